@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,14 +10,43 @@
 #define INFO(...) fprintf(stderr, "[          ] [ INFO ] "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); fflush(stderr)
 
 #define PORT 8080
+#define WATCH_PORT (PORT + 1)   // Observers of a --multi server connect here
 #define BUFFER_SIZE 1024
 
-#define MAX_MOVES 512
-#define MAX_CAPTURED_PIECES 32
+#define MAX_GENERATED_MOVES 256
+#define MOVE_HISTORY_SIZE 64      // Moves unmake_move can take back, as deep as a search goes
+
+#define DEFAULT_HASH_MB 16
 
 #define WHITE_PLAYER 0
 #define BLACK_PLAYER 1
 
+#define PIECE_TYPES 12
+#define PIECE_CHARS "PNBRQKpnbrqk"
+#define PIECE_COLOR(index) ((index) / 6)
+
+#define CASTLE_WHITE_KING 1
+#define CASTLE_WHITE_QUEEN 2
+#define CASTLE_BLACK_KING 4
+#define CASTLE_BLACK_QUEEN 8
+#define NO_SQUARE -1
+
+#define GAME_PLAYING 0
+#define GAME_CHECK 1
+#define GAME_CHECKMATE 2
+#define GAME_STALEMATE 3
+
+#define SQUARE(row, col) ((row) * 8 + (col))
+#define SQUARE_BIT(square) (1ULL << (square))
+#define LSB(bb) __builtin_ctzll(bb)
+#define POPCOUNT(bb) __builtin_popcountll(bb)
+
+#define MOVE_SRC(move) ((move) & 0x3F)
+#define MOVE_DEST(move) (((move) >> 6) & 0x3F)
+#define MOVE_PROMOTION(move) (((move) >> 12) & 0x7)   // 0 if none, then 1 to 4 for knight, bishop, rook and queen
+#define PROMOTION_QUEEN 4
+#define MOVE_TEXT_SIZE 6                              // Holds the text of move_to_text, as "e7e8q", with its '\0'
+
 #define MOVE_SUS 2
 #define MOVE_OUT_OF_TURN 3
 #define MOVE_NOTHING 4
@@ -24,12 +54,66 @@
 #define MOVE_WRONG 6
 #define MOVE_NOT_A_PAWN 7
 #define MOVE_MISSING_PROMOTION 8
+#define MOVE_KING_IN_CHECK 10
 
 #define PARSE_MOVE_INVALID_FORMAT 20
 #define PARSE_MOVE_INVALID_DESTINATION 21
 #define PARSE_MOVE_OUT_OF_BOUNDS 22
 #define PARSE_MOVE_INVALID_PROMOTION 23
 
+#define BOARD_TEXT_SIZE 224  // Holds the text of render_chessboard, with its '\0'
+#define BOARD_DIFF_SIZE 32   // Holds the text of render_last_move, with its '\0'
+
+#define FEN_MAX_LENGTH 128   // Holds any FEN chessboard_to_fen writes, with its '\0'
+#define FEN_INVALID_BOARD 30
+#define FEN_INVALID_SIDE 31
+#define FEN_INVALID_CASTLING 32
+#define FEN_INVALID_EN_PASSANT 33
+#define FEN_INVALID_COUNTER 34
+#define FEN_TRAILING_TEXT 35
+#define FEN_BUFFER_TOO_SMALL 36
+
+#define WIRE_TEXT 0
+#define WIRE_BINARY 1
+
+#define FRAME_HEADER_SIZE 2
+#define FRAME_MAX_PAYLOAD BUFFER_SIZE
+#define FRAME_DECODER_SIZE (2 * (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD))
+#define FRAME_MOVE 1
+#define FRAME_FORFEIT 2
+#define FRAME_NONE 3
+#define FRAME_TEXT 4
+
+#define DATABASE_TEXT 0
+#define DATABASE_BINARY 1
+
+#define DATABASE_RECORD_MAX (2 * BUFFER_SIZE)
+
+#define FSYNC_NONE 0
+#define FSYNC_BATCH 1
+#define FSYNC_INTERVAL 2
+#define DEFAULT_FSYNC_INTERVAL_MS 50
+
+#define POSITION_MAGIC "CHESSPOS"
+#define POSITION_VERSION 1
+#define POSITION_HEADER_SIZE 16
+#define POSITION_RECORD_SIZE 64
+#define POSITION_USERNAME_SIZE 22
+
+#define JOURNAL_SNAPSHOT_INTERVAL 64
+
+#define BOOK_MAGIC "CHESSBOK"
+#define BOOK_VERSION 1
+#define BOOK_HEADER_SIZE 32
+#define BOOK_ENTRY_SIZE 16
+#define DEFAULT_BOOK_PLIES 16
+
+#define TABLEBASE_ENDINGS 5
+#define TABLEBASE_UNKNOWN -1
+#define TABLEBASE_LOSS 0
+#define TABLEBASE_DRAW 1
+#define TABLEBASE_WIN 2
+
 #define COMMAND_MOVE 1001
 #define COMMAND_FORFEIT 1002
 #define COMMAND_GAME 1004
@@ -41,30 +125,292 @@
 #define COMMAND_UNKNOWN 2001
 #define COMMAND_ERROR -1
 
+#define STAT_PARSE_COMMAND 0
+#define STAT_MAKE_MOVE 1          // Moves made with validation, not those of searches
+#define STAT_IS_VALID_MOVE 2
+#define STAT_SAVE_GAME 3
+#define STAT_LOAD_GAME 4
+#define STAT_SEND_MOVE 5
+#define STAT_SEND_FORFEIT 6
+#define STAT_SEND_CHESSBOARD 7
+#define STAT_SEND_IMPORT 8
+#define STAT_SEND_LOAD 9
+#define STAT_SEND_SAVE 10
+#define STAT_SEND_NONE 11
+#define STAT_RECEIVE_MOVE 12
+#define STAT_RECEIVE_FORFEIT 13
+#define STAT_RECEIVE_IMPORT 14
+#define STAT_RECEIVE_LOAD 15
+#define STAT_RECEIVE_NONE 16
+#define STAT_EVENTS 17
+#define STATS_TEXT_SIZE 2048      // Holds the table of stats_format
+#define POOL_ALIGN 64             // Pooled objects start on, and fill whole, cache lines
+#define POOL_MAX 16               // Pools a process may create
+#define POOL_NAME_SIZE 16
+
+#define TRACE_RECEIVED 0          // A command arrived from the other side
+#define TRACE_PARSED 1
+#define TRACE_VALIDATED 2         // A move passed validation
+#define TRACE_APPLIED 3           // A move was made on the board
+#define TRACE_SENT 4
+#define TRACE_REJECTED 5          // A move failed validation, its MOVE_* error in move
+#define TRACE_DROPPED 6           // Events lost to a full ring, their number in game
+#define TRACE_KINDS 7
+#define TRACE_RING_SIZE 4096      // Events per thread, a power of two
+#define TRACE_FLUSH_MS 10         // The flusher drains the rings this often
+#define TRACE_MAGIC "CHSTRACE"
+#define TRACE_VERSION 1
+
+// Compiled in with `make TRACE=1`, otherwise the tracing points cost nothing
+#ifdef CHESS_TRACE
+#define TRACE_EVENT(kind, command, move) trace_event(kind, command, move)
+#define TRACE_MESSAGE(kind, message) trace_message(kind, message)
+#define TRACE_FRAME(kind, frame) trace_frame(kind, frame)
+#define TRACE_GAME(id) trace_set_game(id)
+#else
+#define TRACE_EVENT(kind, command, move) ((void) 0)
+#define TRACE_MESSAGE(kind, message) ((void) 0)
+#define TRACE_FRAME(kind, frame) ((void) 0)
+#define TRACE_GAME(id) ((void) 0)
+#endif
+
+typedef uint64_t Bitboard;   // Bit i is square i, where i = row * 8 + col (a8 = 0, h1 = 63)
+
+typedef uint16_t ChessMove;   // Source square (bits 0-5), destination (6-11) and promotion (12-14); 0 is no move
+
 typedef struct {
-    char startSquare[3];   // Starting location of a piece
-    char endSquare[4];     // Ending location of a piece
-} ChessMove;
+    ChessMove move;         // The move made
+    char captured;          // Piece captured by the move, '.' if none
+    char promoted;          // 1 if the move promoted a pawn
+    char enPassant;         // 1 if the move captured a pawn en passant
+    char castling;          // Castling rights before the move
+    signed char epSquare;   // En passant square before the move
+    int halfmoveClock;      // Halfmove clock before the move
+} MoveUndo;
 
 typedef struct {
-    ChessMove moves[MAX_MOVES];                 // Piece move during gaming
-    char capturedPieces[MAX_CAPTURED_PIECES];   // Piece been captured during gaming
+    MoveUndo history[MOVE_HISTORY_SIZE];        // Last moves and how to take them back, move n at n % MOVE_HISTORY_SIZE
     int moveCount;                              // Count of move
-    int capturedCount;                          // Count of captured pieces
+    int undoCount;                              // Moves in history, at most MOVE_HISTORY_SIZE
     int currentPlayer;
     char chessboard[8][8];
+    Bitboard pieceBB[PIECE_TYPES];              // Occupancy of each piece, indexed by PIECE_CHARS
+    Bitboard colorBB[2];                        // Occupancy of each player
+    Bitboard occupiedBB;                        // Occupancy of all pieces
+    uint64_t hash;                              // Zobrist key of the position
+    int castling;                               // Castling rights still held, CASTLE_* bits
+    int epSquare;                               // Square a pawn of the player to move can capture en passant on, NO_SQUARE if none
+    Bitboard attackBB[2];                       // Squares each player attacks, seeing through the other player's king
+    Bitboard pinnedBB[2];                       // Pieces of each player pinned to their own king
+    Bitboard checkersBB;                        // Pieces giving check to the player to move
+    int halfmoveClock;                          // Plies since the last capture or pawn move
+    int fullmoveNumber;                         // Starts at 1, incremented after each black move
 } ChessGame;
 
+int piece_index(char piece);
+void sync_bitboards(ChessGame* game);
+void update_attacks(ChessGame* game);
+uint64_t compute_hash(const ChessGame* game);
+void init_attack_tables(void);
+Bitboard knight_attacks(int square);
+Bitboard king_attacks(int square);
+Bitboard rook_attacks(int square, Bitboard occupied);
+Bitboard bishop_attacks(int square, Bitboard occupied);
+Bitboard ray_between(int src_row, int src_col, int dest_row, int dest_col);
+int square_attacked(const ChessGame* game, int square, int by);
+
+typedef struct {
+    int depth;                // Maximum search depth in plies, 0 for no limit
+    int movetime;             // Maximum search time in milliseconds, 0 for no limit
+    int threads;              // Number of search threads
+    int hash;                 // Size of the shared transposition table in MB
+    const char* book;         // Opening book played before searching, NULL for none
+    const char* tablebases;   // Directory of endgame tables played instead of searching, NULL for none
+} EngineOptions;
+
+typedef struct {
+    ChessMove best;               // Best move of the last completed iteration
+    int score;                    // Score of the best move in centipawns
+    int depth;                    // Depth of the last completed iteration
+    unsigned long long nodes;     // Nodes searched
+    double seconds;               // Time spent searching
+} SearchResult;
+
+typedef struct {
+    int opcode;                   // FRAME_MOVE, FRAME_FORFEIT, FRAME_NONE or FRAME_TEXT
+    ChessMove move;               // Move of a FRAME_MOVE
+    char text[BUFFER_SIZE];       // Command of a FRAME_TEXT
+    const unsigned char* raw;     // Encoded frame
+    int size;                     // Size of the encoded frame
+} Frame;
+
+typedef struct {
+    unsigned char buffer[FRAME_DECODER_SIZE];
+    int start;                    // First byte not decoded yet
+    int end;                      // End of the bytes read
+} FrameDecoder;
+
+typedef struct {
+    char magic[8];                            // POSITION_MAGIC
+    uint32_t version;                         // POSITION_VERSION
+    uint32_t recordSize;                      // POSITION_RECORD_SIZE
+} PositionHeader;
+
+typedef struct {
+    uint8_t board[32];                        // Square i in nibble i % 2 of byte i / 2: 0 if empty, else 1 + index in PIECE_CHARS
+    uint64_t hash;                            // Zobrist key, checked when the record is read
+    uint8_t side;                             // Player to move
+    uint8_t state;                            // Castling rights in bits 0-3, en passant file + 1 in bits 4-7 (0 if none)
+    char username[POSITION_USERNAME_SIZE];    // Padded with '\0', not terminated at full length
+} PositionRecord;
+_Static_assert(sizeof(PositionRecord) == POSITION_RECORD_SIZE, "Records are read and written at fixed offsets");
+
+typedef struct {
+    uint64_t tsc;                 // stats_clock when it happened
+    uint32_t game;                // Game id, 0 outside a --multi server
+    uint8_t kind;                 // TRACE_*
+    char command;                 // Letter after the '/' of the command, as 'm' for /move
+    uint16_t move;                // ChessMove, or MOVE_* error of TRACE_REJECTED
+} TraceEvent;
+
+typedef struct {
+    char magic[8];                // TRACE_MAGIC
+    uint32_t version;             // TRACE_VERSION
+    uint32_t eventSize;           // sizeof(TraceEvent)
+    double ticksPerNs;            // Clock ticks of tsc per nanosecond
+} TraceHeader;
+
+typedef struct {
+    uint32_t thread;              // Thread the events were recorded on, numbered from 0
+    uint32_t count;               // TraceEvent records following
+} TraceChunk;
+
+typedef struct Pool Pool;
+
+typedef struct {
+    char name[POOL_NAME_SIZE];
+    unsigned long long objectSize;    // Bytes per object, a multiple of POOL_ALIGN
+    unsigned long long allocations;
+    unsigned long long frees;
+    unsigned long long created;       // Objects ever handed out fresh from a slab; the rest were reused
+    unsigned long long slabs;
+    unsigned long long bytes;         // Taken from malloc, never given back
+} PoolStats;
+
+typedef struct DbWriter DbWriter;
+
+typedef struct {
+    unsigned long long saves;     // Records committed
+    unsigned long long batches;   // Writes to the database
+    unsigned long long syncs;     // fdatasync calls
+    unsigned long long bytes;     // Bytes written
+    double p50Us;                 // Median commit latency in microseconds
+    double p99Us;                 // 99th percentile commit latency in microseconds
+    double maxUs;                 // Highest commit latency in microseconds
+} DbWriterStats;
+
+typedef struct {
+    int fd;                       // Journal file, open for appending
+    char dir[BUFFER_SIZE];        // Directory of the journal files
+    unsigned long id;             // Game id, names the journal file
+    int moves;                    // Moves journaled since the last snapshot
+} GameJournal;
+
+typedef struct {
+    void (*move)(uint64_t hash, const ChessMove* move, int ply, void* context);   // Each valid move and the hash of the position it is made in, or NULL
+    void (*game)(const ChessGame* game, int valid, void* context);               // Each game in its final position, or NULL
+    void* context;
+} PgnHandler;
+
+typedef struct {
+    char magic[8];                // BOOK_MAGIC
+    uint32_t version;             // BOOK_VERSION
+    uint32_t entrySize;           // BOOK_ENTRY_SIZE
+    uint64_t startHash;           // Hash of the standard position when built, so books of other hash keys are refused
+    uint64_t entries;             // Number of entries after the header
+} BookHeader;
+
+typedef struct {
+    uint64_t hash;                // Zobrist key of the position
+    uint16_t move;                // ChessMove
+    uint16_t weight;              // Times the move was played, at most UINT16_MAX
+    uint32_t reserved;
+} BookEntry;
+
+typedef struct {
+    const BookEntry* entries;     // Sorted by hash, mapped from the book file
+    long count;
+    void* map;
+    size_t size;                  // Bytes mapped
+} OpeningBook;
+
+typedef struct {
+    long positions;               // Legal positions in the table
+    long wins;                    // Positions won by the player to move
+    long draws;
+    long losses;
+    int maxPlies;                 // Longest distance to mate
+    long bytes;                   // Size of the file
+    double seconds;               // Time spent building
+} TablebaseStats;
+
+size_t render_chessboard(char out[], const ChessGame* game);
+size_t render_last_move(char out[], const ChessGame* game);
 void display_chessboard(const ChessGame* game);
+void display_last_move(const ChessGame* game);
+int game_status(const ChessGame* game);
+void display_status(const ChessGame* game);
 int initialize_game(ChessGame* game);
-void chessboard_to_fen(char fen[], const ChessGame* game);
-void fen_to_chessboard(const char* fen, ChessGame* game);
+int chessboard_to_fen(char fen[], size_t size, const ChessGame* game);
+int fen_to_chessboard(const char* fen, ChessGame* game);
 int parse_move(const char* str, ChessMove* move);
+void set_move(ChessMove* move, int src, int dest, char promotion);
+char* move_to_text(ChessMove move, char text[]);
+int parse_san(const ChessGame* game, const char* san, ChessMove* move);
+int generate_moves(const ChessGame* game, ChessMove* out);
 int make_move(ChessGame* game, const ChessMove* move, int is_client, int validate_move);
+int unmake_move(ChessGame* game);
 int send_command(ChessGame* game, const char* message, int socketfd, int is_client);
 int receive_command(ChessGame* game, const char* message, int socketfd, int is_client);
+void set_save_on_server(int on);
 int save_game(const ChessGame* game, const char* username, const char* db_filename);
 int load_game(ChessGame* game, const char* username, const char* db_filename, int save_number);
+int database_format(int fd);
+int write_position_header(FILE* file);
+int pack_position(const ChessGame* game, const char* username, PositionRecord* record);
+int unpack_position(const PositionRecord* record, ChessGame* game, char* username);
+int read_position(const char* db_filename, long n, ChessGame* game, char* username);
+int format_record(const ChessGame* game, const char* username, int format, char* out);
+int update_database_index(const char* db_filename);
+long convert_database(const char* from, const char* to, long* skipped);
+DbWriter* db_writer_open(const char* db_filename, int fsync_policy, int interval_ms);
+long long db_writer_submit(DbWriter* writer, const ChessGame* game, const char* username);
+int db_writer_wait(DbWriter* writer, long long ticket);
+int db_writer_save(DbWriter* writer, const ChessGame* game, const char* username);
+void db_writer_stats(DbWriter* writer, DbWriterStats* stats);
+int db_writer_close(DbWriter* writer);
+int parse_fsync_policy(const char* name);
+long read_pgn(const char* text, size_t length, ChessGame* game, const PgnHandler* handler);
+size_t pgn_boundary(const char* text, size_t length);
+
+int book_open(OpeningBook* book, const char* path);
+int book_probe(const OpeningBook* book, const ChessGame* game, ChessMove* move);
+void book_close(OpeningBook* book);
+long build_book(const char* pgn_filename, const char* book_filename, int max_plies, int min_weight);
+
+int generate_tablebase(const char* name, const char* dir, int threads, TablebaseStats* stats);
+int tablebase_open(const char* dir);
+void tablebase_close(void);
+int tablebase_probe(const ChessGame* game, int* plies);
+int tablebase_move(const ChessGame* game, ChessMove* move, int* plies);
+
+int journal_open(GameJournal* journal, const char* dir, unsigned long id, const ChessGame* game);
+int journal_snapshot(GameJournal* journal, const ChessGame* game);
+int journal_append_move(GameJournal* journal, const ChessGame* game, const ChessMove* move);
+void journal_close(GameJournal* journal, int finished);
+int journal_replay(const char* path, ChessGame* game, int* entries, int* torn);
+int journal_recover(const char* path, ChessGame* game);
+long journal_recover_all(const char* dir, void (*recovered)(unsigned long id, ChessGame* game, void* context), void* context);
 
 int is_valid_pawn_move(char piece, int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game);
 int is_valid_rook_move(int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game);
@@ -73,3 +419,42 @@ int is_valid_bishop_move(int src_row, int src_col, int dest_row, int dest_col, c
 int is_valid_queen_move(int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game);
 int is_valid_king_move(int src_row, int src_col, int dest_row, int dest_col);
 int is_valid_move(char piece, int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game);
+
+int evaluate(const ChessGame* game);
+int tt_resize(int size_mb);
+void tt_clear(void);
+int engine_search(ChessGame* game, const EngineOptions* options, SearchResult* result);
+int engine_command(ChessGame* game, const EngineOptions* options, char* message);
+int parse_engine_options(int argc, char* argv[], EngineOptions* options);
+
+void set_wire_protocol(int protocol);
+int get_wire_protocol(void);
+int encode_frame(const char* message, unsigned char* out);
+int decode_frame(const unsigned char* data, int size, Frame* frame);
+void frame_to_message(const Frame* frame, char* message);
+void frame_decoder_init(FrameDecoder* decoder);
+int frame_decoder_read(FrameDecoder* decoder, int socketfd);
+int frame_decoder_next(FrameDecoder* decoder, Frame* frame);
+int transmit(int socketfd, const char* message);
+int receive_message(int socketfd, FrameDecoder* decoder, char* message);
+
+int run_multi_server(int port, int fsync_policy, const char* journal_dir);
+
+uint64_t stats_clock(void);
+void stats_record(int event, uint64_t start);
+size_t stats_format(char* out, size_t size, int json);
+void stats_dump_on_exit(const char* path);
+double stats_ticks_per_ns(void);
+
+Pool* pool_create(const char* name, size_t object_size);
+void* pool_alloc(Pool* pool);
+void pool_free(Pool* pool, void* object);
+int pool_list(PoolStats* out);
+
+int trace_start(const char* path);
+void trace_stop(void);
+void trace_set_game(unsigned long id);
+void trace_event(int kind, int command, uint16_t move);
+void trace_message(int kind, const char* message);
+void trace_frame(int kind, const Frame* frame);
+long trace_dump(const char* path, FILE* out, long game);
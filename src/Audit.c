@@ -0,0 +1,358 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Resources.h"
+
+/*
+ * Audit of the game database and the move journals of --multi games, on all cores.
+ * The database is memory-mapped and cut into chunks on record boundaries; each thread takes
+ * chunks in turn and checks every record with its own ChessGame. Records are positions, so
+ * they are checked for states no game can reach. Journals hold moves, so each is replayed
+ * through make_move with validation, and the position it ends in is checked the same way.
+ */
+
+#define AUDIT_CHUNK_SIZE (4 << 20)
+#define AUDIT_MAX_THREADS 64
+#define AUDIT_EXAMPLES 5          // Problems listed for each kind, the others are only counted
+#define AUDIT_DEFAULT_DB "../src/game_database.txt"
+#define AUDIT_DEFAULT_JOURNAL "journal"
+#define AUDIT_BACK_RANKS 0xFF000000000000FFULL   // Rows 0 and 7
+
+// Problems found in records and journals
+#define AUDIT_UNREADABLE 0        // Not a record, or a corrupt one
+#define AUDIT_KINGS 1             // Not exactly one king of each color
+#define AUDIT_PAWN_RANK 2         // Pawn on the first or last rank
+#define AUDIT_TOO_MANY 3          // More than 16 pieces or 8 pawns of a color
+#define AUDIT_CAPTURABLE_KING 4   // The side that just moved left its king attacked
+#define AUDIT_REJECTED_MOVE 5     // Journal move make_move does not accept
+#define AUDIT_TORN_ENTRY 6        // Journal ends in the middle of an entry
+#define AUDIT_KINDS 7
+
+static const char* kind_names[AUDIT_KINDS] = {
+    "unreadable", "king count", "pawn on back rank", "too many pieces",
+    "king left in check", "rejected move", "torn journal entry"
+};
+
+typedef struct {
+    long where[AUDIT_EXAMPLES];   // Record number in the chunk, or journal id
+    int count;
+} Examples;
+
+typedef struct {
+    long begin;                   // Byte range of the chunk in the database
+    long end;
+    long records;
+    long problems[AUDIT_KINDS];
+    Examples examples[AUDIT_KINDS];
+} AuditChunk;
+
+typedef struct {
+    const char* data;             // Mapped database
+    int format;
+    AuditChunk* chunks;
+    int chunkCount;
+    char (*journals)[NAME_MAX + 1];
+    int journalCount;
+    const char* journalDir;
+    long journalMoves;
+    long journalProblems[AUDIT_KINDS];
+    Examples journalExamples[AUDIT_KINDS];
+    int next;                     // Next chunk, then next journal, to take
+    pthread_mutex_t lock;
+} Audit;
+
+static double elapsed(const struct timespec* begin) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static void add_problem(long* problems, Examples* examples, int kind, long where) {
+    problems[kind]++;
+    if (examples[kind].count < AUDIT_EXAMPLES)
+        examples[kind].where[examples[kind].count++] = where;
+}
+
+/*
+ * @brief Find the first state of a position that no sequence of valid moves reaches.
+ *
+ * @return An AUDIT_ problem, -1 if the position looks reachable.
+ */
+static int position_problem(const ChessGame* game) {
+    for (int color = WHITE_PLAYER; color <= BLACK_PLAYER; ++color) {
+        const Bitboard* pieces = game->pieceBB + 6 * color;
+        if (1 != __builtin_popcountll(pieces[5]))
+            return AUDIT_KINGS;
+        if (__builtin_popcountll(game->colorBB[color]) > 16 || __builtin_popcountll(pieces[0]) > 8)
+            return AUDIT_TOO_MANY;
+    }
+    if ((game->pieceBB[0] | game->pieceBB[6]) & AUDIT_BACK_RANKS)
+        return AUDIT_PAWN_RANK;
+    int moved = !game->currentPlayer;
+    if (square_attacked(game, LSB(game->pieceBB[6 * moved + 5]), game->currentPlayer))
+        return AUDIT_CAPTURABLE_KING;
+    return -1;
+}
+
+/*
+ * @brief Check the "username:FEN" lines of a chunk of a text database.
+ */
+static void audit_text(const Audit* audit, AuditChunk* chunk, ChessGame* game) {
+    char fen[BUFFER_SIZE];
+    const char* line = audit->data + chunk->begin;
+    const char* end = audit->data + chunk->end;
+    while (line < end) {
+        const char* next = memchr(line, '\n', end - line);
+        next = NULL == next ? end : next + 1;
+        const char* stop = next > line && '\n' == next[-1] ? next - 1 : next;
+        const char* colon = memchr(line, ':', stop - line);
+        size_t length = NULL == colon ? 0 : stop - colon - 1;
+        int problem = AUDIT_UNREADABLE;
+        if (NULL != colon && length < sizeof(fen)) {
+            memcpy(fen, colon + 1, length);
+            fen[length] = '\0';
+            if (0 == fen_to_chessboard(fen, game))
+                problem = position_problem(game);
+        }
+        if (problem >= 0)
+            add_problem(chunk->problems, chunk->examples, problem, chunk->records);
+        chunk->records++;
+        line = next;
+    }
+}
+
+/*
+ * @brief Check the records of a chunk of a binary database.
+ */
+static void audit_binary(const Audit* audit, AuditChunk* chunk, ChessGame* game) {
+    PositionRecord record;
+    for (long offset = chunk->begin; offset + POSITION_RECORD_SIZE <= chunk->end; offset += POSITION_RECORD_SIZE) {
+        memcpy(&record, audit->data + offset, sizeof(record));
+        int problem = 0 == unpack_position(&record, game, NULL) ? position_problem(game) : AUDIT_UNREADABLE;
+        if (problem >= 0)
+            add_problem(chunk->problems, chunk->examples, problem, chunk->records);
+        chunk->records++;
+    }
+}
+
+/*
+ * @brief Replay a journal and check the position it ends in.
+ */
+static void audit_journal(Audit* audit, const char* name, ChessGame* game) {
+    char path[BUFFER_SIZE];
+    unsigned long id = 0;
+    int entries = 0, torn = 0, problem = -1;
+    sscanf(name, "game-%lu.jnl", &id);
+    snprintf(path, sizeof(path), "%s/%s", audit->journalDir, name);
+    int moves = journal_replay(path, game, &entries, &torn);
+    if (moves < 0)
+        problem = AUDIT_UNREADABLE;
+    else if (moves < entries)
+        problem = AUDIT_REJECTED_MOVE;
+    else if (torn)
+        problem = AUDIT_TORN_ENTRY;
+    else
+        problem = position_problem(game);
+
+    pthread_mutex_lock(&audit->lock);
+    audit->journalMoves += moves > 0 ? moves : 0;
+    if (problem >= 0)
+        add_problem(audit->journalProblems, audit->journalExamples, problem, (long) id);
+    pthread_mutex_unlock(&audit->lock);
+}
+
+/*
+ * @brief Thread: audit chunks of the database, then journals, until none is left.
+ */
+static void* auditor(void* arg) {
+    Audit* audit = arg;
+    ChessGame* game = malloc(sizeof(ChessGame));
+    if (NULL == game)
+        return NULL;
+    while (1) {
+        pthread_mutex_lock(&audit->lock);
+        int next = audit->next++;
+        pthread_mutex_unlock(&audit->lock);
+        if (next < audit->chunkCount) {
+            AuditChunk* chunk = &audit->chunks[next];
+            if (DATABASE_BINARY == audit->format)
+                audit_binary(audit, chunk, game);
+            else
+                audit_text(audit, chunk, game);
+        } else if (next < audit->chunkCount + audit->journalCount) {
+            audit_journal(audit, audit->journals[next - audit->chunkCount], game);
+        } else {
+            break;
+        }
+    }
+    free(game);
+    return NULL;
+}
+
+/*
+ * @brief Cut the mapped database into chunks of about AUDIT_CHUNK_SIZE bytes, each ending on a record boundary.
+ *
+ * @return Number of chunks, -1 if out of memory.
+ */
+static int split_database(Audit* audit, long size) {
+    long first = DATABASE_BINARY == audit->format ? POSITION_HEADER_SIZE : 0;
+    int count = (int) ((size - first) / AUDIT_CHUNK_SIZE + 1);
+    audit->chunks = calloc(count, sizeof(AuditChunk));
+    if (NULL == audit->chunks)
+        return -1;
+    long begin = first;
+    for (int i = 0; i < count; ++i) {
+        long end = i + 1 == count ? size : begin + AUDIT_CHUNK_SIZE;
+        if (end > size)   // Earlier chunks were stretched to whole lines
+            end = size;
+        if (begin >= size) {   // They already reached the end, this chunk is empty
+            begin = end = size;
+        } else if (end < size) {
+            if (DATABASE_BINARY == audit->format) {
+                end -= (end - first) % POSITION_RECORD_SIZE;
+            } else {
+                const char* newline = memchr(audit->data + end, '\n', size - end);
+                end = NULL == newline ? size : newline - audit->data + 1;
+            }
+        }
+        audit->chunks[i].begin = begin;
+        audit->chunks[i].end = end;
+        begin = end;
+    }
+    return count;
+}
+
+/*
+ * @brief List the journals of a directory. A missing directory has none.
+ *
+ * @return Number of journals, -1 if the directory cannot be read.
+ */
+static int list_journals(Audit* audit) {
+    DIR* directory = opendir(audit->journalDir);
+    if (NULL == directory)
+        return ENOENT == errno ? 0 : -1;
+    int count = 0, capacity = 0;
+    struct dirent* entry;
+    unsigned long id;
+    char suffix[8];
+    while (NULL != (entry = readdir(directory))) {
+        if (2 != sscanf(entry->d_name, "game-%lu.%7s", &id, suffix) || 0 != strcmp(suffix, "jnl"))
+            continue;
+        if (count == capacity) {
+            capacity = 0 == capacity ? 64 : 2 * capacity;
+            void* journals = realloc(audit->journals, capacity * sizeof(*audit->journals));
+            if (NULL == journals) {
+                closedir(directory);
+                return -1;
+            }
+            audit->journals = journals;
+        }
+        strcpy(audit->journals[count++], entry->d_name);
+    }
+    closedir(directory);
+    return count;
+}
+
+static void print_problems(const char* what, const long* problems, const Examples* examples) {
+    for (int kind = 0; kind < AUDIT_KINDS; ++kind) {
+        if (0 == problems[kind])
+            continue;
+        fprintf(stdout, "  %s %s: %ld (", what, kind_names[kind], problems[kind]);
+        for (int i = 0; i < examples[kind].count; ++i)
+            fprintf(stdout, "%s%ld", i > 0 ? ", " : "", examples[kind].where[i]);
+        fprintf(stdout, "%s)\n", problems[kind] > examples[kind].count ? ", ..." : "");
+    }
+}
+
+/*
+ * @brief Usage: audit [--db PATH] [--journal DIR] [--threads N]
+ * @details Check every record of a game database and replay every journal of a --multi server,
+ * then report the problems found: records by number (from 0) and journals by game id.
+ * Exits with 1 if any problem is found, 2 if the files cannot be read.
+ */
+int main(int argc, char* argv[]) {
+    const char* db_filename = AUDIT_DEFAULT_DB;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    Audit audit = { .journalDir = AUDIT_DEFAULT_JOURNAL };
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--db") && i + 1 < argc) {
+            db_filename = argv[++i];
+        } else if (0 == strcmp(argv[i], "--journal") && i + 1 < argc) {
+            audit.journalDir = argv[++i];
+        } else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atol(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--db PATH] [--journal DIR] [--threads N]\n", argv[0]);
+            return 2;
+        }
+    }
+    threads = threads < 1 ? 1 : (threads > AUDIT_MAX_THREADS ? AUDIT_MAX_THREADS : threads);
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int fd = open(db_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || 0 != fstat(fd, &st) || (audit.format = database_format(fd)) < 0) {
+        fprintf(stderr, "Cannot read the game database %s.\n", db_filename);
+        return 2;
+    }
+    long size = (long) st.st_size;
+    void* data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (MAP_FAILED == data) {
+        fprintf(stderr, "Cannot map the game database %s.\n", db_filename);
+        return 2;
+    }
+    if (NULL != data)
+        madvise(data, size, MADV_SEQUENTIAL);
+    audit.data = data;
+    audit.chunkCount = split_database(&audit, size);
+    audit.journalCount = list_journals(&audit);
+    if (audit.chunkCount < 0 || audit.journalCount < 0) {
+        fprintf(stderr, "Cannot read the journals in %s.\n", audit.journalDir);
+        return 2;
+    }
+    pthread_mutex_init(&audit.lock, NULL);
+
+    pthread_t workers[AUDIT_MAX_THREADS];
+    for (long i = 0; i < threads; ++i)
+        pthread_create(&workers[i], NULL, auditor, &audit);
+    for (long i = 0; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+    double seconds = elapsed(&begin);
+
+    // Merge the chunks in file order, turning record numbers in a chunk into numbers in the database
+    long records = 0, problems[AUDIT_KINDS] = { 0 }, total = 0;
+    Examples examples[AUDIT_KINDS] = { { { 0 }, 0 } };
+    for (int i = 0; i < audit.chunkCount; ++i) {
+        const AuditChunk* chunk = &audit.chunks[i];
+        for (int kind = 0; kind < AUDIT_KINDS; ++kind) {
+            problems[kind] += chunk->problems[kind];
+            for (int j = 0; j < chunk->examples[kind].count && examples[kind].count < AUDIT_EXAMPLES; ++j)
+                examples[kind].where[examples[kind].count++] = records + chunk->examples[kind].where[j];
+        }
+        records += chunk->records;
+    }
+    for (int kind = 0; kind < AUDIT_KINDS; ++kind)
+        total += problems[kind] + audit.journalProblems[kind];
+
+    fprintf(stdout, "%s: %ld %s records, %.1f MB\n", db_filename, records,
+            DATABASE_BINARY == audit.format ? "binary" : "text", size / 1e6);
+    print_problems("record", problems, examples);
+    fprintf(stdout, "%s: %d journals, %ld moves replayed\n", audit.journalDir, audit.journalCount, audit.journalMoves);
+    print_problems("journal", audit.journalProblems, audit.journalExamples);
+    fprintf(stdout, "%ld problems, %ld threads, %.3f s, %.0f records/s, %.1f MB/s, %.0f journals/s\n",
+            total, threads, seconds, records / seconds, size / 1e6 / seconds, audit.journalCount / seconds);
+
+    if (NULL != data)
+        munmap(data, size);
+    free(audit.chunks);
+    free(audit.journals);
+    pthread_mutex_destroy(&audit.lock);
+    return 0 == total ? EXIT_SUCCESS : EXIT_FAILURE;
+}
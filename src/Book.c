@@ -0,0 +1,234 @@
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Resources.h"
+
+/*
+ * An opening book is a BookHeader followed by BookEntry records sorted by position hash, all
+ * little-endian. It is mapped read-only, so every process using a book shares the pages of the
+ * page cache and nothing is parsed at startup; a probe is a binary search of the entries.
+ */
+
+#define BOOK_INITIAL_MOVES (1 << 16)
+
+typedef struct {
+    BookEntry* entries;           // Moves collected, merged by compact_entries
+    long count;
+    long capacity;
+    int maxPlies;
+} BookBuilder;
+
+/**
+ * @brief Map an opening book file.
+ *
+ * @return 0 on success, -1 if it cannot be read, is not a book, or was built with other hash keys.
+ */
+int book_open(OpeningBook* book, const char* path) {
+    memset(book, 0, sizeof(*book));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (0 == fstat(fd, &st) && st.st_size >= BOOK_HEADER_SIZE)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+        return -1;
+
+    const BookHeader* header = map;
+    ChessGame* start = malloc(sizeof(ChessGame));
+    uint64_t entries = le64toh(header->entries);
+    int valid = NULL != start && 0 == memcmp(header->magic, BOOK_MAGIC, sizeof(header->magic))
+            && BOOK_VERSION == le32toh(header->version) && BOOK_ENTRY_SIZE == le32toh(header->entrySize)
+            && entries <= (st.st_size - BOOK_HEADER_SIZE) / BOOK_ENTRY_SIZE;
+    if (valid) {
+        initialize_game(start);
+        valid = start->hash == le64toh(header->startHash);
+    }
+    free(start);
+    if (!valid) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    book->map = map;
+    book->size = st.st_size;
+    book->entries = (const BookEntry*) ((const char*) map + BOOK_HEADER_SIZE);
+    book->count = (long) entries;
+    return 0;
+}
+
+/**
+ * @brief Pick a book move for the current position, at random in proportion to the weights of its moves.
+ * @details A move is only returned if it moves a piece of the current player and does not capture
+ * one of its own, in case another position has the same hash.
+ *
+ * @return 0 if a move was found, -1 if the position is not in the book.
+ */
+int book_probe(const OpeningBook* book, const ChessGame* game, ChessMove* move) {
+    long low = 0, high = book->count;   // First entry of the position, by binary search
+    while (low < high) {
+        long middle = low + (high - low) / 2;
+        if (le64toh(book->entries[middle].hash) < game->hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    long total = 0, end = low;
+    for (; end < book->count && le64toh(book->entries[end].hash) == game->hash; ++end)
+        total += le16toh(book->entries[end].weight);
+    if (0 == total)
+        return -1;
+
+    long pick = rand() % total;
+    for (long i = low; i < end; ++i) {
+        pick -= le16toh(book->entries[i].weight);
+        if (pick < 0) {
+            *move = le16toh(book->entries[i].move);
+            Bitboard own = game->colorBB[game->currentPlayer];
+            return (own & SQUARE_BIT(MOVE_SRC(*move))) && !(own & SQUARE_BIT(MOVE_DEST(*move))) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Unmap an opening book.
+ */
+void book_close(OpeningBook* book) {
+    if (book->map)
+        munmap(book->map, book->size);
+    memset(book, 0, sizeof(*book));
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const BookEntry* x = a;
+    const BookEntry* y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return (int) x->move - (int) y->move;
+}
+
+/*
+ * @brief Sort the entries and merge those of the same position and move, adding their weights.
+ */
+static void compact_entries(BookBuilder* builder) {
+    qsort(builder->entries, builder->count, sizeof(BookEntry), compare_entries);
+    long count = 0;
+    for (long i = 0; i < builder->count; ++i) {
+        BookEntry* last = builder->entries + count - (count > 0);
+        if (count > 0 && last->hash == builder->entries[i].hash && last->move == builder->entries[i].move) {
+            long weight = (long) last->weight + builder->entries[i].weight;
+            last->weight = weight > UINT16_MAX ? UINT16_MAX : (uint16_t) weight;
+        } else {
+            builder->entries[count++] = builder->entries[i];
+        }
+    }
+    builder->count = count;
+}
+
+/*
+ * @brief Collect a move of the first plies of a game. When the entries are full they are merged,
+ * and only grown if merging does not free a quarter of them.
+ */
+static void collect_move(uint64_t hash, const ChessMove* move, int ply, void* context) {
+    BookBuilder* builder = context;
+    if (ply > builder->maxPlies || builder->capacity < 0)
+        return;
+    if (builder->count == builder->capacity) {
+        compact_entries(builder);
+        if (builder->count > builder->capacity / 4 * 3) {
+            BookEntry* entries = realloc(builder->entries, 2 * builder->capacity * sizeof(BookEntry));
+            if (NULL == entries) {
+                builder->capacity = -1;   // Out of memory, reported when the book is written
+                return;
+            }
+            builder->entries = entries;
+            builder->capacity *= 2;
+        }
+    }
+    BookEntry* entry = &builder->entries[builder->count++];
+    entry->hash = hash;
+    entry->move = *move;
+    entry->weight = 1;
+    entry->reserved = 0;
+}
+
+/**
+ * @brief Build an opening book from the moves of PGN games.
+ * @details Every valid move of the first max_plies plies of each game becomes an entry of the
+ * position it is played in, weighted by the number of games that play it. The book is written to a
+ * temporary file renamed over book_filename, so processes mapping the old book keep a whole file.
+ *
+ * @param min_weight Moves played in fewer games are left out.
+ * @return Number of entries written, -1 on failure.
+ */
+long build_book(const char* pgn_filename, const char* book_filename, int max_plies, int min_weight) {
+    int fd = open(pgn_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || 0 != fstat(fd, &st)) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    const char* text = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (MAP_FAILED == text)
+        return -1;
+    if (st.st_size > 0)
+        madvise((void*) text, st.st_size, MADV_SEQUENTIAL);
+
+    BookBuilder builder = { malloc(BOOK_INITIAL_MOVES * sizeof(BookEntry)), 0, BOOK_INITIAL_MOVES, max_plies };
+    ChessGame* game = malloc(sizeof(ChessGame));
+    PgnHandler handler = { collect_move, NULL, &builder };
+    if (NULL != builder.entries && NULL != game)
+        read_pgn(text, st.st_size, game, &handler);
+    if (st.st_size > 0)
+        munmap((void*) text, st.st_size);
+    free(game);
+    if (NULL == builder.entries || NULL == game || builder.capacity < 0) {
+        free(builder.entries);
+        return -1;
+    }
+    compact_entries(&builder);
+
+    long count = 0;
+    for (long i = 0; i < builder.count; ++i) {   // Drop rare moves and convert to file order
+        if (builder.entries[i].weight < min_weight)
+            continue;
+        BookEntry* entry = &builder.entries[count++];
+        entry->hash = htole64(builder.entries[i].hash);
+        entry->move = htole16(builder.entries[i].move);
+        entry->weight = htole16(builder.entries[i].weight);
+        entry->reserved = 0;
+    }
+
+    BookHeader header;
+    ChessGame* start = malloc(sizeof(ChessGame));
+    if (NULL == start) {
+        free(builder.entries);
+        return -1;
+    }
+    initialize_game(start);
+    memcpy(header.magic, BOOK_MAGIC, sizeof(header.magic));
+    header.version = htole32(BOOK_VERSION);
+    header.entrySize = htole32(BOOK_ENTRY_SIZE);
+    header.startHash = htole64(start->hash);
+    header.entries = htole64((uint64_t) count);
+    free(start);
+
+    char temp[BUFFER_SIZE];
+    snprintf(temp, sizeof(temp), "%s.tmp", book_filename);
+    FILE* out = fopen(temp, "w");
+    int ok = NULL != out && 1 == fwrite(&header, sizeof(header), 1, out)
+            && (0 == count || 1 == fwrite(builder.entries, count * sizeof(BookEntry), 1, out));
+    if (NULL != out && 0 != fclose(out))
+        ok = 0;
+    free(builder.entries);
+    if (!ok || 0 != rename(temp, book_filename)) {
+        unlink(temp);
+        return -1;
+    }
+    return count;
+}
@@ -0,0 +1,60 @@
+#include <time.h>
+#include "Resources.h"
+
+#define PROBE_ROUNDS 1000000
+
+/*
+ * @brief Usage: bookbuild <games.pgn> <book> [--plies N] [--min N]
+ * @details Build an opening book from the first N plies (default DEFAULT_BOOK_PLIES) of PGN games,
+ * keeping moves played in at least --min games, then time a probe of the standard position.
+ * Engines play from the book with `--engine book=<book>`.
+ */
+int main(int argc, char* argv[]) {
+    int plies = DEFAULT_BOOK_PLIES, min_weight = 1;
+    int usage = argc < 3;
+    for (int i = 3; i < argc && !usage; ++i) {
+        if (0 == strcmp(argv[i], "--plies") && i + 1 < argc)
+            plies = atoi(argv[++i]);
+        else if (0 == strcmp(argv[i], "--min") && i + 1 < argc)
+            min_weight = atoi(argv[++i]);
+        else
+            usage = 1;
+    }
+    if (usage || plies <= 0 || min_weight <= 0) {
+        fprintf(stderr, "Usage: %s <games.pgn> <book> [--plies N] [--min N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    long count = build_book(argv[1], argv[2], plies, min_weight);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (count < 0) {
+        fprintf(stderr, "Failed to build %s from %s.\n", argv[2], argv[1]);
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "Wrote %ld entries in %.2f s.\n", count,
+            (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9);
+
+    OpeningBook book;
+    ChessGame* game = malloc(sizeof(ChessGame));
+    ChessMove move;
+    if (NULL == game || 0 != book_open(&book, argv[2])) {
+        fprintf(stderr, "Cannot open %s.\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    initialize_game(game);
+    int found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < PROBE_ROUNDS; ++i)
+        found += 0 == book_probe(&book, game, &move);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (found > 0)
+        fprintf(stdout, "Start position: %d of %d probes found a move, %.0f ns per probe.\n", found, PROBE_ROUNDS,
+                ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / PROBE_ROUNDS);
+    else
+        fprintf(stdout, "Start position is not in the book.\n");
+    book_close(&book);
+    free(game);
+    return EXIT_SUCCESS;
+}
@@ -6,8 +6,12 @@
 #include <sys/socket.h>
 #include "Resources.h"
 
-int main() {
-    ChessGame game;
+/*
+ * @brief Connect to the server on this machine.
+ *
+ * @return The socket; exits on failure.
+ */
+static int connect_server(int port) {
     int connfd = 0;
     struct sockaddr_in serv_addr;
 
@@ -18,7 +22,7 @@ int main() {
     }
 
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
+    serv_addr.sin_port = htons(port);
     if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
         perror("Invalid address/ Address not supported");
         exit(EXIT_FAILURE);
@@ -28,55 +32,169 @@ int main() {
         perror("connect failed");
         exit(EXIT_FAILURE);
     }
+    return connfd;
+}
+
+/*
+ * @brief Follow a game of a --multi server as an observer, until it ends.
+ * @details Observers always receive binary frames: the position first, then each command of the players.
+ *
+ * @param id Game id, or "" for the newest game.
+ */
+static int watch_game(const char* id) {
+    int connfd = connect_server(WATCH_PORT);
+    char buffer[BUFFER_SIZE];
+    ChessGame game;
+    FrameDecoder decoder;
+    initialize_game(&game);
+    frame_decoder_init(&decoder);
+    set_wire_protocol(WIRE_BINARY);
+    snprintf(buffer, sizeof(buffer), "%s%s%s", "/watch", '\0' == *id ? "" : " ", id);
+    transmit(connfd, buffer);
+    while (receive_message(connfd, &decoder, buffer) > 0) {
+        int command = receive_command(&game, buffer, connfd, 1);
+        if (COMMAND_FORFEIT == command) {
+            fprintf(stdout, "[Observer] The game is over.\n");
+            return 0;
+        }
+        fprintf(stdout, "[Observer] %s\n", buffer);
+        if (COMMAND_IMPORT == command || COMMAND_LOAD == command) {
+            display_chessboard(&game);
+        } else if (COMMAND_MOVE == command) {
+            display_last_move(&game);
+            display_status(&game);
+        }
+    }
+    fprintf(stdout, "[Observer] Disconnected.\n");
+    close(connfd);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // --black plays black against a white client, through a server run with --multi
+    // --binary uses framed binary messages instead of raw text
+    // --resume rejoins a game a --multi server recovered after a restart
+    // --diff shows the squares each move changes
+    // --watch[=ID] follows a game of a --multi server as an observer
+    // --server-save sends /save to a --multi server, which saves the game; --black and --resume imply it
+    // --stats=FILE writes the command latencies to FILE as JSON on exit
+    // --trace=FILE records the flow of commands to FILE, in a build with `make TRACE=1`
+    int black = 0, resume = 0, diff = 0, flags = 1;
+    const char* watch = NULL;
+    for (; flags < argc && 0 != strcmp(argv[flags], "--engine"); ++flags) {
+        if (0 == strcmp(argv[flags], "--black"))
+            black = 1;
+        else if (0 == strcmp(argv[flags], "--binary"))
+            set_wire_protocol(WIRE_BINARY);
+        else if (0 == strcmp(argv[flags], "--resume"))
+            resume = 1;
+        else if (0 == strcmp(argv[flags], "--server-save"))
+            set_save_on_server(1);
+        else if (0 == strcmp(argv[flags], "--diff"))
+            diff = 1;
+        else if (0 == strncmp(argv[flags], "--watch", 7) && ('\0' == argv[flags][7] || '=' == argv[flags][7]))
+            watch = argv[flags] + 7 + ('=' == argv[flags][7]);
+        else if (0 == strncmp(argv[flags], "--stats=", 8) && '\0' != argv[flags][8])
+            stats_dump_on_exit(argv[flags] + 8);
+        else if (0 == strncmp(argv[flags], "--trace=", 8) && '\0' != argv[flags][8] && 0 == trace_start(argv[flags] + 8))
+            continue;
+        else
+            break;
+    }
+    if (black || resume)   // Only a --multi server seats black or resumes games
+        set_save_on_server(1);
+    int is_client = !black;
+    int color = black ? BLACK_PLAYER : WHITE_PLAYER;
+
+    EngineOptions options;
+    int engine = parse_engine_options(argc - flags + 1, argv + flags - 1, &options);
+    if (engine < 0) {
+        fprintf(stderr, "Usage: %s [--black] [--binary] [--resume] [--server-save] [--diff] [--watch[=ID]] [--stats=FILE] [--trace=FILE] [--engine [depth=N] [movetime=ms] [threads=N] [hash=MB] [book=PATH] [tablebases=DIR]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (watch)
+        return watch_game(watch);
+
+    ChessGame game;
+    int connfd = connect_server(PORT);
 
     initialize_game(&game);
-    display_chessboard(&game);
 
     char buffer[BUFFER_SIZE];
-    int server_command, client_command;
-    while (1) {
+    FrameDecoder decoder;
+    frame_decoder_init(&decoder);
+    int server_command = 0, client_command;
+    int waiting = black;   // Black waits for the first move of white
+    if (resume) {
+        // The server sends the recovered position first; it comes from the server, so either color takes it
+        if (receive_message(connfd, &decoder, buffer) <= 0 || COMMAND_IMPORT != receive_command(&game, buffer, connfd, 1)) {
+            fprintf(stderr, "No game to resume.\n");
+            close(connfd);
+            exit(EXIT_FAILURE);
+        }
+        waiting = game.currentPlayer != color;
+    }
+    display_chessboard(&game);
+    while (COMMAND_FORFEIT != server_command) {
         // Client enter
-        while (1) {
-            fprintf(stdout, "[Client] Enter message: ");
-            memset(buffer, 0, BUFFER_SIZE);
-            fgets(buffer, BUFFER_SIZE, stdin);
-            buffer[strlen(buffer)-1] = '\0';
-            fprintf(stdout, "\n");
+        while (!waiting) {
+            if (engine) {
+                engine_command(&game, &options, buffer);
+                fprintf(stdout, "[Client] Engine plays: %s\n", buffer);
+            } else {
+                fprintf(stdout, "[Client] Enter message: ");
+                memset(buffer, 0, BUFFER_SIZE);
+                fgets(buffer, BUFFER_SIZE, stdin);
+                buffer[strlen(buffer)-1] = '\0';
+                fprintf(stdout, "\n");
+            }
 
             // Send command
-            client_command = send_command(&game, buffer, connfd, 1);
+            client_command = send_command(&game, buffer, connfd, is_client);
             if (COMMAND_UNKNOWN == client_command || COMMAND_ERROR == client_command) {
                 fprintf(stdout, "[Client] Bad command. Enter again.\n");
             } else if (COMMAND_FORFEIT == client_command) {
                 FILE *temp = fopen("./fen.txt", "w");
-                char fen[200];
-                chessboard_to_fen(fen, &game);
+                char fen[FEN_MAX_LENGTH];
+                chessboard_to_fen(fen, sizeof(fen), &game);
                 fprintf(temp, "%s", fen);
                 fclose(temp);
                 close(connfd);
                 return 0;
             } else if (COMMAND_DISPLAY != client_command && COMMAND_SAVE != client_command) { 
+                if (COMMAND_MOVE == client_command) {
+                    if (diff)
+                        display_last_move(&game);
+                    display_status(&game);
+                }
                 break;
             } 
         }
 
+        waiting = 0;
+
         // Read from server
         while (1) {
-            memset(buffer, 0, BUFFER_SIZE);
-            if (read(connfd, buffer, BUFFER_SIZE) < 0) {
+            if (receive_message(connfd, &decoder, buffer) <= 0) {
                 fprintf(stdout, "[Client] Read error\n");
+                server_command = COMMAND_FORFEIT;
                 break;
             }
 
             // Receive command
-            server_command = receive_command(&game, buffer, connfd, 1);
+            server_command = receive_command(&game, buffer, connfd, is_client);
             if (COMMAND_NONE != server_command) {
                 fprintf(stdout, "[Client] Server enter: %s\n", buffer);
-                    if (COMMAND_FORFEIT == server_command)
-                        break;
-                if (COMMAND_LOAD == server_command && game.currentPlayer != WHITE_PLAYER) {
+                if (COMMAND_MOVE == server_command) {
+                    if (diff)
+                        display_last_move(&game);
+                    display_status(&game);
+                }
+                if (COMMAND_FORFEIT == server_command)
+                    break;
+                if (COMMAND_LOAD == server_command && game.currentPlayer != color) {
                     fprintf(stdout, "[Client] Current player is server. Switch control to server.\n");
-                    send_command(&game, "/none", connfd, 1);
+                    send_command(&game, "/none", connfd, is_client);
                 } else {
                     break;
                 }
@@ -89,8 +207,8 @@ int main() {
 
     // Save the game in current directory
     FILE *temp = fopen("./fen.txt", "w");
-    char fen[200];
-    chessboard_to_fen(fen, &game);
+    char fen[FEN_MAX_LENGTH];
+    chessboard_to_fen(fen, sizeof(fen), &game);
     fprintf(temp, "%s", fen);
     fclose(temp);
     close(connfd);
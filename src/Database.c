@@ -0,0 +1,526 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Resources.h"
+
+/*
+ * The game database is a file of records: "username:FEN" lines, or the fixed-size
+ * records of Position.c once converted. Next to it, "<database>.idx" holds an open-addressed
+ * hash table so /load reads one record instead of the whole file:
+ *   key (username, n)  ->  byte offset of the n-th save of username, n >= 1
+ *   key (username, 0)  ->  number of saves of username
+ * The header records how many bytes of the database are indexed. Records appended by another
+ * writer are indexed the next time the index is opened, and a database that shrank is indexed
+ * again from scratch. The index file is locked with flock while it is used.
+ */
+
+#define INDEX_MAGIC "CHESSIDX"
+#define INDEX_MIN_BUCKETS 1024
+
+typedef struct {
+    char magic[8];
+    uint64_t dbSize;    // Bytes of the database indexed
+    uint64_t buckets;   // Number of buckets, a power of 2
+    uint64_t entries;   // Buckets in use
+} IndexHeader;
+
+typedef struct {
+    uint64_t key;       // 0 if the bucket is empty
+    uint64_t value;     // Record offset, or save count for a key (username, 0)
+} IndexBucket;
+
+typedef struct {
+    int fd;
+    IndexHeader* header;
+    IndexBucket* buckets;
+    size_t mapSize;
+} DbIndex;
+
+/*
+ * @brief Verify if the username is valid.
+ * @details Username should not contain white spaces, ':' (which ends it in a text record)
+ * or control characters such as '\n', so it can never split or forge a record. It fits the
+ * POSITION_USERNAME_SIZE bytes of a binary record.
+ *
+ * @return 1 if username valid.
+ */
+int username_valid(const char* username) {
+    if (NULL == username)
+        return 0;
+    int length = (int) strnlen(username, POSITION_USERNAME_SIZE + 1);
+    if (0 == length || length > POSITION_USERNAME_SIZE)
+        return 0;
+    for (int i = 0; i < length; ++i) {
+        if (' ' == username[i] || ':' == username[i] || iscntrl((unsigned char) username[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * @brief Parse the username from a line.
+ * @details Username is located in the beginning of the line,
+ * and ended with a ':'.
+ */
+void get_username(char* username, const char* line) {
+    memset(username, 0, BUFFER_SIZE);
+    int index = 0;
+    while (':' != *line) {
+        username[index] = *line;
+        index++;
+        line++;
+    }
+    username[index] = '\0';
+}
+
+/*
+ * @brief Parse a FEN string from a line.
+ * @details FEN string is located in the end of line,
+ * and started after a ':'.
+ */
+void get_fen(char* fen, const char* line) {
+    while (':' != *line) line++;
+    int index = 0;
+    line++;
+    while ('\0' != *line) {
+        fen[index] = *line;
+        index++;
+        line++;
+    }
+    fen[index] = '\0';
+}
+
+/*
+ * @brief FNV-1a hash of the first length bytes of a username.
+ */
+static uint64_t username_hash(const char* username, size_t length) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char) username[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/*
+ * @brief Index key of the save_number-th save of a user, or of its save count if save_number is 0.
+ */
+static uint64_t index_key(uint64_t user_hash, uint64_t save_number) {
+    uint64_t key = user_hash ^ (save_number * 0x9E3779B97F4A7C15ULL);
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+    key ^= key >> 31;
+    return 0 == key ? 1 : key;
+}
+
+static void index_unmap(DbIndex* index) {
+    if (NULL != index->header)
+        munmap(index->header, index->mapSize);
+    index->header = NULL;
+    index->buckets = NULL;
+}
+
+/*
+ * @brief Map the index file.
+ * @details With buckets 0 the existing table is mapped; otherwise the file is resized to
+ * an empty table of that many buckets.
+ *
+ * @return 0 on success, -1 if the file is not a valid index or cannot be mapped.
+ */
+static int index_map(DbIndex* index, uint64_t buckets) {
+    IndexHeader header;
+    struct stat st;
+    int create = 0 != buckets;
+    index_unmap(index);
+    if (!create) {
+        if (0 != fstat(index->fd, &st) || sizeof(header) != pread(index->fd, &header, sizeof(header), 0))
+            return -1;
+        if (0 != memcmp(header.magic, INDEX_MAGIC, 8) || 0 == header.buckets
+                || 0 != (header.buckets & (header.buckets - 1))
+                || (uint64_t) st.st_size != sizeof(header) + header.buckets * sizeof(IndexBucket))
+            return -1;
+        buckets = header.buckets;
+    }
+    size_t size = sizeof(IndexHeader) + buckets * sizeof(IndexBucket);
+    if (create && 0 != ftruncate(index->fd, (off_t) size))
+        return -1;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0);
+    if (MAP_FAILED == map)
+        return -1;
+    index->header = map;
+    index->buckets = (IndexBucket*) (index->header + 1);
+    index->mapSize = size;
+    if (create) {
+        memset(map, 0, size);
+        memcpy(index->header->magic, INDEX_MAGIC, 8);
+        index->header->buckets = buckets;
+    }
+    return 0;
+}
+
+/*
+ * @brief Store a key in the first free bucket of its probe sequence.
+ * @details With replace, a bucket holding the same key is overwritten instead. Record keys are
+ * never replaced: two users may share a key, and load_game tells them apart by the record.
+ * The table doubles once it is half full.
+ *
+ * @return 0 on success, -1 if the table could not grow.
+ */
+static int index_put(DbIndex* index, uint64_t key, uint64_t value, int replace) {
+    if (2 * (index->header->entries + 1) > index->header->buckets) {
+        uint64_t old_buckets = index->header->buckets;
+        IndexHeader header = *index->header;
+        IndexBucket* old = malloc(old_buckets * sizeof(IndexBucket));
+        if (NULL == old)
+            return -1;
+        memcpy(old, index->buckets, old_buckets * sizeof(IndexBucket));
+        if (0 != index_map(index, 2 * old_buckets)) {
+            free(old);
+            return -1;
+        }
+        for (uint64_t i = 0; i < old_buckets; ++i) {
+            if (0 != old[i].key)
+                index_put(index, old[i].key, old[i].value, 0);
+        }
+        index->header->dbSize = header.dbSize;   // Until here the index reads as empty
+        free(old);
+    }
+
+    uint64_t mask = index->header->buckets - 1;
+    uint64_t i = key & mask;
+    while (0 != index->buckets[i].key) {
+        if (replace && key == index->buckets[i].key) {
+            index->buckets[i].value = value;
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    index->buckets[i].key = key;
+    index->buckets[i].value = value;
+    index->header->entries++;
+    return 0;
+}
+
+/*
+ * @brief Look up the value of a key, 0 if absent. Only used for keys that are never duplicated.
+ */
+static uint64_t index_get(const DbIndex* index, uint64_t key) {
+    uint64_t mask = index->header->buckets - 1;
+    for (uint64_t i = key & mask; 0 != index->buckets[i].key; i = (i + 1) & mask) {
+        if (key == index->buckets[i].key)
+            return index->buckets[i].value;
+    }
+    return 0;
+}
+
+static off_t database_size(const char* db_filename) {
+    struct stat st;
+    return 0 == stat(db_filename, &st) ? st.st_size : 0;
+}
+
+/*
+ * @brief Add the next save of a user, stored at offset, to the index.
+ */
+static int index_record(DbIndex* index, const char* username, size_t length, uint64_t offset) {
+    uint64_t user = username_hash(username, length);
+    uint64_t count = index_get(index, index_key(user, 0)) + 1;
+    if (0 != index_put(index, index_key(user, count), offset, 0))
+        return -1;
+    return index_put(index, index_key(user, 0), count, 1);
+}
+
+/*
+ * @brief Index the text lines from the current position of db.
+ * @details A last line without '\n' is still being written, and is left for later.
+ */
+static int index_text(DbIndex* index, FILE* db) {
+    char line[BUFFER_SIZE];
+    off_t offset = ftello(db);
+    while (NULL != fgets(line, BUFFER_SIZE, db)) {
+        size_t length = strlen(line);
+        if ('\n' != line[length - 1]) {
+            if (feof(db))
+                break;
+            int c;   // Longer than any record load_game reads, skip it
+            while (EOF != (c = fgetc(db)) && '\n' != c);
+            if (EOF == c)
+                break;
+        } else {
+            char* colon = strchr(line, ':');
+            if (NULL != colon && 0 != index_record(index, line, colon - line, (uint64_t) offset))
+                return -1;
+        }
+        offset = ftello(db);
+        index->header->dbSize = (uint64_t) offset;
+    }
+    return 0;
+}
+
+/*
+ * @brief Index the binary records from the current position of db. A partial last record is left for later.
+ */
+static int index_binary(DbIndex* index, FILE* db) {
+    PositionRecord record;
+    uint64_t offset = (uint64_t) ftello(db);
+    while (1 == fread(&record, sizeof(record), 1, db)) {
+        if (0 != index_record(index, record.username, strnlen(record.username, POSITION_USERNAME_SIZE), offset))
+            return -1;
+        offset += sizeof(record);
+        index->header->dbSize = offset;
+    }
+    return 0;
+}
+
+/*
+ * @brief Index the records of the database past the indexed bytes. The index must be locked exclusively.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int index_update(DbIndex* index, const char* db_filename) {
+    off_t size = database_size(db_filename);
+    if ((uint64_t) size == index->header->dbSize)
+        return 0;
+    if (0 == index->header->dbSize || (uint64_t) size < index->header->dbSize) {   // Index from scratch
+        memset(index->buckets, 0, index->header->buckets * sizeof(IndexBucket));
+        index->header->entries = 0;
+        index->header->dbSize = 0;
+    }
+
+    FILE* db = fopen(db_filename, "r");
+    if (!db)
+        return -1;
+    int format = database_format(fileno(db));
+    off_t start = (off_t) index->header->dbSize;
+    if (DATABASE_BINARY == format && start < POSITION_HEADER_SIZE)
+        start = POSITION_HEADER_SIZE;
+    int ret = -1;
+    if (format >= 0 && 0 == fseeko(db, start, SEEK_SET))
+        ret = DATABASE_BINARY == format ? index_binary(index, db) : index_text(index, db);
+    fclose(db);
+    return ret;
+}
+
+static void index_close(DbIndex* index) {
+    index_unmap(index);
+    close(index->fd);   // Also releases the lock
+}
+
+/*
+ * @brief Open, lock and map the index of a database, indexing any new lines first.
+ * @details A reader takes a shared lock, and only locks exclusively if the index has to be updated.
+ *
+ * @return 0 on success, -1 if the index cannot be used.
+ */
+static int index_open(DbIndex* index, const char* db_filename, int exclusive) {
+    char path[BUFFER_SIZE];
+    if (snprintf(path, sizeof(path), "%s.idx", db_filename) >= (int) sizeof(path))
+        return -1;
+    index->header = NULL;
+    index->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (index->fd < 0)
+        return -1;
+
+    if (!exclusive) {
+        if (0 != flock(index->fd, LOCK_SH)) {
+            index_close(index);
+            return -1;
+        }
+        if (0 == index_map(index, 0) && index->header->dbSize == (uint64_t) database_size(db_filename))
+            return 0;
+    }
+    if (0 != flock(index->fd, LOCK_EX)
+            || (0 != index_map(index, 0) && 0 != index_map(index, INDEX_MIN_BUCKETS))
+            || 0 != index_update(index, db_filename)) {
+        index_close(index);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief Read one record of a database into a game if it belongs to the user.
+ *
+ * @return 0 if loaded, 1 if the record belongs to another user, -1 on failure.
+ */
+static int read_record(int fd, int format, uint64_t offset, const char* username, ChessGame* game) {
+    size_t length = strlen(username);
+    if (DATABASE_BINARY == format) {
+        PositionRecord record;
+        if (sizeof(record) != pread(fd, &record, sizeof(record), (off_t) offset))
+            return -1;
+        if (length > POSITION_USERNAME_SIZE || 0 != strncmp(record.username, username, POSITION_USERNAME_SIZE))
+            return 1;
+        return unpack_position(&record, game, NULL);
+    }
+
+    char line[BUFFER_SIZE], fen[BUFFER_SIZE];
+    ssize_t n = pread(fd, line, BUFFER_SIZE - 1, (off_t) offset);
+    if (n <= 0)
+        return -1;
+    line[n] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+    if (0 != strncmp(line, username, length) || ':' != line[length])
+        return 1;
+    get_fen(fen, line);
+    return 0 == fen_to_chessboard(fen, game) ? 0 : -1;
+}
+
+/*
+ * @brief Load the save_number-th save of a user with the index.
+ *
+ * @return 0 if found, -1 otherwise.
+ */
+static int index_find(const DbIndex* index, const char* db_filename, const char* username, int save_number, ChessGame* game) {
+    uint64_t key = index_key(username_hash(username, strlen(username)), (uint64_t) save_number);
+    uint64_t mask = index->header->buckets - 1;
+    int fd = open(db_filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    int format = database_format(fd);
+    int ret = -1;
+    for (uint64_t i = key & mask; format >= 0 && 0 != index->buckets[i].key; i = (i + 1) & mask) {
+        if (key != index->buckets[i].key)
+            continue;
+        ret = read_record(fd, format, index->buckets[i].value, username, game);
+        if (ret <= 0)
+            break;
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Write the record of a save in a database format.
+ *
+ * @param out Buffer of at least DATABASE_RECORD_MAX bytes.
+ * @return Size of the record, -1 if the username cannot be saved in that format.
+ */
+int format_record(const ChessGame* game, const char* username, int format, char* out) {
+    if (!username_valid(username) || format < 0)
+        return -1;
+    if (DATABASE_BINARY == format)
+        return 0 == pack_position(game, username, (PositionRecord*) out) ? POSITION_RECORD_SIZE : -1;
+    char fen[FEN_MAX_LENGTH];
+    if (0 != chessboard_to_fen(fen, sizeof(fen), game))
+        return -1;
+    int length = snprintf(out, DATABASE_RECORD_MAX, "%s:%s\n", username, fen);
+    return length < DATABASE_RECORD_MAX ? length : -1;
+}
+
+/**
+ * @brief Save the game state and username in a given file.
+ * @details The record is written in the format of the file, text unless the file
+ * was converted to binary records. The index of the file is updated with it.
+ *
+ * @return 0 if saved game success, -1 otherwise.
+ */
+int save_game(const ChessGame* game, const char* username, const char* db_filename) {
+    if (!username_valid(username))
+        return -1;
+
+    uint64_t begin = stats_clock();
+    DbIndex index;
+    int indexed = 0 == index_open(&index, db_filename, 1);   // Also keeps other savers out
+    FILE *db = fopen(db_filename, "a+");
+    int ret = -1;
+    if (db) {
+        char record[DATABASE_RECORD_MAX];
+        int length = format_record(game, username, database_format(fileno(db)), record);
+        if (length > 0 && 1 == fwrite(record, length, 1, db))
+            ret = 0;
+        if (0 != fclose(db))
+            ret = -1;
+    }
+    if (indexed) {
+        index_update(&index, db_filename);
+        index_close(&index);
+    }
+    stats_record(STAT_SAVE_GAME, begin);
+    return ret;
+}
+
+/**
+ * @brief Index the records appended to a database since its index was last updated.
+ *
+ * @return 0 on success, -1 if the index cannot be used.
+ */
+int update_database_index(const char* db_filename) {
+    DbIndex index;
+    if (0 != index_open(&index, db_filename, 1))
+        return -1;
+    index_close(&index);
+    return 0;
+}
+
+/*
+ * @brief Find the save_number-th save of a user by reading the whole file.
+ * @details Used when the index cannot be opened, e.g. in a read-only directory.
+ */
+static int scan_game(ChessGame* game, const char* username, const char* db_filename, int save_number) {
+    FILE *db = fopen(db_filename, "r");
+    if (!db)
+        return -1;
+
+    int count = 0;
+    int format = database_format(fileno(db));
+    if (DATABASE_BINARY == format) {
+        PositionRecord record;
+        fseeko(db, POSITION_HEADER_SIZE, SEEK_SET);
+        while (count < save_number && 1 == fread(&record, sizeof(record), 1, db)) {
+            if (0 == strncmp(record.username, username, POSITION_USERNAME_SIZE)
+                    && strlen(username) <= POSITION_USERNAME_SIZE && ++count == save_number
+                    && 0 != unpack_position(&record, game, NULL))
+                count = 0;
+        }
+        fclose(db);
+        return count == save_number ? 0 : -1;
+    }
+
+    char line[BUFFER_SIZE], last_line[BUFFER_SIZE], u_name[BUFFER_SIZE];
+    while (DATABASE_TEXT == format && NULL != fgets(line, BUFFER_SIZE, db)) {
+        line[strlen(line)-1] = '\0';
+        get_username(u_name, line);
+        if (0 == strcmp(username, u_name)) {   // Match username
+            memset(last_line, 0, BUFFER_SIZE);
+            strcpy(last_line, line);           // Hold the last line data
+            count++;
+            if (count == save_number)          // Match save number
+                break;
+        }
+        memset(line, 0, BUFFER_SIZE);
+    }
+    fclose(db);
+    if (count != save_number)
+        return -1;
+
+    char fen[BUFFER_SIZE];
+    get_fen(fen, last_line);
+    return 0 == fen_to_chessboard(fen, game) ? 0 : -1;
+}
+
+/**
+ * @brief Load the game state from a given file.
+ * @details The record is located with the index of the file, so only that record is read.
+ *
+ * @param save_number The number of game state
+ * @return 0 if loaded success, -1 otherwise.
+ */
+int load_game(ChessGame* game, const char* username, const char* db_filename, int save_number) {
+    if (save_number <= 0 || !username_valid(username))
+        return -1;
+
+    uint64_t begin = stats_clock();
+    DbIndex index;
+    int ret;
+    if (0 == index_open(&index, db_filename, 0)) {
+        ret = index_find(&index, db_filename, username, save_number, game);
+        index_close(&index);
+    } else {
+        ret = scan_game(game, username, db_filename, save_number);
+    }
+    stats_record(STAT_LOAD_GAME, begin);
+    return ret;
+}
@@ -0,0 +1,135 @@
+#include <sys/stat.h>
+#include <time.h>
+#include "Resources.h"
+
+#define BENCH_USERS 100
+#define BENCH_LOADS 20000
+
+static double elapsed(const struct timespec* begin) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static long file_size(const char* filename) {
+    struct stat st;
+    return 0 == stat(filename, &st) ? (long) st.st_size : 0;
+}
+
+/*
+ * @brief Write a text database of positions from random games, record i saved by user i % BENCH_USERS.
+ */
+static int write_positions(const char* filename, long records) {
+    FILE* db = fopen(filename, "w");
+    if (!db)
+        return -1;
+    ChessGame game;
+    ChessMove moves[MAX_GENERATED_MOVES];
+    char fen[FEN_MAX_LENGTH];
+    initialize_game(&game);
+    srand(1);
+    for (long i = 0; i < records; ++i) {
+        int count = generate_moves(&game, moves);
+        if (0 == count || game.moveCount >= 200)
+            initialize_game(&game);
+        else
+            make_move(&game, &moves[rand() % count], WHITE_PLAYER == game.currentPlayer, 0);
+        chessboard_to_fen(fen, sizeof(fen), &game);
+        fprintf(db, "player%ld:%s\n", i % BENCH_USERS, fen);
+    }
+    return fclose(db);
+}
+
+/*
+ * @brief Read every record of a text database the way load_game does: split the line, parse the FEN.
+ */
+static long read_text(const char* filename) {
+    FILE* db = fopen(filename, "r");
+    if (!db)
+        return 0;
+    long count = 0;
+    char line[BUFFER_SIZE];
+    ChessGame game;
+    while (NULL != fgets(line, BUFFER_SIZE, db)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* colon = strchr(line, ':');
+        if (NULL == colon)
+            continue;
+        fen_to_chessboard(colon + 1, &game);
+        count++;
+    }
+    fclose(db);
+    return count;
+}
+
+/*
+ * @brief Read every record of a binary database.
+ */
+static long read_binary(const char* filename) {
+    FILE* db = fopen(filename, "r");
+    if (!db)
+        return 0;
+    long count = 0;
+    PositionRecord record;
+    ChessGame game;
+    fseeko(db, POSITION_HEADER_SIZE, SEEK_SET);
+    while (1 == fread(&record, sizeof(record), 1, db)) {
+        if (0 == unpack_position(&record, &game, NULL))
+            count++;
+    }
+    fclose(db);
+    return count;
+}
+
+/*
+ * @brief Time BENCH_LOADS random /load calls; the index is built before timing.
+ */
+static double time_loads(const char* filename, long records) {
+    ChessGame game;
+    load_game(&game, "player0", filename, 1);
+    srand(2);
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < BENCH_LOADS; ++i) {
+        long record = rand() % records;
+        char username[32];
+        sprintf(username, "player%ld", record % BENCH_USERS);
+        if (0 != load_game(&game, username, filename, (int) (record / BENCH_USERS) + 1))
+            fprintf(stderr, "Failed to load record %ld of %s\n", record, filename);
+    }
+    return elapsed(&begin);
+}
+
+/*
+ * @brief Usage: dbbench [records]
+ * @details Write a database of positions in the text format and convert it to binary records,
+ * then compare the two formats: file size, sequential load throughput and random /load latency.
+ */
+int main(int argc, char* argv[]) {
+    long records = argc > 1 ? atol(argv[1]) : 200000;
+    if (records <= 0) {
+        fprintf(stderr, "Usage: %s [records]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* text = "play/bench_db.txt";
+    const char* binary = "play/bench_db.bin";
+    long skipped;
+    if (0 != write_positions(text, records) || records != convert_database(text, binary, &skipped)) {
+        fprintf(stderr, "Failed to write the benchmark databases.\n");
+        return EXIT_FAILURE;
+    }
+    remove("play/bench_db.txt.idx");
+
+    const char* names[2] = { "text", "binary" };
+    const char* files[2] = { text, binary };
+    for (int i = 0; i < 2; ++i) {
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        long count = 0 == i ? read_text(files[i]) : read_binary(files[i]);
+        double seconds = elapsed(&begin);
+        double loads = time_loads(files[i], records);
+        fprintf(stdout, "%-6s  size %10ld bytes  sequential %10.0f records/s  random /load %7.2f us\n",
+                names[i], file_size(files[i]), seconds > 0 ? count / seconds : 0.0, loads / BENCH_LOADS * 1e6);
+    }
+    return EXIT_SUCCESS;
+}
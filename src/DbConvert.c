@@ -0,0 +1,21 @@
+#include "Resources.h"
+
+/*
+ * @brief Usage: dbconvert <from> <to>
+ * @details Convert a game database of "username:FEN" lines to binary position records,
+ * or binary position records back to text. The format of <from> is detected from its header.
+ */
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <from> <to>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long skipped;
+    long count = convert_database(argv[1], argv[2], &skipped);
+    if (count < 0) {
+        fprintf(stderr, "Failed to convert %s to %s.\n", argv[1], argv[2]);
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "Converted %ld records, skipped %ld.\n", count, skipped);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include "Resources.h"
+
+/*
+ * Group commit: sessions format their record and append it to the filling batch, then a single
+ * writer thread swaps batches and writes the whole batch with one write() on a database it keeps
+ * open. A save is committed once its batch is written, and synced too with FSYNC_BATCH.
+ * Records are only written whole by one thread, so they never interleave.
+ */
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    uint64_t* times;     // Submit time of each record, in nanoseconds
+    size_t count;
+    size_t timesCapacity;
+} Batch;
+
+struct DbWriter {
+    char filename[BUFFER_SIZE];
+    int fd;
+    int format;                        // DATABASE_TEXT or DATABASE_BINARY
+    int policy;                        // FSYNC_NONE, FSYNC_BATCH or FSYNC_INTERVAL
+    uint64_t intervalNs;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;               // Signaled when a record is submitted or on close
+    pthread_cond_t done;               // Broadcast when a batch is committed
+    Batch batches[2];
+    int filling;                       // Batch records are submitted to
+    long long submitted;               // Ticket of the last submitted record
+    long long committed;               // Ticket of the last committed record
+    int failed;                        // A write failed, later saves are not trusted
+    int stop;
+    int dirty;                         // Written since the last sync, writer thread only
+    uint64_t lastSync;                 // Writer thread only
+    DbWriterStats stats;
+    uint64_t histogram[LATENCY_BUCKETS];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * @brief Log-linear histogram bucket: 16 sub-buckets per power of 2, about 6% precision.
+ */
+static int latency_bucket(uint64_t ns) {
+    if (ns < (1 << LATENCY_SUB_BITS))
+        return (int) ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    int shift = exponent - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) | (int) ((ns >> shift) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+/*
+ * @brief Lowest latency in nanoseconds counted in a bucket.
+ */
+static uint64_t bucket_value(int bucket) {
+    if (bucket < (1 << LATENCY_SUB_BITS))
+        return (uint64_t) bucket;
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t mantissa = (1 << LATENCY_SUB_BITS) | (bucket & ((1 << LATENCY_SUB_BITS) - 1));
+    return mantissa << shift;
+}
+
+static double percentile_us(const uint64_t* histogram, unsigned long long total, double fraction) {
+    unsigned long long rank = (unsigned long long) (fraction * total);
+    unsigned long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += histogram[i];
+        if (seen > rank)
+            return bucket_value(i) / 1e3;
+    }
+    return 0;
+}
+
+/*
+ * @brief Append a record to a batch, growing it as needed.
+ */
+static int batch_append(Batch* batch, const char* record, size_t length, uint64_t time) {
+    if (batch->length + length > batch->capacity) {
+        size_t capacity = batch->capacity ? 2 * batch->capacity : 64 * DATABASE_RECORD_MAX;
+        while (capacity < batch->length + length)
+            capacity *= 2;
+        char* data = realloc(batch->data, capacity);
+        if (NULL == data)
+            return -1;
+        batch->data = data;
+        batch->capacity = capacity;
+    }
+    if (batch->count == batch->timesCapacity) {
+        size_t capacity = batch->timesCapacity ? 2 * batch->timesCapacity : 256;
+        uint64_t* times = realloc(batch->times, capacity * sizeof(uint64_t));
+        if (NULL == times)
+            return -1;
+        batch->times = times;
+        batch->timesCapacity = capacity;
+    }
+    memcpy(batch->data + batch->length, record, length);
+    batch->length += length;
+    batch->times[batch->count++] = time;
+    return 0;
+}
+
+static int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+        data += n;
+        length -= (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * @brief Sync the database if the policy asks for it now. Called by the writer thread only.
+ *
+ * @return 1 if synced, 0 if not needed, -1 on failure.
+ */
+static int sync_database(DbWriter* writer, int force) {
+    if (FSYNC_NONE == writer->policy || !writer->dirty)
+        return 0;
+    uint64_t now = now_ns();
+    if (!force && FSYNC_INTERVAL == writer->policy && now - writer->lastSync < writer->intervalNs)
+        return 0;
+    writer->dirty = 0;
+    writer->lastSync = now;
+    return 0 == fdatasync(writer->fd) ? 1 : -1;
+}
+
+/*
+ * @brief Write a batch with one write(), sync per policy and index it. Called without the lock.
+ *
+ * @return As sync_database.
+ */
+static int commit_batch(DbWriter* writer, const Batch* batch) {
+    if (0 != write_all(writer->fd, batch->data, batch->length))
+        return -1;
+    writer->dirty = 1;
+    int ret = sync_database(writer, FSYNC_BATCH == writer->policy);
+    update_database_index(writer->filename);
+    return ret;
+}
+
+static void* writer_thread(void* arg) {
+    DbWriter* writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        Batch* batch = &writer->batches[writer->filling];
+        if (0 == batch->count) {
+            if (writer->stop)
+                break;
+            if (FSYNC_INTERVAL == writer->policy && writer->dirty) {
+                uint64_t deadline = writer->lastSync + writer->intervalNs;
+                struct timespec until = { (time_t) (deadline / 1000000000ULL), (long) (deadline % 1000000000ULL) };
+                if (ETIMEDOUT == pthread_cond_timedwait(&writer->work, &writer->lock, &until)) {
+                    pthread_mutex_unlock(&writer->lock);
+                    int ret = sync_database(writer, 1);
+                    pthread_mutex_lock(&writer->lock);
+                    writer->stats.syncs += ret > 0;
+                    writer->failed |= ret < 0;
+                }
+            } else {
+                pthread_cond_wait(&writer->work, &writer->lock);
+            }
+            continue;
+        }
+
+        writer->filling = !writer->filling;   // Sessions keep submitting to the other batch
+        long long last = writer->submitted;
+        pthread_mutex_unlock(&writer->lock);
+        int ret = commit_batch(writer, batch);
+        uint64_t now = now_ns();
+        pthread_mutex_lock(&writer->lock);
+
+        for (size_t i = 0; i < batch->count; ++i) {
+            uint64_t latency = now - batch->times[i];
+            writer->histogram[latency_bucket(latency)]++;
+            if (latency / 1e3 > writer->stats.maxUs)
+                writer->stats.maxUs = latency / 1e3;
+        }
+        writer->stats.saves += batch->count;
+        writer->stats.batches++;
+        writer->stats.bytes += batch->length;
+        writer->stats.syncs += ret > 0;
+        if (ret < 0)
+            writer->failed = 1;
+        writer->committed = last;
+        batch->length = batch->count = 0;
+        pthread_cond_broadcast(&writer->done);
+    }
+    int ret = sync_database(writer, 1);
+    writer->stats.syncs += ret > 0;
+    writer->failed |= ret < 0;
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/**
+ * @brief Parse a fsync policy name: none, batch or interval.
+ *
+ * @return FSYNC_NONE, FSYNC_BATCH or FSYNC_INTERVAL, -1 if unknown.
+ */
+int parse_fsync_policy(const char* name) {
+    if (0 == strcmp(name, "none"))
+        return FSYNC_NONE;
+    if (0 == strcmp(name, "batch"))
+        return FSYNC_BATCH;
+    if (0 == strcmp(name, "interval"))
+        return FSYNC_INTERVAL;
+    return -1;
+}
+
+/**
+ * @brief Open a database for group commits and start its writer thread.
+ * @details Records are written in the format the database already has, text if it is new.
+ *
+ * @param fsync_policy FSYNC_NONE: never sync. FSYNC_BATCH: a save is committed once its batch is
+ * synced. FSYNC_INTERVAL: a save is committed once written, and synced within interval_ms.
+ * @return The writer, NULL on failure.
+ */
+DbWriter* db_writer_open(const char* db_filename, int fsync_policy, int interval_ms) {
+    if (fsync_policy < FSYNC_NONE || fsync_policy > FSYNC_INTERVAL || strlen(db_filename) >= BUFFER_SIZE)
+        return NULL;
+    DbWriter* writer = calloc(1, sizeof(DbWriter));
+    if (NULL == writer)
+        return NULL;
+    strcpy(writer->filename, db_filename);
+    writer->policy = fsync_policy;
+    writer->intervalNs = (uint64_t) (interval_ms > 0 ? interval_ms : DEFAULT_FSYNC_INTERVAL_MS) * 1000000ULL;
+    writer->lastSync = now_ns();
+    writer->fd = open(db_filename, O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (writer->fd < 0 || (writer->format = database_format(writer->fd)) < 0) {
+        if (writer->fd >= 0)
+            close(writer->fd);
+        free(writer);
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work, &attr);
+    pthread_cond_init(&writer->done, NULL);
+    pthread_condattr_destroy(&attr);
+    if (0 != pthread_create(&writer->thread, NULL, writer_thread, writer)) {
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->work);
+        pthread_cond_destroy(&writer->done);
+        close(writer->fd);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+/**
+ * @brief Queue a save without waiting for it to be committed.
+ *
+ * @return Ticket to wait for with db_writer_wait, -1 if the save is invalid.
+ */
+long long db_writer_submit(DbWriter* writer, const ChessGame* game, const char* username) {
+    char record[DATABASE_RECORD_MAX];
+    int length = format_record(game, username, writer->format, record);
+    if (length < 0)
+        return -1;
+    uint64_t time = now_ns();
+    pthread_mutex_lock(&writer->lock);
+    long long ticket = -1;
+    if (0 == batch_append(&writer->batches[writer->filling], record, (size_t) length, time)) {
+        ticket = ++writer->submitted;
+        pthread_cond_signal(&writer->work);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return ticket;
+}
+
+/**
+ * @brief Wait until a queued save is committed.
+ *
+ * @return 0 on success, -1 if a write failed.
+ */
+int db_writer_wait(DbWriter* writer, long long ticket) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->committed < ticket && !writer->failed)
+        pthread_cond_wait(&writer->done, &writer->lock);
+    int ret = writer->failed ? -1 : 0;
+    pthread_mutex_unlock(&writer->lock);
+    return ret;
+}
+
+/**
+ * @brief Save a game as save_game does, returning once the save is committed.
+ *
+ * @return 0 if saved, -1 otherwise.
+ */
+int db_writer_save(DbWriter* writer, const ChessGame* game, const char* username) {
+    long long ticket = db_writer_submit(writer, game, username);
+    return ticket < 0 ? -1 : db_writer_wait(writer, ticket);
+}
+
+/**
+ * @brief Counters and commit latency percentiles since the writer was opened.
+ */
+void db_writer_stats(DbWriter* writer, DbWriterStats* stats) {
+    pthread_mutex_lock(&writer->lock);
+    *stats = writer->stats;
+    stats->p50Us = percentile_us(writer->histogram, stats->saves, 0.50);
+    stats->p99Us = percentile_us(writer->histogram, stats->saves, 0.99);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * @brief Commit every queued save, stop the writer thread and close the database.
+ *
+ * @return 0 on success, -1 if a write failed.
+ */
+int db_writer_close(DbWriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = 1;
+    pthread_cond_signal(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    int ret = writer->failed ? -1 : 0;
+    if (0 != close(writer->fd))
+        ret = -1;
+    for (int i = 0; i < 2; ++i) {
+        free(writer->batches[i].data);
+        free(writer->batches[i].times);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->work);
+    pthread_cond_destroy(&writer->done);
+    free(writer);
+    return ret;
+}
@@ -0,0 +1,628 @@
+#include <pthread.h>
+#include <time.h>
+#include "Resources.h"
+
+#define MAX_PLY 64
+
+_Static_assert(MAX_PLY <= MOVE_HISTORY_SIZE, "A search takes back up to MAX_PLY moves");
+#define MAX_THREADS 64
+#define MATE_SCORE 30000
+#define INFINITE_SCORE 32000
+#define NODES_PER_CLOCK_CHECK 1024
+
+#define BOUND_EXACT 1
+#define BOUND_LOWER 2
+#define BOUND_UPPER 3
+
+/*
+ * @brief Value of each piece in PIECE_CHARS order (white then black), in centipawns.
+ */
+static const int piece_values[PIECE_TYPES] = { 100, 320, 330, 500, 900, 0, 100, 320, 330, 500, 900, 0 };
+
+/*
+ * @brief Piece-square bonuses from white's point of view, a8 first, as the board is displayed.
+ * Black pieces read the table with the square mirrored vertically.
+ */
+static const int piece_squares[6][64] = {
+    {    // Pawn
+         0,   0,   0,   0,   0,   0,   0,   0,
+        50,  50,  50,  50,  50,  50,  50,  50,
+        10,  10,  20,  30,  30,  20,  10,  10,
+         5,   5,  10,  25,  25,  10,   5,   5,
+         0,   0,   0,  20,  20,   0,   0,   0,
+         5,  -5, -10,   0,   0, -10,  -5,   5,
+         5,  10,  10, -20, -20,  10,  10,   5,
+         0,   0,   0,   0,   0,   0,   0,   0,
+    },
+    {    // Knight
+       -50, -40, -30, -30, -30, -30, -40, -50,
+       -40, -20,   0,   0,   0,   0, -20, -40,
+       -30,   0,  10,  15,  15,  10,   0, -30,
+       -30,   5,  15,  20,  20,  15,   5, -30,
+       -30,   0,  15,  20,  20,  15,   0, -30,
+       -30,   5,  10,  15,  15,  10,   5, -30,
+       -40, -20,   0,   5,   5,   0, -20, -40,
+       -50, -40, -30, -30, -30, -30, -40, -50,
+    },
+    {    // Bishop
+       -20, -10, -10, -10, -10, -10, -10, -20,
+       -10,   0,   0,   0,   0,   0,   0, -10,
+       -10,   0,   5,  10,  10,   5,   0, -10,
+       -10,   5,   5,  10,  10,   5,   5, -10,
+       -10,   0,  10,  10,  10,  10,   0, -10,
+       -10,  10,  10,  10,  10,  10,  10, -10,
+       -10,   5,   0,   0,   0,   0,   5, -10,
+       -20, -10, -10, -10, -10, -10, -10, -20,
+    },
+    {    // Rook
+         0,   0,   0,   0,   0,   0,   0,   0,
+         5,  10,  10,  10,  10,  10,  10,   5,
+        -5,   0,   0,   0,   0,   0,   0,  -5,
+        -5,   0,   0,   0,   0,   0,   0,  -5,
+        -5,   0,   0,   0,   0,   0,   0,  -5,
+        -5,   0,   0,   0,   0,   0,   0,  -5,
+        -5,   0,   0,   0,   0,   0,   0,  -5,
+         0,   0,   0,   5,   5,   0,   0,   0,
+    },
+    {    // Queen
+       -20, -10, -10,  -5,  -5, -10, -10, -20,
+       -10,   0,   0,   0,   0,   0,   0, -10,
+       -10,   0,   5,   5,   5,   5,   0, -10,
+        -5,   0,   5,   5,   5,   5,   0,  -5,
+         0,   0,   5,   5,   5,   5,   0,  -5,
+       -10,   5,   5,   5,   5,   5,   0, -10,
+       -10,   0,   5,   0,   0,   0,   0, -10,
+       -20, -10, -10,  -5,  -5, -10, -10, -20,
+    },
+    {    // King
+       -30, -40, -40, -50, -50, -40, -40, -30,
+       -30, -40, -40, -50, -50, -40, -40, -30,
+       -30, -40, -40, -50, -50, -40, -40, -30,
+       -30, -40, -40, -50, -50, -40, -40, -30,
+       -20, -30, -30, -40, -40, -30, -30, -20,
+       -10, -20, -20, -20, -20, -20, -20, -10,
+        20,  20,   0,   0,   0,   0,  20,  20,
+        20,  30,  10,   0,   0,  10,  30,  20,
+    },
+};
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Static evaluation of the position, from the point of view of the current player.
+ *
+ * @return Material plus piece-square score in centipawns.
+ */
+int evaluate(const ChessGame* game) {
+    int score = 0;
+    for (int piece = 0; piece < PIECE_TYPES; ++piece) {
+        int type = piece % 6;
+        for (Bitboard set = game->pieceBB[piece]; set; set &= set - 1) {
+            int square = LSB(set);
+            if (WHITE_PLAYER == PIECE_COLOR(piece))
+                score += piece_values[piece] + piece_squares[type][square];
+            else
+                score -= piece_values[piece] + piece_squares[type][square ^ 56];
+        }
+    }
+    return WHITE_PLAYER == game->currentPlayer ? score : -score;
+}
+
+/*
+ * @brief Give each move an ordering score: hash move, then captures by MVV-LVA and promotions, then killers.
+ */
+static void score_moves(const ChessGame* game, const ChessMove* moves, int* scores, int count,
+                        const ChessMove* best, const ChessMove killers[2]) {
+    for (int i = 0; i < count; ++i) {
+        ChessMove move = moves[i];
+        char attacker = game->chessboard[MOVE_SRC(move) >> 3][MOVE_SRC(move) & 7];
+        char victim = game->chessboard[MOVE_DEST(move) >> 3][MOVE_DEST(move) & 7];
+        if (best && move == *best) {
+            scores[i] = 1000000;
+        } else if ('.' != victim || MOVE_PROMOTION(move)) {
+            scores[i] = 100000;
+            if ('.' != victim) {
+                int type = piece_index(victim) % 6;
+                scores[i] += 10 * piece_values[type] - piece_values[piece_index(attacker)] / 10;
+            }
+            if (PROMOTION_QUEEN == MOVE_PROMOTION(move))
+                scores[i] += 10 * piece_values[4];
+        } else if (killers && move == killers[0]) {
+            scores[i] = 90000;
+        } else if (killers && move == killers[1]) {
+            scores[i] = 80000;
+        } else {
+            scores[i] = 0;
+        }
+    }
+}
+
+/*
+ * @brief Swap the best scoring remaining move into position index.
+ */
+static void pick_move(ChessMove* moves, int* scores, int count, int index) {
+    int best = index;
+    for (int i = index + 1; i < count; ++i) {
+        if (scores[i] > scores[best])
+            best = i;
+    }
+    if (best != index) {
+        ChessMove move = moves[index];
+        int score = scores[index];
+        moves[index] = moves[best];
+        scores[index] = scores[best];
+        moves[best] = move;
+        scores[best] = score;
+    }
+}
+
+/*
+ * @brief Transposition table entry.
+ * @details data packs the move (bits 0-15), score (16-31), depth (32-39), bound (40-41) and age (42-47).
+ * check is key ^ data, so an entry torn by two threads writing at once fails verification
+ * on probe instead of returning another position's data. No lock is taken.
+ */
+typedef struct {
+    uint64_t check;
+    uint64_t data;
+} TTEntry;
+
+static TTEntry* tt_table = NULL;
+static uint64_t tt_mask = 0;
+static int tt_size_mb = 0;
+static unsigned tt_age = 0;
+
+static OpeningBook engine_book;   // Mapped by book_ready, shared with other processes through the page cache
+static int engine_tablebases = 0;   // Endings mapped by tablebases_ready
+
+/**
+ * @brief Allocate the shared transposition table with the largest power of two entries fitting in size_mb.
+ *
+ * @return 0 if allocated, -1 otherwise.
+ */
+int tt_resize(int size_mb) {
+    uint64_t entries = 1;
+    while (entries * 2 * sizeof(TTEntry) <= (uint64_t) size_mb << 20)
+        entries *= 2;
+    TTEntry* table = calloc(entries, sizeof(TTEntry));
+    if (NULL == table)
+        return -1;
+    free(tt_table);
+    tt_table = table;
+    tt_mask = entries - 1;
+    tt_size_mb = size_mb;
+    return 0;
+}
+
+/**
+ * @brief Forget every entry of the transposition table.
+ */
+void tt_clear(void) {
+    if (tt_table)
+        memset(tt_table, 0, (tt_mask + 1) * sizeof(TTEntry));
+    tt_age = 0;
+}
+
+/*
+ * @brief Mate scores are stored relative to the node, so they stay correct at any ply.
+ */
+static int score_to_tt(int score, int ply) {
+    if (score >= MATE_SCORE - MAX_PLY)
+        return score + ply;
+    if (score <= -MATE_SCORE + MAX_PLY)
+        return score - ply;
+    return score;
+}
+
+static int score_from_tt(int score, int ply) {
+    if (score >= MATE_SCORE - MAX_PLY)
+        return score - ply;
+    if (score <= -MATE_SCORE + MAX_PLY)
+        return score + ply;
+    return score;
+}
+
+/*
+ * @brief Look up a position.
+ *
+ * @return 1 if found, with its packed move, score, depth and bound.
+ */
+static int tt_probe(uint64_t key, ChessMove* move, int* score, int* depth, int* bound) {
+    if (NULL == tt_table)   // It could not be allocated, the search goes on without it
+        return 0;
+    TTEntry* entry = &tt_table[key & tt_mask];
+    uint64_t check = __atomic_load_n(&entry->check, __ATOMIC_RELAXED);
+    uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+    if ((check ^ data) != key || 0 == data)
+        return 0;
+    *move = (uint16_t) data;
+    *score = (int16_t) (data >> 16);
+    *depth = (int) ((data >> 32) & 0xFF);
+    *bound = (int) ((data >> 40) & 0x3);
+    return 1;
+}
+
+/*
+ * @brief Store a position, replacing the slot if it holds the same position,
+ * an entry from an older search, or a shallower one.
+ */
+static void tt_store(uint64_t key, ChessMove move, int score, int depth, int bound) {
+    if (NULL == tt_table)
+        return;
+    TTEntry* entry = &tt_table[key & tt_mask];
+    uint64_t check = __atomic_load_n(&entry->check, __ATOMIC_RELAXED);
+    uint64_t old = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+    int same = (check ^ old) == key;
+    if (!same && 0 != old && ((old >> 42) & 0x3F) == (tt_age & 0x3F) && depth < (int) ((old >> 32) & 0xFF))
+        return;
+    if (same && 0 == move)
+        move = (uint16_t) old;   // Keep the move of a previous search of this position
+
+    uint64_t data = move | (uint64_t) (uint16_t) score << 16 | (uint64_t) depth << 32 |
+                    (uint64_t) bound << 40 | (uint64_t) (tt_age & 0x3F) << 42;
+    __atomic_store_n(&entry->check, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
+
+/*
+ * @brief State shared by all threads of one search.
+ */
+typedef struct {
+    const EngineOptions* options;
+    struct timespec start;
+    int stop;   // Set once by the main thread, read by all
+} SharedSearch;
+
+/*
+ * @brief State of one search thread: its own copy of the game, statistics and move ordering heuristics.
+ */
+typedef struct {
+    SharedSearch* shared;
+    ChessGame game;
+    int id;
+    unsigned long long nodes;
+    int stopped;
+    ChessMove killers[MAX_PLY][2];
+} SearchContext;
+
+/*
+ * @brief Pick up the stop flag. The main thread also checks the clock every NODES_PER_CLOCK_CHECK nodes
+ * and raises the flag when movetime runs out.
+ */
+static void check_limits(SearchContext* context) {
+    SharedSearch* shared = context->shared;
+    if (0 == context->id && 0 == context->nodes % NODES_PER_CLOCK_CHECK && shared->options->movetime > 0 &&
+            elapsed_seconds(&shared->start) * 1000 >= shared->options->movetime)
+        __atomic_store_n(&shared->stop, 1, __ATOMIC_RELAXED);
+    context->stopped = __atomic_load_n(&shared->stop, __ATOMIC_RELAXED);
+}
+
+/*
+ * @brief Search captures and promotions only, until the position is quiet.
+ */
+static int quiescence(SearchContext* context, ChessGame* game, int ply, int alpha, int beta) {
+    context->nodes++;
+    check_limits(context);
+    if (context->stopped)
+        return 0;
+
+    ChessMove moves[MAX_GENERATED_MOVES];
+    int scores[MAX_GENERATED_MOVES];
+    int count = 0, total = generate_moves(game, moves);
+    if (0 == total)   // Checkmate or stalemate
+        return game->checkersBB ? -MATE_SCORE + ply : 0;
+
+    int stand_pat = evaluate(game);
+    if (stand_pat >= beta || ply >= MAX_PLY - 1)
+        return stand_pat;
+    if (stand_pat > alpha)
+        alpha = stand_pat;
+
+    Bitboard enemy = game->colorBB[!game->currentPlayer];
+    for (int i = 0; i < total; ++i) {   // Keep captures and promotions
+        if ((enemy & SQUARE_BIT(MOVE_DEST(moves[i]))) || MOVE_PROMOTION(moves[i]))
+            moves[count++] = moves[i];
+    }
+    score_moves(game, moves, scores, count, NULL, NULL);
+
+    for (int i = 0; i < count; ++i) {
+        pick_move(moves, scores, count, i);
+        if (0 != make_move(game, &moves[i], WHITE_PLAYER == game->currentPlayer, 0))
+            continue;
+        int score = -quiescence(context, game, ply + 1, -beta, -alpha);
+        unmake_move(game);
+        if (context->stopped)
+            return 0;
+        if (score >= beta)
+            return score;
+        if (score > alpha)
+            alpha = score;
+    }
+    return alpha;
+}
+
+/*
+ * @brief Alpha-beta search to the given depth, falling into quiescence search at the leaves.
+ * @details The transposition table gives the first move to try, and cuts the node off
+ * when it already holds a deep enough result. The root (ply 0) is always searched.
+ *
+ * @param best Receives the best move found, may be NULL.
+ */
+static int alpha_beta(SearchContext* context, ChessGame* game, int depth, int ply,
+                        int alpha, int beta, ChessMove* best) {
+    if (engine_tablebases > 0 && ply > 0 && __builtin_popcountll(game->occupiedBB) <= 3) {
+        int plies, result = tablebase_probe(game, &plies);
+        if (TABLEBASE_UNKNOWN != result)
+            return TABLEBASE_DRAW == result ? 0 : TABLEBASE_WIN == result ? MATE_SCORE - ply - plies : -MATE_SCORE + ply + plies;
+    }
+    if (depth <= 0 || ply >= MAX_PLY - 1)
+        return quiescence(context, game, ply, alpha, beta);
+    context->nodes++;
+    check_limits(context);
+    if (context->stopped)
+        return 0;
+
+    ChessMove tt_move = 0;
+    int tt_score, tt_depth, tt_bound;
+    if (tt_probe(game->hash, &tt_move, &tt_score, &tt_depth, &tt_bound)) {
+        tt_score = score_from_tt(tt_score, ply);
+        if (ply > 0 && tt_depth >= depth && (BOUND_EXACT == tt_bound ||
+                (BOUND_LOWER == tt_bound && tt_score >= beta) || (BOUND_UPPER == tt_bound && tt_score <= alpha)))
+            return tt_score;
+    }
+
+    ChessMove moves[MAX_GENERATED_MOVES];
+    int scores[MAX_GENERATED_MOVES];
+    int count = generate_moves(game, moves);
+    if (0 == count)   // Checkmate or stalemate
+        return game->checkersBB ? -MATE_SCORE + ply : 0;
+    score_moves(game, moves, scores, count, tt_move ? &tt_move : NULL, context->killers[ply]);
+
+    int original_alpha = alpha, best_score = -INFINITE_SCORE, best_index = -1;
+    for (int i = 0; i < count; ++i) {
+        pick_move(moves, scores, count, i);
+        if (0 != make_move(game, &moves[i], WHITE_PLAYER == game->currentPlayer, 0))
+            continue;
+        int score = -alpha_beta(context, game, depth - 1, ply + 1, -beta, -alpha, NULL);
+        unmake_move(game);
+        if (context->stopped)
+            return 0;
+
+        if (score > best_score) {
+            best_score = score;
+            best_index = i;
+        }
+        if (score > alpha)
+            alpha = score;
+        if (alpha >= beta) {
+            char victim = game->chessboard[MOVE_DEST(moves[i]) >> 3][MOVE_DEST(moves[i]) & 7];
+            if ('.' == victim && moves[i] != context->killers[ply][0]) {
+                context->killers[ply][1] = context->killers[ply][0];
+                context->killers[ply][0] = moves[i];
+            }
+            break;
+        }
+    }
+    if (best_index < 0)
+        return 0;
+
+    int bound = best_score >= beta ? BOUND_LOWER : best_score > original_alpha ? BOUND_EXACT : BOUND_UPPER;
+    tt_store(game->hash, moves[best_index], score_to_tt(best_score, ply), depth, bound);
+    if (best)
+        *best = moves[best_index];
+    return best_score;
+}
+
+/*
+ * @brief Lazy SMP helper: iterative deepening on a private copy of the game until the main thread stops.
+ * @details Helpers share nothing but the transposition table. Odd helpers start one ply deeper
+ * so threads spread over different depths and fill the table for each other.
+ */
+static void* helper_search(void* arg) {
+    SearchContext* context = arg;
+    int max_depth = context->shared->options->depth > 0 ? context->shared->options->depth : MAX_PLY - 1;
+    for (int depth = 1 + (context->id & 1); depth <= max_depth && !context->stopped; ++depth)
+        alpha_beta(context, &context->game, depth, 0, -INFINITE_SCORE, INFINITE_SCORE, NULL);
+    return NULL;
+}
+
+/*
+ * @brief Map the endgame tables of the options, unless they are already mapped.
+ *
+ * @return Number of endings mapped; a directory without tables is not tried again.
+ */
+static int tablebases_ready(const char* dir) {
+    static char dir_tried[BUFFER_SIZE];
+    if (0 != strcmp(dir, dir_tried)) {
+        snprintf(dir_tried, sizeof(dir_tried), "%s", dir);
+        engine_tablebases = tablebase_open(dir);
+        if (0 == engine_tablebases) {
+            INFO("No endgame tables in %s", dir);
+        }
+    }
+    return engine_tablebases;
+}
+
+/**
+ * @brief Find the best move for the current player by iterative deepening.
+ * @details Each iteration runs a full alpha-beta search one ply deeper, trying the best move
+ * of the previous iteration first. With options->threads > 1 the search runs Lazy SMP:
+ * helper threads search the same position through the shared transposition table while
+ * the main thread's result is reported. The search stops at options->depth, or when
+ * options->movetime runs out, in which case the result of the last completed iteration is kept.
+ * If memory runs out, the search goes on without the transposition table, or on one thread.
+ *
+ * @param game Game to search. It is modified during the search and restored before returning.
+ * @return 0 if a move was found, -1 if the current player has no move.
+ */
+int engine_search(ChessGame* game, const EngineOptions* options, SearchResult* result) {
+    ChessMove moves[MAX_GENERATED_MOVES];
+    if (0 == generate_moves(game, moves))
+        return -1;
+    memset(result, 0, sizeof(*result));
+    result->best = moves[0];
+    if (options->tablebases)
+        tablebases_ready(options->tablebases);
+
+    int hash_mb = options->hash > 0 ? options->hash : DEFAULT_HASH_MB;
+    if (hash_mb != tt_size_mb && 0 != tt_resize(hash_mb)) {
+        INFO("Engine cannot allocate a %d MB transposition table, searching %s", hash_mb,
+             tt_table ? "with the previous one" : "without one");
+        tt_size_mb = hash_mb;   // Not tried again at every move
+    }
+    tt_age++;
+
+    SharedSearch shared = { .options = options, .stop = 0 };
+    clock_gettime(CLOCK_MONOTONIC, &shared.start);
+
+    int threads = options->threads > 0 ? options->threads : 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    SearchContext* contexts = calloc(threads, sizeof(SearchContext));
+    pthread_t* helpers = calloc(threads, sizeof(pthread_t));
+    SearchContext single;
+    if (NULL == contexts || NULL == helpers) {
+        INFO("Engine cannot allocate %d search threads, searching on one", threads);
+        free(contexts);
+        free(helpers);
+        memset(&single, 0, sizeof(single));
+        contexts = &single;
+        helpers = NULL;
+        threads = 1;
+    }
+    for (int i = 0; i < threads; ++i) {
+        contexts[i].shared = &shared;
+        contexts[i].id = i;
+        contexts[i].game = *game;
+    }
+    for (int i = 1; i < threads; ++i) {
+        if (0 != pthread_create(&helpers[i], NULL, helper_search, &contexts[i]))
+            contexts[i].id = -1;   // Not started
+    }
+
+    SearchContext* primary = &contexts[0];
+    int max_depth = options->depth > 0 ? options->depth : MAX_PLY - 1;
+    for (int depth = 1; depth <= max_depth; ++depth) {
+        ChessMove best = result->best;
+        int score = alpha_beta(primary, &primary->game, depth, 0, -INFINITE_SCORE, INFINITE_SCORE, &best);
+        if (primary->stopped)
+            break;
+        result->best = best;
+        result->score = score;
+        result->depth = depth;
+        char text[MOVE_TEXT_SIZE];
+        INFO("Engine depth %d score %d best %s nodes %llu", depth, score, move_to_text(best, text), primary->nodes);
+        if (score >= MATE_SCORE - MAX_PLY || score <= -MATE_SCORE + MAX_PLY)
+            break;
+    }
+
+    __atomic_store_n(&shared.stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < threads; ++i) {
+        if (i > 0 && contexts[i].id > 0)
+            pthread_join(helpers[i], NULL);
+        result->nodes += contexts[i].nodes;
+    }
+    if (contexts != &single)
+        free(contexts);
+    free(helpers);
+
+    result->seconds = elapsed_seconds(&shared.start);
+    INFO("Engine searched %llu nodes in %.3f s with %d thread(s) (%.0f nodes/s)", result->nodes, result->seconds,
+            threads, result->seconds > 0 ? result->nodes / result->seconds : 0.0);
+    return 0;
+}
+
+/*
+ * @brief Map the opening book of the options, unless it is already mapped.
+ *
+ * @return 0 if the book is mapped, -1 if it cannot be used; it is not tried again.
+ */
+static int book_ready(const char* path) {
+    static char path_tried[BUFFER_SIZE];
+    static int ready = -1;
+    if (0 != strcmp(path, path_tried)) {
+        book_close(&engine_book);
+        snprintf(path_tried, sizeof(path_tried), "%s", path);
+        ready = book_open(&engine_book, path);
+        if (0 != ready) {
+            INFO("Opening book %s cannot be used", path);
+        }
+    }
+    return ready;
+}
+
+/**
+ * @brief Build the command the engine plays in the current position.
+ * @details A move of the opening book, or the best move of the endgame tables, is played without
+ * searching when the options have a book or tables holding the position.
+ *
+ * @param message Receives "/move <move>", or "/forfeit" if the player is checkmated or stalemated.
+ * @return Type of command built.
+ */
+int engine_command(ChessGame* game, const EngineOptions* options, char* message) {
+    SearchResult result;
+    char text[MOVE_TEXT_SIZE];
+    if (options->book && 0 == book_ready(options->book) && 0 == book_probe(&engine_book, game, &result.best)) {
+        sprintf(message, "/move %s", move_to_text(result.best, text));
+        return COMMAND_MOVE;
+    }
+    if (options->tablebases && tablebases_ready(options->tablebases) > 0
+            && TABLEBASE_UNKNOWN != tablebase_move(game, &result.best, NULL)) {
+        sprintf(message, "/move %s", move_to_text(result.best, text));
+        return COMMAND_MOVE;
+    }
+    if (0 != engine_search(game, options, &result)) {
+        strcpy(message, "/forfeit");
+        return COMMAND_FORFEIT;
+    }
+    sprintf(message, "/move %s", move_to_text(result.best, text));
+    return COMMAND_MOVE;
+}
+
+/**
+ * @brief Parse the engine options of the command line.
+ * @details Options are "--engine" followed by any of "depth=N", "movetime=ms",
+ * "threads=N", "hash=MB", "book=PATH" and "tablebases=DIR". Without a limit the engine searches 5 plies.
+ *
+ * @return 1 if the engine plays, 0 if a human plays, -1 if an option is invalid.
+ */
+int parse_engine_options(int argc, char* argv[], EngineOptions* options) {
+    memset(options, 0, sizeof(*options));
+    options->threads = 1;
+    options->hash = DEFAULT_HASH_MB;
+    int enabled = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--engine")) {
+            enabled = 1;
+        } else if (enabled && 0 == strncmp(argv[i], "depth=", 6)) {
+            options->depth = atoi(argv[i] + 6);
+            if (options->depth <= 0)
+                return -1;
+        } else if (enabled && 0 == strncmp(argv[i], "movetime=", 9)) {
+            options->movetime = atoi(argv[i] + 9);
+            if (options->movetime <= 0)
+                return -1;
+        } else if (enabled && 0 == strncmp(argv[i], "threads=", 8)) {
+            options->threads = atoi(argv[i] + 8);
+            if (options->threads <= 0 || options->threads > MAX_THREADS)
+                return -1;
+        } else if (enabled && 0 == strncmp(argv[i], "hash=", 5)) {
+            options->hash = atoi(argv[i] + 5);
+            if (options->hash <= 0)
+                return -1;
+        } else if (enabled && 0 == strncmp(argv[i], "book=", 5)) {
+            options->book = argv[i] + 5;
+        } else if (enabled && 0 == strncmp(argv[i], "tablebases=", 11)) {
+            options->tablebases = argv[i] + 11;
+        } else {
+            return -1;
+        }
+    }
+    if (enabled && 0 == options->depth && 0 == options->movetime)
+        options->depth = 5;
+    return enabled;
+}
@@ -0,0 +1,80 @@
+#include <time.h>
+#include "Resources.h"
+
+#define BENCH_ROUNDS 5
+
+static double elapsed(const struct timespec* begin) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/*
+ * @brief Write the FEN of each position of random games, FEN_MAX_LENGTH bytes apart.
+ */
+static void write_positions(char* fens, long positions) {
+    ChessGame game;
+    ChessMove moves[MAX_GENERATED_MOVES];
+    initialize_game(&game);
+    srand(1);
+    for (long i = 0; i < positions; ++i) {
+        int count = generate_moves(&game, moves);
+        if (0 == count || game.moveCount >= 200)
+            initialize_game(&game);
+        else
+            make_move(&game, &moves[rand() % count], WHITE_PLAYER == game.currentPlayer, 0);
+        chessboard_to_fen(fens + i * FEN_MAX_LENGTH, FEN_MAX_LENGTH, &game);
+    }
+}
+
+/*
+ * @brief Usage: fenbench [positions]
+ * @details Parse and write the FEN of positions from random games, BENCH_ROUNDS times each,
+ * and report positions per second. Every FEN written must equal the one parsed.
+ */
+int main(int argc, char* argv[]) {
+    long positions = argc > 1 ? atol(argv[1]) : 200000;
+    char* fens = positions > 0 ? malloc(positions * FEN_MAX_LENGTH) : NULL;
+    ChessGame* games = positions > 0 ? malloc(positions * sizeof(ChessGame)) : NULL;
+    if (NULL == fens || NULL == games) {
+        fprintf(stderr, "Usage: %s [positions]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    write_positions(fens, positions);
+
+    long bytes = 0;
+    for (long i = 0; i < positions; ++i)
+        bytes += strlen(fens + i * FEN_MAX_LENGTH) + 1;
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    long failed = 0;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {   // Into one game, as a load does
+        for (long i = 0; i < positions; ++i)
+            failed += 0 != fen_to_chessboard(fens + i * FEN_MAX_LENGTH, &games[0]);
+    }
+    double parse = elapsed(&begin);
+    for (long i = 0; i < positions; ++i)
+        fen_to_chessboard(fens + i * FEN_MAX_LENGTH, &games[i]);
+
+    char fen[FEN_MAX_LENGTH];
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        for (long i = 0; i < positions; ++i)
+            chessboard_to_fen(fen, sizeof(fen), &games[i]);
+    }
+    double write = elapsed(&begin);
+
+    for (long i = 0; i < positions; ++i) {
+        chessboard_to_fen(fen, sizeof(fen), &games[i]);
+        failed += 0 != strcmp(fen, fens + i * FEN_MAX_LENGTH);
+    }
+    double total = (double) positions * BENCH_ROUNDS;
+    fprintf(stdout, "parse  %10.0f positions/s  %7.1f MB/s\n", total / parse, bytes * BENCH_ROUNDS / parse / 1e6);
+    fprintf(stdout, "write  %10.0f positions/s  %7.1f MB/s\n", total / write, bytes * BENCH_ROUNDS / write / 1e6);
+    if (failed > 0)
+        fprintf(stderr, "%ld positions did not round-trip.\n", failed);
+    free(fens);
+    free(games);
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include "Resources.h"
+#include <errno.h>
 #include <fcntl.h>
 
 /*
@@ -8,21 +9,655 @@ int is_white(const char piece) {
     return piece > 'A' && piece < 'Z';
 }
 
+/*
+ * @brief Index of each piece character in ChessGame.pieceBB, -1 for anything else.
+ */
+static const signed char piece_lookup[128] = {
+    ['P'] = 1, ['N'] = 2, ['B'] = 3, ['R'] = 4, ['Q'] = 5, ['K'] = 6,
+    ['p'] = 7, ['n'] = 8, ['b'] = 9, ['r'] = 10, ['q'] = 11, ['k'] = 12,
+};
+
+/**
+ * @brief Get the index of a piece in ChessGame.pieceBB.
+ * 
+ * @return Index in PIECE_CHARS, -1 if it is not a piece.
+ */
+int piece_index(char piece) {
+    if (piece < 0)
+        return -1;
+    return piece_lookup[(int) piece] - 1;
+}
+
+static uint64_t zobrist_pieces[PIECE_TYPES][64];
+static uint64_t zobrist_side;
+static uint64_t zobrist_castling[16];   // Indexed by the CASTLE_* bits held, 0 for none
+static uint64_t zobrist_ep[8];          // Indexed by the file of the en passant square
+
+/*
+ * @brief Castling rights given up by a move from or to each square: moving the king or a rook,
+ * or capturing a rook, loses the rights that need it.
+ */
+static const unsigned char castling_lost[64] = {
+    [0] = CASTLE_BLACK_QUEEN, [4] = CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN, [7] = CASTLE_BLACK_KING,
+    [56] = CASTLE_WHITE_QUEEN, [60] = CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN, [63] = CASTLE_WHITE_KING,
+};
+
+/*
+ * @brief Next number of the xorshift64* sequence the keys are drawn from.
+ */
+static uint64_t next_key(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/**
+ * @brief Fill the Zobrist keys from a fixed seed.
+ * @details The seed is fixed so keys, and therefore stored hashes, are the same in every process.
+ * Castling and en passant keys are drawn last, so a position without them keeps the key it had
+ * before they were tracked.
+ */
+__attribute__((constructor))
+void init_zobrist_keys(void) {
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    for (int piece = 0; piece < PIECE_TYPES; ++piece) {
+        for (int square = 0; square < 64; ++square)
+            zobrist_pieces[piece][square] = next_key(&state);
+    }
+    zobrist_side = next_key(&state);
+    uint64_t rights[4];
+    for (int i = 0; i < 4; ++i)
+        rights[i] = next_key(&state);
+    for (int held = 1; held < 16; ++held)
+        zobrist_castling[held] = zobrist_castling[held & (held - 1)] ^ rights[LSB(held)];
+    for (int file = 0; file < 8; ++file)
+        zobrist_ep[file] = next_key(&state);
+}
+
+/**
+ * @brief Compute the Zobrist key of a position from scratch.
+ * @details XOR of the key of every piece on its square, the side key when black is to move,
+ * and the keys of the castling rights and en passant file.
+ */
+uint64_t compute_hash(const ChessGame* game) {
+    uint64_t hash = BLACK_PLAYER == game->currentPlayer ? zobrist_side : 0;
+    for (int piece = 0; piece < PIECE_TYPES; ++piece) {
+        Bitboard set = game->pieceBB[piece];
+        for (; set; set &= set - 1)
+            hash ^= zobrist_pieces[piece][LSB(set)];
+    }
+    hash ^= zobrist_castling[game->castling];
+    if (NO_SQUARE != game->epSquare)
+        hash ^= zobrist_ep[game->epSquare & 7];
+    return hash;
+}
+
+/*
+ * @brief Put a piece (or '.') on a square, keeping the bitboards and hash in sync with the chessboard.
+ */
+static void put_piece(ChessGame* game, int row, int col, char piece) {
+    int square = SQUARE(row, col);
+    Bitboard bit = SQUARE_BIT(square);
+    int index = piece_index(game->chessboard[row][col]);
+    if (index >= 0) {
+        game->pieceBB[index] &= ~bit;
+        game->colorBB[PIECE_COLOR(index)] &= ~bit;
+        game->hash ^= zobrist_pieces[index][square];
+    }
+    index = piece_index(piece);
+    if (index >= 0) {
+        game->pieceBB[index] |= bit;
+        game->colorBB[PIECE_COLOR(index)] |= bit;
+        game->hash ^= zobrist_pieces[index][square];
+    }
+    game->chessboard[row][col] = piece;
+}
+
+/**
+ * @brief Rebuild every bitboard from the chessboard array.
+ */
+void sync_bitboards(ChessGame* game) {
+    memset(game->pieceBB, 0, sizeof(game->pieceBB));
+    game->colorBB[WHITE_PLAYER] = game->colorBB[BLACK_PLAYER] = 0;
+    for (int row = 0; row < 8; ++row) {
+        for (int col = 0; col < 8; ++col) {
+            int index = piece_index(game->chessboard[row][col]);
+            if (index < 0)
+                continue;
+            game->pieceBB[index] |= SQUARE_BIT(SQUARE(row, col));
+            game->colorBB[PIECE_COLOR(index)] |= SQUARE_BIT(SQUARE(row, col));
+        }
+    }
+    game->occupiedBB = game->colorBB[WHITE_PLAYER] | game->colorBB[BLACK_PLAYER];
+    update_attacks(game);
+}
+
+/*
+ * @brief Squares a knight or a king on a square can jump to. Used to build the tables.
+ */
+static Bitboard step_targets(int square, const int deltas[8][2]) {
+    Bitboard targets = 0;
+    for (int i = 0; i < 8; ++i) {
+        int row = (square >> 3) + deltas[i][0], col = (square & 7) + deltas[i][1];
+        if (row >= 0 && row < 8 && col >= 0 && col < 8)
+            targets |= SQUARE_BIT(SQUARE(row, col));
+    }
+    return targets;
+}
+
+/*
+ * @brief Squares a slider on a square reaches, stopping at (and including) the first piece in each direction.
+ * Used to build the tables.
+ */
+static Bitboard slide_targets(int square, const int deltas[4][2], Bitboard occupied) {
+    Bitboard targets = 0;
+    for (int i = 0; i < 4; ++i) {
+        int row = (square >> 3) + deltas[i][0], col = (square & 7) + deltas[i][1];
+        for (; row >= 0 && row < 8 && col >= 0 && col < 8; row += deltas[i][0], col += deltas[i][1]) {
+            targets |= SQUARE_BIT(SQUARE(row, col));
+            if (occupied & SQUARE_BIT(SQUARE(row, col)))
+                break;
+        }
+    }
+    return targets;
+}
+
+static const int knight_deltas[8][2] = { {-2, -1}, {-2, 1}, {-1, -2}, {-1, 2}, {1, -2}, {1, 2}, {2, -1}, {2, 1} };
+static const int king_deltas[8][2] = { {-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1} };
+static const int rook_deltas[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+static const int bishop_deltas[4][2] = { {-1, -1}, {-1, 1}, {1, -1}, {1, 1} };
+static const char promotion_chars[8] = { '\0', 'n', 'b', 'r', 'q' };   // By MOVE_PROMOTION
+
+#define FILE_A 0x0101010101010101ULL
+#define FILE_H 0x8080808080808080ULL
+
+#define FEN_COUNTER_DIGITS 5
+
+/*
+ * @brief Compute the squares strictly between two squares on the same row, column or diagonal.
+ * @details The squares in index range (lo, hi) are masked with the line both squares lie on,
+ * which is a shifted copy of the first rank, the a-file, or one of the two long diagonals.
+ * 
+ * @return Mask of squares between, 0 if the squares are not aligned or adjacent.
+ */
+static Bitboard compute_between(int src_row, int src_col, int dest_row, int dest_col) {
+    int src = SQUARE(src_row, src_col), dest = SQUARE(dest_row, dest_col);
+    int lo = src < dest ? src : dest;
+    int hi = src < dest ? dest : src;
+    Bitboard range = (SQUARE_BIT(hi) - 1) & ~((SQUARE_BIT(lo) << 1) - 1);
+    Bitboard line;
+    if (src_row == dest_row) {
+        line = 0xFFULL << (8 * src_row);
+    } else if (src_col == dest_col) {
+        line = 0x0101010101010101ULL << src_col;
+    } else if (src_row - src_col == dest_row - dest_col) {
+        int shift = 8 * (src_row - src_col);
+        line = shift >= 0 ? 0x8040201008040201ULL << shift : 0x8040201008040201ULL >> -shift;
+    } else if (src_row + src_col == dest_row + dest_col) {
+        int shift = 8 * (src_row + src_col - 7);
+        line = shift >= 0 ? 0x0102040810204080ULL << shift : 0x0102040810204080ULL >> -shift;
+    } else {
+        return 0;
+    }
+    return range & line;
+}
+
+
+static Bitboard knight_table[64];
+static Bitboard king_table[64];
+static Bitboard between_table[64][64];
+static Bitboard line_table[64][64];      // Whole row, column or diagonal through two squares, 0 if not aligned
+
+/*
+ * @brief Magic bitboard entry of a slider on one square.
+ * @details The relevant occupancy (mask) is multiplied by magic and shifted down,
+ * giving the index of the attack set in the slider's shared table.
+ */
+typedef struct {
+    Bitboard mask;
+    Bitboard magic;
+    Bitboard* attacks;
+    int shift;
+} Magic;
+
+static Magic rook_magics[64];
+static Magic bishop_magics[64];
+static Bitboard rook_table[0x19000];     // Sum of 2^(bits of rook mask) over all squares
+static Bitboard bishop_table[0x1480];    // Sum of 2^(bits of bishop mask) over all squares
+
+/*
+ * @brief Magic numbers found offline by random search over sparse 64-bit candidates.
+ * Each one maps every relevant occupancy of its square to a distinct index (or to an index
+ * sharing the same attack set), so no search happens at startup.
+ */
+static const Bitboard rook_magic_numbers[64] = {
+    0x1080004008801020ULL, 0x0840092002C03000ULL, 0x1900200010400900ULL, 0x0880100008000480ULL,
+    0x4200100420080200ULL, 0x8100020100080400ULL, 0x0200040110886200ULL, 0x0200008040220411ULL,
+    0x0404800084400220ULL, 0x0000401000402000ULL, 0x0086001081220440ULL, 0x0408800800100280ULL,
+    0x000A001201040820ULL, 0x8848800200840080ULL, 0x4001000100040200ULL, 0x0442000102105084ULL,
+    0x9080010020804100ULL, 0x0040404000201009ULL, 0x0000808010002009ULL, 0x2200090021D00100ULL,
+    0x0008008008040080ULL, 0x0004004002010040ULL, 0x0011040008015042ULL, 0x00000A0001768104ULL,
+    0x0000800080204009ULL, 0x2010004140002001ULL, 0x9800200280100080ULL, 0x1000100080080080ULL,
+    0x0442000A00049020ULL, 0x2100040080020080ULL, 0x0800120400900148ULL, 0x0010040A00128541ULL,
+    0x2800804000800030ULL, 0x1010002000400041ULL, 0x4000200011004100ULL, 0x0610008410800800ULL,
+    0x0400802402800800ULL, 0xC100020080800400ULL, 0x0002000802000401ULL, 0x0182085882000401ULL,
+    0x0220204000808000ULL, 0x2860100040024022ULL, 0x0001002004110040ULL, 0x99101042000A0020ULL,
+    0x0004080004008080ULL, 0x0010040002008080ULL, 0x2012004881020004ULL, 0x8300842444820011ULL,
+    0x0088403882010200ULL, 0x0820400080210100ULL, 0x0110910040A00300ULL, 0x0801100280080480ULL,
+    0x0242009008200600ULL, 0x1002000489500200ULL, 0x0040800200010080ULL, 0x0091800041000080ULL,
+    0x0000209300488001ULL, 0x04C1002414824001ULL, 0x020020000B001041ULL, 0x7000100004200901ULL,
+    0x8002002004100802ULL, 0x30010002084C0007ULL, 0x0888221800813004ULL, 0x4000002840840112ULL
+};
+
+static const Bitboard bishop_magic_numbers[64] = {
+    0x10102002004A1420ULL, 0x8020040400584008ULL, 0x10510800811201C8ULL, 0x5204042080000088ULL,
+    0x2204106880000002ULL, 0x1401042004000000ULL, 0x0400880410042004ULL, 0x0028208200A02020ULL,
+    0x1500241990010E00ULL, 0x8001200182020A40ULL, 0x40004101030B0000ULL, 0x8002041042000100ULL,
+    0x4010011041020038ULL, 0x0000010421044000ULL, 0x1500210808020A00ULL, 0x8000088400880520ULL,
+    0x0405004010040100ULL, 0x1005823210040108ULL, 0x2708008102040011ULL, 0x4048200404009100ULL,
+    0x0018104101400024ULL, 0x0003000601190101ULL, 0x8004803108491000ULL, 0x8014241200820800ULL,
+    0x0006E080100C3040ULL, 0x0501044A11041800ULL, 0x9020300008004045ULL, 0x0894080000220040ULL,
+    0x1001010083104000ULL, 0x5004030040900080ULL, 0x000400422C012400ULL, 0x0002128698404812ULL,
+    0x1010108404900440ULL, 0x0928021182084100ULL, 0x2006080409020024ULL, 0x1010202020180080ULL,
+    0xA010008200202200ULL, 0x2098015100019004ULL, 0x0002041440810811ULL, 0x802A02020000B098ULL,
+    0x0009015090004060ULL, 0x4000821082081001ULL, 0x0100210040420800ULL, 0x0800004010488A00ULL,
+    0x2000081104004040ULL, 0x4C8E029015000082ULL, 0x0420340322224842ULL, 0x1298260043400210ULL,
+    0x0000822802400008ULL, 0x00008A0101600000ULL, 0x3040003412080021ULL, 0x3040290220884800ULL,
+    0x4A1500401041004AULL, 0x8010200282020781ULL, 0x0020203142209091ULL, 0x0070300600902110ULL,
+    0x0040808800B62048ULL, 0x0000810400C44420ULL, 0x00080400440C0441ULL, 0x8340080020840411ULL,
+    0x0000000104208200ULL, 0x0000800810D00080ULL, 0x0400530411080200ULL, 0x4040702400932244ULL
+};
+
+/*
+ * @brief Fill the attack table of one slider.
+ * @details Sub-sets of the relevant occupancy are enumerated with the Carry-Rippler trick
+ * and the walked attack set of each is stored at its magic index.
+ */
+static void init_magics(Magic magics[64], Bitboard* table, const Bitboard magic_numbers[64], const int deltas[4][2]) {
+    Bitboard* next = table;
+    for (int square = 0; square < 64; ++square) {
+        int row = square >> 3, col = square & 7;
+        Bitboard edges = ((0xFFULL | 0xFFULL << 56) & ~(0xFFULL << (8 * row))) | 
+                         ((FILE_A | FILE_H) & ~(FILE_A << col));
+        Magic* m = &magics[square];
+        m->mask = slide_targets(square, deltas, 0) & ~edges;
+        m->magic = magic_numbers[square];
+        m->shift = 64 - POPCOUNT(m->mask);
+        m->attacks = next;
+
+        Bitboard subset = 0;
+        do {
+            m->attacks[(subset * m->magic) >> m->shift] = slide_targets(square, deltas, subset);
+            subset = (subset - m->mask) & m->mask;
+        } while (subset);
+        next += SQUARE_BIT(64 - m->shift);
+    }
+}
+
+/**
+ * @brief Build the knight, king, between and magic slider tables.
+ * @details Runs once before main, so every lookup afterwards is a constant-time table read.
+ */
+__attribute__((constructor))
+void init_attack_tables(void) {
+    static int initialized = 0;
+    if (initialized)
+        return;
+    initialized = 1;
+
+    for (int src = 0; src < 64; ++src) {
+        knight_table[src] = step_targets(src, knight_deltas);
+        king_table[src] = step_targets(src, king_deltas);
+        for (int dest = 0; dest < 64; ++dest)
+            between_table[src][dest] = compute_between(src >> 3, src & 7, dest >> 3, dest & 7);
+    }
+    init_magics(rook_magics, rook_table, rook_magic_numbers, rook_deltas);
+    init_magics(bishop_magics, bishop_table, bishop_magic_numbers, bishop_deltas);
+    for (int src = 0; src < 64; ++src) {
+        for (int dest = 0; dest < 64; ++dest) {
+            if (src == dest)
+                continue;
+            Bitboard ends = SQUARE_BIT(src) | SQUARE_BIT(dest);
+            if ((src >> 3) == (dest >> 3) || (src & 7) == (dest & 7))
+                line_table[src][dest] = (rook_attacks(src, 0) & rook_attacks(dest, 0)) | ends;
+            else if (bishop_attacks(src, 0) & SQUARE_BIT(dest))
+                line_table[src][dest] = (bishop_attacks(src, 0) & bishop_attacks(dest, 0)) | ends;
+        }
+    }
+}
+
+/**
+ * @brief Squares attacked by a knight on the square.
+ */
+Bitboard knight_attacks(int square) {
+    return knight_table[square];
+}
+
+/**
+ * @brief Squares attacked by a king on the square.
+ */
+Bitboard king_attacks(int square) {
+    return king_table[square];
+}
+
+/**
+ * @brief Squares attacked by a rook on the square, up to and including the first blocker.
+ */
+Bitboard rook_attacks(int square, Bitboard occupied) {
+    const Magic* m = &rook_magics[square];
+    return m->attacks[((occupied & m->mask) * m->magic) >> m->shift];
+}
+
+/**
+ * @brief Squares attacked by a bishop on the square, up to and including the first blocker.
+ */
+Bitboard bishop_attacks(int square, Bitboard occupied) {
+    const Magic* m = &bishop_magics[square];
+    return m->attacks[((occupied & m->mask) * m->magic) >> m->shift];
+}
+
+/**
+ * @brief Get the squares strictly between two squares on the same row, column or diagonal.
+ * 
+ * @return Mask of squares between, 0 if the squares are not aligned or adjacent.
+ */
+Bitboard ray_between(int src_row, int src_col, int dest_row, int dest_col) {
+    return between_table[SQUARE(src_row, src_col)][SQUARE(dest_row, dest_col)];
+}
+
+/**
+ * @brief Whether a piece of a player could capture on a square.
+ *
+ * @param by WHITE_PLAYER or BLACK_PLAYER
+ */
+int square_attacked(const ChessGame* game, int square, int by) {
+    const Bitboard* pieces = game->pieceBB + 6 * by;   // Pawn, knight, bishop, rook, queen, king of the player
+    if ((knight_attacks(square) & pieces[1]) || (king_attacks(square) & pieces[5]))
+        return 1;
+    if (bishop_attacks(square, game->occupiedBB) & (pieces[2] | pieces[4]))
+        return 1;
+    if (rook_attacks(square, game->occupiedBB) & (pieces[3] | pieces[4]))
+        return 1;
+    int row = (square >> 3) + (WHITE_PLAYER == by ? 1 : -1), col = square & 7;   // Row of the pawns that capture there
+    if (row < 0 || row > 7)
+        return 0;
+    Bitboard pawns = (col > 0 ? SQUARE_BIT(SQUARE(row, col - 1)) : 0) | (col < 7 ? SQUARE_BIT(SQUARE(row, col + 1)) : 0);
+    return 0 != (pawns & pieces[0]);
+}
+
+/*
+ * @brief Squares attacked by a set of pawns of a player.
+ */
+static Bitboard pawn_attacks(Bitboard pawns, int color) {
+    if (WHITE_PLAYER == color)
+        return ((pawns >> 9) & ~FILE_H) | ((pawns >> 7) & ~FILE_A);
+    return ((pawns << 7) & ~FILE_H) | ((pawns << 9) & ~FILE_A);
+}
+
+/*
+ * @brief Pieces of a player pinned to its king: the only piece between the king and an enemy slider.
+ */
+static Bitboard pinned_pieces(const ChessGame* game, int color) {
+    Bitboard king = game->pieceBB[6 * color + 5];
+    if (0 == king)
+        return 0;
+    int square = LSB(king);
+    const Bitboard* enemy = game->pieceBB + 6 * !color;
+    Bitboard pinners = (rook_attacks(square, game->colorBB[!color]) & (enemy[3] | enemy[4])) |
+                       (bishop_attacks(square, game->colorBB[!color]) & (enemy[2] | enemy[4]));
+    Bitboard pinned = 0;
+    for (; pinners; pinners &= pinners - 1) {
+        Bitboard between = between_table[square][LSB(pinners)] & game->occupiedBB;
+        if (between && 0 == (between & (between - 1)) && (between & game->colorBB[color]))
+            pinned |= between;
+    }
+    return pinned;
+}
+
+/**
+ * @brief Rebuild the attack, pin and check maps from the bitboards.
+ * @details Called by make_move and unmake_move once per move, so a candidate move is checked for
+ * leaving its king in check with a few bit operations. Attacks are computed with the other player's
+ * king taken off the board, so a king in check cannot step back along the ray of its checker.
+ */
+void update_attacks(ChessGame* game) {
+    for (int color = WHITE_PLAYER; color <= BLACK_PLAYER; ++color) {
+        const Bitboard* pieces = game->pieceBB + 6 * color;
+        Bitboard occupied = game->occupiedBB & ~game->pieceBB[6 * !color + 5];
+        Bitboard attacks = pawn_attacks(pieces[0], color);
+        for (Bitboard set = pieces[1]; set; set &= set - 1)
+            attacks |= knight_table[LSB(set)];
+        for (Bitboard set = pieces[2] | pieces[4]; set; set &= set - 1)
+            attacks |= bishop_attacks(LSB(set), occupied);
+        for (Bitboard set = pieces[3] | pieces[4]; set; set &= set - 1)
+            attacks |= rook_attacks(LSB(set), occupied);
+        if (pieces[5])
+            attacks |= king_table[LSB(pieces[5])];
+        game->attackBB[color] = attacks;
+        game->pinnedBB[color] = pinned_pieces(game, color);
+    }
+
+    int color = game->currentPlayer;
+    Bitboard king = game->pieceBB[6 * color + 5];
+    game->checkersBB = 0;
+    if (king & game->attackBB[!color]) {
+        int square = LSB(king);
+        const Bitboard* enemy = game->pieceBB + 6 * !color;
+        game->checkersBB = (pawn_attacks(king, color) & enemy[0]) | (knight_table[square] & enemy[1]) |
+                           (bishop_attacks(square, game->occupiedBB) & (enemy[2] | enemy[4])) |
+                           (rook_attacks(square, game->occupiedBB) & (enemy[3] | enemy[4]));
+    }
+}
+
+/*
+ * @brief Squares a piece of the player to move, other than its king, can move to without
+ * leaving the king in check: anywhere, or only onto the checker or between it and the king,
+ * and only along the pin line if the piece is pinned. Nowhere in double check.
+ */
+static Bitboard legal_targets(const ChessGame* game, int src) {
+    Bitboard king = game->pieceBB[6 * game->currentPlayer + 5];
+    if (0 == king)
+        return ~0ULL;
+    int square = LSB(king);
+    Bitboard targets = ~0ULL, checkers = game->checkersBB;
+    if (checkers)
+        targets = (checkers & (checkers - 1)) ? 0 : checkers | between_table[square][LSB(checkers)];
+    if (game->pinnedBB[game->currentPlayer] & SQUARE_BIT(src))
+        targets &= line_table[square][src];
+    return targets;
+}
+
+/*
+ * @brief Whether capturing en passant leaves the king of the player to move in check.
+ * @details The captured pawn and the capturing one both leave the row of the king, so the
+ * board after the capture is checked against every enemy slider rather than the pin map.
+ */
+static int en_passant_exposes_king(const ChessGame* game, int src, int dest) {
+    int color = game->currentPlayer;
+    Bitboard king = game->pieceBB[6 * color + 5];
+    if (0 == king)
+        return 0;
+    int square = LSB(king), captured = WHITE_PLAYER == color ? dest + 8 : dest - 8;
+    Bitboard occupied = (game->occupiedBB ^ SQUARE_BIT(src) ^ SQUARE_BIT(captured)) | SQUARE_BIT(dest);
+    const Bitboard* enemy = game->pieceBB + 6 * !color;
+    return 0 != ((pawn_attacks(king, color) & enemy[0] & ~SQUARE_BIT(captured)) | (knight_table[square] & enemy[1]) |
+                 (bishop_attacks(square, occupied) & (enemy[2] | enemy[4])) |
+                 (rook_attacks(square, occupied) & (enemy[3] | enemy[4])));
+}
+
+/*
+ * @brief Whether the player to move may castle with its king from src to dest: the right is held,
+ * the king and rook are in place, the squares between are empty, and the king is not in check
+ * and does not pass through or land on an attacked square.
+ */
+static int castling_allowed(const ChessGame* game, int src, int dest) {
+    int color = game->currentPlayer;
+    int home = WHITE_PLAYER == color ? 60 : 4;
+    int kingside = dest == home + 2;
+    int right = WHITE_PLAYER == color ? (kingside ? CASTLE_WHITE_KING : CASTLE_WHITE_QUEEN)
+                                      : (kingside ? CASTLE_BLACK_KING : CASTLE_BLACK_QUEEN);
+    int rook = kingside ? home + 3 : home - 4;
+    if (src != home || (dest != home + 2 && dest != home - 2) || !(game->castling & right))
+        return 0;
+    if (!(game->pieceBB[6 * color + 5] & SQUARE_BIT(home)) || !(game->pieceBB[6 * color + 3] & SQUARE_BIT(rook)))
+        return 0;
+    Bitboard path = between_table[home][dest] | SQUARE_BIT(dest);   // Squares the king crosses
+    return 0 == (between_table[home][rook] & game->occupiedBB) && 0 == game->checkersBB
+            && 0 == (path & game->attackBB[!color]);
+}
+
+/*
+ * @brief Whether a move of a piece of the player to move, valid by its geometry, leaves its own king in check.
+ */
+static int exposes_king(const ChessGame* game, int src, int dest) {
+    int color = game->currentPlayer;
+    if (game->pieceBB[6 * color + 5] & SQUARE_BIT(src))
+        return (dest - src == 2 || src - dest == 2) ? !castling_allowed(game, src, dest)
+                                                    : 0 != (game->attackBB[!color] & SQUARE_BIT(dest));
+    if (dest == game->epSquare && (game->pieceBB[6 * color] & SQUARE_BIT(src)))
+        return en_passant_exposes_king(game, src, dest);
+    return 0 == (legal_targets(game, src) & SQUARE_BIT(dest));
+}
+
+#define BOARD_ROW(n) #n " . . . . . . . . " #n "\n"
+#define BOARD_HEADER_LENGTH 31   // "\nChessboard:\n" and the file letters
+#define BOARD_ROW_LENGTH 20
+
+/*
+ * @brief The text of an empty board; render_chessboard only writes the 64 squares into a copy.
+ */
+static const char board_template[] =
+    "\nChessboard:\n  a b c d e f g h\n"
+    BOARD_ROW(8) BOARD_ROW(7) BOARD_ROW(6) BOARD_ROW(5) BOARD_ROW(4) BOARD_ROW(3) BOARD_ROW(2) BOARD_ROW(1)
+    "  a b c d e f g h\n";
+
+/**
+ * @brief Format the whole chessboard, as display_chessboard shows it, into one buffer.
+ *
+ * @param out Buffer of at least BOARD_TEXT_SIZE bytes.
+ * @return Length of the text, without its '\0'.
+ */
+size_t render_chessboard(char out[], const ChessGame* game) {
+    memcpy(out, board_template, sizeof(board_template));
+    for (int row = 0; row < 8; ++row) {
+        char* square = out + BOARD_HEADER_LENGTH + row * BOARD_ROW_LENGTH + 2;
+        for (int col = 0; col < 8; ++col)
+            square[2 * col] = game->chessboard[row][col];
+    }
+    return sizeof(board_template) - 1;
+}
+
+/*
+ * @brief Append a square and the piece now on it, as in " e4=P".
+ */
+static char* write_square(char* out, const ChessGame* game, int row, int col) {
+    *out++ = ' ';
+    *out++ = 'a' + col;
+    *out++ = '8' - row;
+    *out++ = '=';
+    *out++ = game->chessboard[row][col];
+    return out;
+}
+
+/**
+ * @brief Format only the squares changed by the last move, as in "Board: e2=. e4=P".
+ * @details A move changes its 2 squares, plus the rook's when castling or the captured pawn's
+ * en passant. The squares are found from the last move and its undo record.
+ *
+ * @param out Buffer of at least BOARD_DIFF_SIZE bytes.
+ * @return Length of the text, without its '\0'; 0 if the game has no last move.
+ */
+size_t render_last_move(char out[], const ChessGame* game) {
+    if (game->undoCount <= 0)
+        return 0;
+    const MoveUndo* undo = &game->history[(game->moveCount - 1) % MOVE_HISTORY_SIZE];
+    int src_row = MOVE_SRC(undo->move) >> 3, src_col = MOVE_SRC(undo->move) & 7;
+    int dest_row = MOVE_DEST(undo->move) >> 3, dest_col = MOVE_DEST(undo->move) & 7;
+    char piece = game->chessboard[dest_row][dest_col];
+
+    char* p = out;
+    memcpy(p, "Board:", 6);
+    p += 6;
+    p = write_square(p, game, src_row, src_col);
+    p = write_square(p, game, dest_row, dest_col);
+    if (undo->enPassant) {
+        p = write_square(p, game, src_row, dest_col);
+    } else if (('K' == piece || 'k' == piece) && (2 == dest_col - src_col || 2 == src_col - dest_col)) {
+        p = write_square(p, game, src_row, dest_col > src_col ? 7 : 0);   // The rook's start and end
+        p = write_square(p, game, src_row, (src_col + dest_col) / 2);
+    }
+    *p++ = '\n';
+    *p = '\0';
+    return p - out;
+}
+
+/*
+ * @brief Write a rendered text to stdout in one write, after what stdio holds.
+ */
+static void write_stdout(const char* text, size_t length) {
+    fflush(stdout);
+    while (length > 0) {
+        ssize_t n = write(STDOUT_FILENO, text, length);
+        if (n < 0 && EINTR != errno)
+            return;
+        if (n > 0) {
+            text += n;
+            length -= n;
+        }
+    }
+}
+
 /**
  * @brief Display the current state of chessboard.
  */
 void display_chessboard(const ChessGame* game) {
     if (NULL == game)
         return;
-    fprintf(stdout, "\nChessboard:\n");
-    fprintf(stdout, "  a b c d e f g h\n");
-    for (int row = 0; row < 8; ++row) {
-        fprintf(stdout, "%d ", 8 - row);
-        for (int col = 0; col < 8; ++col) 
-            fprintf(stdout, "%c ", game->chessboard[row][col]);
-        fprintf(stdout, "%d\n", 8 - row);
+    char text[BOARD_TEXT_SIZE];
+    write_stdout(text, render_chessboard(text, game));
+}
+
+/**
+ * @brief Display the squares changed by the last move, or the whole chessboard if there is none.
+ */
+void display_last_move(const ChessGame* game) {
+    char text[BOARD_DIFF_SIZE];
+    size_t length = render_last_move(text, game);
+    if (0 == length)
+        display_chessboard(game);
+    else
+        write_stdout(text, length);
+}
+
+/**
+ * @brief Whether the player to move is in check, checkmated or stalemated.
+ *
+ * @return GAME_PLAYING, GAME_CHECK, GAME_CHECKMATE or GAME_STALEMATE.
+ */
+int game_status(const ChessGame* game) {
+    ChessMove moves[MAX_GENERATED_MOVES];
+    if (generate_moves(game, moves) > 0)
+        return game->checkersBB ? GAME_CHECK : GAME_PLAYING;
+    return game->checkersBB ? GAME_CHECKMATE : GAME_STALEMATE;
+}
+
+/**
+ * @brief Tell the player to move that it is in check, or that the game is over.
+ */
+void display_status(const ChessGame* game) {
+    const char* player = WHITE_PLAYER == game->currentPlayer ? "White" : "Black";
+    switch (game_status(game)) {
+        case GAME_CHECK:
+            fprintf(stdout, "%s is in check.\n", player);
+            break;
+        case GAME_CHECKMATE:
+            fprintf(stdout, "Checkmate, %s wins.\n", WHITE_PLAYER == game->currentPlayer ? "black" : "white");
+            break;
+        case GAME_STALEMATE:
+            fprintf(stdout, "Stalemate, %s has no move.\n", player);
+            break;
     }
-    fprintf(stdout, "  a b c d e f g h\n");
 }
 
 /**
@@ -36,8 +671,12 @@ int initialize_game(ChessGame* game) {
         return -1;
 
     game->moveCount = 0;
-    game->capturedCount = 0;
+    game->undoCount = 0;
     game->currentPlayer = WHITE_PLAYER; 
+    game->castling = CASTLE_WHITE_KING | CASTLE_WHITE_QUEEN | CASTLE_BLACK_KING | CASTLE_BLACK_QUEEN;
+    game->epSquare = NO_SQUARE;
+    game->halfmoveClock = 0;
+    game->fullmoveNumber = 1;
     const char* b_row = "rnbqkbnr";
     const char* w_row = "RNBQKBNR";
     for (int col = 0; col < 8; ++col) {
@@ -48,85 +687,291 @@ int initialize_game(ChessGame* game) {
         game->chessboard[6][col] = 'P';
         game->chessboard[7][col] = w_row[col];
     }
+    sync_bitboards(game);
+    game->hash = compute_hash(game);
     return 0;
 }
 
+/*
+ * @brief Castling field of a FEN for each set of CASTLE_* bits.
+ */
+static const char* const fen_castling_fields[16] = {
+    "-", "K", "Q", "KQ", "k", "Kk", "Qk", "KQk", "q", "Kq", "Qq", "KQq", "kq", "Kkq", "Qkq", "KQkq"
+};
+
+/*
+ * @brief Write a counter of a FEN.
+ *
+ * @return End of the digits written.
+ */
+static char* write_counter(char* out, unsigned int value) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count > 0)
+        *out++ = digits[--count];
+    return out;
+}
+
 /**
  * @brief Storage the state of game in a string array in format of FEN.
+ * @details All six fields are written: board, side to move, castling rights, en passant square,
+ * halfmove clock and fullmove number. Each row is written from the occupancy bitboard,
+ * so only occupied squares are visited.
+ *
+ * @param size Size of fen; FEN_MAX_LENGTH always holds the FEN.
+ * @return 0 on success, FEN_BUFFER_TOO_SMALL if the FEN does not fit (fen is then left empty).
  */
-void chessboard_to_fen(char fen[], const ChessGame* game) {
-    int index = 0;
+int chessboard_to_fen(char fen[], size_t size, const ChessGame* game) {
+    char text[FEN_MAX_LENGTH];
+    char* out = text;
     for (int row = 0; row < 8; ++row) {
-        for (int col = 0; col < 8; ++col) {
-            if ('.' != game->chessboard[row][col]) {
-                fen[index] = game->chessboard[row][col];
-                index++;
-            } else {
-                int count = 0;
-                for (; col < 8; ++col) {
-                    if ('.' == game->chessboard[row][col])
-                        count++;
-                    else 
-                        break;
-                }
-                fen[index] = count + '0';
-                index++;
-                if (8 != col) {
-                    fen[index] = game->chessboard[row][col];
-                    index++;
-                }
-            }
+        unsigned int occupied = (unsigned int) (game->occupiedBB >> (8 * row)) & 0xFF;
+        int col = 0;
+        for (; occupied; occupied &= occupied - 1) {
+            int next = LSB(occupied);
+            if (next > col)
+                *out++ = '0' + next - col;
+            *out++ = game->chessboard[row][next];
+            col = next + 1;
         }
-        if (7 == row) fen[index] = ' ';
-        else fen[index] = '/';
-        index++;
+        if (col < 8)
+            *out++ = '0' + 8 - col;
+        *out++ = 7 == row ? ' ' : '/';
+    }
+    *out++ = WHITE_PLAYER == game->currentPlayer ? 'w' : 'b';
+    *out++ = ' ';
+    const char* castling = fen_castling_fields[game->castling & 0xF];
+    size_t length = strlen(castling);
+    memcpy(out, castling, length);
+    out += length;
+    *out++ = ' ';
+    if (NO_SQUARE != game->epSquare) {
+        *out++ = 'a' + (game->epSquare & 7);
+        *out++ = '8' - (game->epSquare >> 3);
+    } else {
+        *out++ = '-';
+    }
+    *out++ = ' ';
+    out = write_counter(out, (unsigned int) game->halfmoveClock);
+    *out++ = ' ';
+    out = write_counter(out, (unsigned int) game->fullmoveNumber);
+    *out = '\0';
+
+    length = out - text;
+    if (length + 1 > size) {
+        if (size > 0)
+            fen[0] = '\0';
+        return FEN_BUFFER_TOO_SMALL;
+    }
+    memcpy(fen, text, length + 1);
+    return 0;
+}
+
+/*
+ * @brief Castling rights whose king and rook are on their starting squares.
+ */
+static int castling_in_place(const ChessGame* game) {
+    static const int rights[4][3] = {   // Right, king square, rook square
+        { CASTLE_WHITE_KING, 60, 63 }, { CASTLE_WHITE_QUEEN, 60, 56 }, { CASTLE_BLACK_KING, 4, 7 }, { CASTLE_BLACK_QUEEN, 4, 0 }
+    };
+    int castling = 0;
+    for (int i = 0; i < 4; ++i) {
+        int offset = i < 2 ? 0 : 6;
+        if ((game->pieceBB[offset + 5] & SQUARE_BIT(rights[i][1])) && (game->pieceBB[offset + 3] & SQUARE_BIT(rights[i][2])))
+            castling |= rights[i][0];
     }
+    return castling;
+}
 
-    fen[index] = game->currentPlayer == WHITE_PLAYER ? 'w' : 'b';
-    index++;
-    fen[index] = '\0';
+/*
+ * @brief En passant square of the player to move, for an enemy pawn that just moved 2 rows past it.
+ * @details The square is only kept when a pawn of the player to move could capture there,
+ * so positions that differ in nothing else share one hash.
+ *
+ * @return The square, NO_SQUARE if no capture is possible.
+ */
+static int en_passant_square(const ChessGame* game, int square) {
+    int color = game->currentPlayer;
+    int pawn = WHITE_PLAYER == color ? square + 8 : square - 8;
+    if ((square >> 3) != (WHITE_PLAYER == color ? 2 : 5) || (game->occupiedBB & SQUARE_BIT(square)) ||
+            !(game->pieceBB[6 * !color] & SQUARE_BIT(pawn)))
+        return NO_SQUARE;
+    return (pawn_attacks(SQUARE_BIT(square), !color) & game->pieceBB[6 * color]) ? square : NO_SQUARE;
+}
+
+/*
+ * @brief What each character means in the board field of a FEN: the character written on the squares
+ * it covers, how many squares it covers, and 1 + its index in PIECE_CHARS (0 if it is not a piece).
+ * A character with no entry is invalid; '/' covers no square.
+ */
+typedef struct {
+    char fill;
+    unsigned char width;
+    unsigned char piece;
+} FenSquares;
+
+static const FenSquares fen_board_chars[128] = {
+    ['P'] = { 'P', 1, 1 }, ['N'] = { 'N', 1, 2 }, ['B'] = { 'B', 1, 3 }, ['R'] = { 'R', 1, 4 }, ['Q'] = { 'Q', 1, 5 }, ['K'] = { 'K', 1, 6 },
+    ['p'] = { 'p', 1, 7 }, ['n'] = { 'n', 1, 8 }, ['b'] = { 'b', 1, 9 }, ['r'] = { 'r', 1, 10 }, ['q'] = { 'q', 1, 11 }, ['k'] = { 'k', 1, 12 },
+    ['1'] = { '.', 1, 0 }, ['2'] = { '.', 2, 0 }, ['3'] = { '.', 3, 0 }, ['4'] = { '.', 4, 0 },
+    ['5'] = { '.', 5, 0 }, ['6'] = { '.', 6, 0 }, ['7'] = { '.', 7, 0 }, ['8'] = { '.', 8, 0 },
+    ['/'] = { '/', 0, 0 },
+};
+
+/*
+ * @brief CASTLE_* bit of each character of the castling field of a FEN, 0 if invalid.
+ */
+static const unsigned char fen_castling_chars[128] = {
+    ['K'] = CASTLE_WHITE_KING, ['Q'] = CASTLE_WHITE_QUEEN, ['k'] = CASTLE_BLACK_KING, ['q'] = CASTLE_BLACK_QUEEN,
+};
+
+/*
+ * @brief Whether a character ends a field of a FEN.
+ */
+static int fen_field_end(char c) {
+    return ' ' == c || '\t' == c || '\0' == c || '\r' == c || '\n' == c;
+}
+
+/*
+ * @brief Skip the spaces before the next field of a FEN.
+ *
+ * @return Start of the next field, NULL if the FEN ends here (only line endings may follow).
+ */
+static const char* next_fen_field(const char* p) {
+    while (' ' == *p || '\t' == *p)
+        p++;
+    return '\0' == *p || '\r' == *p || '\n' == *p ? NULL : p;
+}
+
+/*
+ * @brief Read a halfmove or fullmove counter of at most FEN_COUNTER_DIGITS digits.
+ *
+ * @return End of the counter, NULL if it is not one.
+ */
+static const char* read_counter(const char* p, int* value) {
+    const char* begin = p;
+    *value = 0;
+    for (; *p >= '0' && *p <= '9' && p - begin < FEN_COUNTER_DIGITS; ++p)
+        *value = 10 * *value + (*p - '0');
+    return p == begin || !fen_field_end(*p) ? NULL : p;
 }
 
 /**
  * @brief Parse the FEN string and modify the state of game.
+ * @details The board and side to move may be followed by the castling rights ("KQkq" or "-"),
+ * the en passant square ("e3" or "-"), the halfmove clock and the fullmove number. Without
+ * castling rights, castling is allowed wherever the king and rook are in place. Every field is
+ * checked, and the squares are written through lookup tables, before the game is changed.
+ *
+ * @return 0 on success, or FEN_INVALID_BOARD, FEN_INVALID_SIDE, FEN_INVALID_CASTLING,
+ * FEN_INVALID_EN_PASSANT, FEN_INVALID_COUNTER or FEN_TRAILING_TEXT; the game is unchanged on error.
  */
-void fen_to_chessboard(const char* fen, ChessGame* game) {
-    int index = 0, col = 0;
-    char current;
-    for (int row = 0; row < 8; ++row) {
-        while ('/' != (current = fen[index]) && ' ' != current) {
-            index++;
-            if (current >= '0' && current <= '9') {
-                for (int i = 0; i < current - '0'; ++i) {
-                    game->chessboard[row][col] = '.';
-                    col++;
-                }
-            } else {
-                game->chessboard[row][col] = current;
-                col++;
+int fen_to_chessboard(const char* fen, ChessGame* game) {
+    char board[64 + 8];   // A run of empty squares is written 8 wide
+    Bitboard pieces[PIECE_TYPES + 1] = { 0 };   // pieces[0] collects the empty squares
+    int square = 0, row_end = 8;
+    const char* p = fen;
+    for (; !fen_field_end(*p); ++p) {
+        if ((unsigned char) *p >= 128)
+            return FEN_INVALID_BOARD;
+        const FenSquares* entry = &fen_board_chars[(int) *p];
+        if ('\0' == entry->fill || square + entry->width > row_end)
+            return FEN_INVALID_BOARD;
+        if ('/' == entry->fill) {
+            if (square != row_end || 64 == row_end)
+                return FEN_INVALID_BOARD;
+            row_end += 8;
+            continue;
+        }
+        memset(board + square, entry->fill, 8);
+        pieces[entry->piece] |= SQUARE_BIT(square);
+        square += entry->width;
+    }
+    if (64 != square)
+        return FEN_INVALID_BOARD;
+
+    p = next_fen_field(p);
+    if (NULL == p || ('w' != *p && 'b' != *p) || !fen_field_end(p[1]))
+        return FEN_INVALID_SIDE;
+    int player = 'w' == *p ? WHITE_PLAYER : BLACK_PLAYER;
+
+    int castling = -1, passant = NO_SQUARE, halfmove = 0, fullmove = 1;
+    p = next_fen_field(p + 1);
+    if (NULL != p) {
+        castling = 0;
+        if ('-' == *p) {
+            p++;
+        } else {
+            for (; !fen_field_end(*p); ++p) {
+                int right = (unsigned char) *p < 128 ? fen_castling_chars[(int) *p] : 0;
+                if (0 == right || (castling & right))
+                    return FEN_INVALID_CASTLING;
+                castling |= right;
             }
         }
-        index++;
-        col = 0;
+        if (!fen_field_end(*p))
+            return FEN_INVALID_CASTLING;
+        p = next_fen_field(p);
+    }
+    if (NULL != p) {
+        if ('-' != *p) {
+            if (*p < 'a' || *p > 'h' || p[1] != (WHITE_PLAYER == player ? '6' : '3'))
+                return FEN_INVALID_EN_PASSANT;
+            passant = SQUARE('8' - p[1], *p - 'a');
+            p++;
+        }
+        if (!fen_field_end(p[1]))
+            return FEN_INVALID_EN_PASSANT;
+        p = next_fen_field(p + 1);
+    }
+    if (NULL != p) {
+        p = read_counter(p, &halfmove);
+        if (NULL == p)
+            return FEN_INVALID_COUNTER;
+        p = next_fen_field(p);
+    }
+    if (NULL != p) {
+        p = read_counter(p, &fullmove);
+        if (NULL == p || 0 == fullmove)
+            return FEN_INVALID_COUNTER;
+        if (NULL != next_fen_field(p))
+            return FEN_TRAILING_TEXT;
     }
 
-    current = fen[index];
-    if (current == 'w')
-        game->currentPlayer = WHITE_PLAYER;
-    else 
-        game->currentPlayer = BLACK_PLAYER;
+    memcpy(game->chessboard, board, 64);
+    memcpy(game->pieceBB, pieces + 1, sizeof(game->pieceBB));
+    game->colorBB[WHITE_PLAYER] = pieces[1] | pieces[2] | pieces[3] | pieces[4] | pieces[5] | pieces[6];
+    game->colorBB[BLACK_PLAYER] = pieces[7] | pieces[8] | pieces[9] | pieces[10] | pieces[11] | pieces[12];
+    game->occupiedBB = game->colorBB[WHITE_PLAYER] | game->colorBB[BLACK_PLAYER];
+    game->currentPlayer = player;
+    game->moveCount = 0;        // History does not lead to this position
+    game->undoCount = 0;
+    game->castling = castling_in_place(game) & (castling < 0 ? 0xF : castling);
+    game->epSquare = NO_SQUARE == passant ? NO_SQUARE : en_passant_square(game, passant);
+    game->halfmoveClock = halfmove;
+    game->fullmoveNumber = fullmove;
+    update_attacks(game);
+    game->hash = compute_hash(game);
+    return 0;
 }
 
 /**
  * @brief Verify if the pawn piece is moving correctly.
  * @details A pawn can only move 2 spaces on its starting row.
  *          Otherwise, it can only move 1 space up (for white player) or down (for black player).
- *          A pawn can move 1 space diagonally if it is able to catch another piece.
+ *          A pawn can move 1 space diagonally if it is able to catch another piece,
+ *          or a pawn that just moved 2 spaces past that square (en passant).
  * 
  * @return 1 if pawn moves valid, 0 otherwise.
  */
 int is_valid_pawn_move(char piece, int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game) {
     int length = dest_row - src_row;
+    Bitboard dest = SQUARE_BIT(SQUARE(dest_row, dest_col));
+    Bitboard passant = NO_SQUARE != game->epSquare ? SQUARE_BIT(game->epSquare) : 0;
     if ('P' == piece) {   // While piece
         if (src_col != dest_col) {
             if (-1 != length)
@@ -134,33 +979,31 @@ int is_valid_pawn_move(char piece, int src_row, int src_col, int dest_row, int d
             int h = src_col - dest_col;
             if (-1 != h && 1 != h)
                 return 0;
-            return !is_white(game->chessboard[dest_row][dest_col]) && 
-                    '.' != game->chessboard[dest_row][dest_col];
+            return 0 != ((game->colorBB[BLACK_PLAYER] | (WHITE_PLAYER == game->currentPlayer ? passant : 0)) & dest);
         }
 
         if (-2 == length) {
             if (6 == src_row)
-                return '.' == game->chessboard[dest_row + 1][dest_col];
+                return 0 == (game->occupiedBB & (dest | dest << 8));
             return 0;
         }
-        return -1 == length && '.' == game->chessboard[dest_row][dest_col];
+        return -1 == length && 0 == (game->occupiedBB & dest);
     } else if ('p' == piece) {   // Black piece
         if (src_col != dest_col) {
-            if (1 == length)
+            if (1 != length)
                 return 0;
             int h = src_col - dest_col;
             if (-1 != h && 1 != h)
                 return 0;
-            return is_white(game->chessboard[dest_row][dest_col]) && 
-                    '.' != game->chessboard[dest_row][dest_col];
+            return 0 != ((game->colorBB[WHITE_PLAYER] | (BLACK_PLAYER == game->currentPlayer ? passant : 0)) & dest);
         }
 
         if (2 == length) {
             if (1 == src_row)
-                return '.' == game->chessboard[dest_row - 1][dest_col];
+                return 0 == (game->occupiedBB & (dest | dest >> 8));
             return 0;
         }
-        return 1 == length && '.' == game->chessboard[dest_row][dest_col];
+        return 1 == length && 0 == (game->occupiedBB & dest);
     } else {   // Invalid piece
         return 0;
     }
@@ -173,19 +1016,7 @@ int is_valid_pawn_move(char piece, int src_row, int src_col, int dest_row, int d
  * @return 1 if rook moves valid, 0 otherwise.
  */
 int is_valid_rook_move(int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game) {
-    if (src_row != dest_row && src_col != dest_col)
-        return 0;
-
-    int length = abs(src_row - dest_row) + abs(src_col - dest_col) - 1;
-    int row_incre = (dest_row > src_row) - (dest_row < src_row);
-    int col_incre = (dest_col > src_col) - (dest_col < src_col);
-    for (int i = 0; i < length; ++i) {
-        src_row += row_incre;
-        src_col += col_incre;
-        if ('.' != game->chessboard[src_row][src_col])
-            return 0;
-    }
-    return 1;
+    return 0 != (rook_attacks(SQUARE(src_row, src_col), game->occupiedBB) & SQUARE_BIT(SQUARE(dest_row, dest_col)));
 }
 
 /**
@@ -195,9 +1026,7 @@ int is_valid_rook_move(int src_row, int src_col, int dest_row, int dest_col, con
  * @return 1 if knight moves valid, 0 otherwise.
  */
 int is_valid_knight_move(int src_row, int src_col, int dest_row, int dest_col) {
-    if (src_row == dest_row || src_col == dest_col)
-        return 0;
-    return 6 == (abs(src_row - dest_row) + 1) * (abs(src_col - dest_col) + 1);
+    return 0 != (knight_table[SQUARE(src_row, src_col)] & SQUARE_BIT(SQUARE(dest_row, dest_col)));
 }
 
 /**
@@ -207,19 +1036,7 @@ int is_valid_knight_move(int src_row, int src_col, int dest_row, int dest_col) {
  * @return 1 if bishop moves valid, 0 otherwise.
  */
 int is_valid_bishop_move(int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game) {
-    if (abs(src_row - dest_row) != abs(src_col - dest_col))
-        return 0;
-    
-    int length = abs(src_row - dest_row) - 1;
-    int row_incre = src_row < dest_row;
-    int col_incre = src_col < dest_col;
-    for (int i = 0; i < length; ++i) {
-        src_row += (row_incre ? 1 : -1);
-        src_col += (col_incre ? 1 : -1);
-        if ('.' != game->chessboard[src_row][src_col])
-            return 0;
-    }
-    return 1;
+    return 0 != (bishop_attacks(SQUARE(src_row, src_col), game->occupiedBB) & SQUARE_BIT(SQUARE(dest_row, dest_col)));
 }
 
 /**
@@ -229,9 +1046,9 @@ int is_valid_bishop_move(int src_row, int src_col, int dest_row, int dest_col, c
  * @return 1 if queen moves valid, 0 otherwise.
  */
 int is_valid_queen_move(int src_row, int src_col, int dest_row, int dest_col, const ChessGame* game) {
-    if (src_row == dest_row || src_col == dest_col) 
-        return is_valid_rook_move(src_row, src_col, dest_row, dest_col, game);
-    return is_valid_bishop_move(src_row, src_col, dest_row, dest_col, game);
+    int square = SQUARE(src_row, src_col);
+    Bitboard attacks = rook_attacks(square, game->occupiedBB) | bishop_attacks(square, game->occupiedBB);
+    return 0 != (attacks & SQUARE_BIT(SQUARE(dest_row, dest_col)));
 }
 
 /**
@@ -241,17 +1058,14 @@ int is_valid_queen_move(int src_row, int src_col, int dest_row, int dest_col, co
  * @return 1 if king moves valid, 0 otherwise.
  */
 int is_valid_king_move(int src_row, int src_col, int dest_row, int dest_col) {
-    if (src_row == dest_row)
-        return 1 == abs(src_col - dest_col);
-    if (src_col == dest_col)
-        return 1 == abs(src_row - dest_row);
-    return 1 == abs(src_row - dest_row) && 1 == abs(src_col - dest_col);
+    return 0 != (king_table[SQUARE(src_row, src_col)] & SQUARE_BIT(SQUARE(dest_row, dest_col)));
 }
 
 /**
  * @brief verify if the piece is moving correctly.
  * @details This function will be passed the starting and ending location of a piece,
- * then verify if this piece can be able to move.
+ * then verify if this piece can be able to move. Castling and en passant are allowed for
+ * the player to move; whether the move leaves its own king in check is left to make_move.
  * 
  * @return 1 if the piece moves valid, 0 otherwise.
  */
@@ -285,7 +1099,8 @@ int is_valid_move(char piece, int src_row, int src_col, int dest_row, int dest_c
             break;
         case 'K':
         case 'k':
-            ret = is_valid_king_move(src_row, src_col, dest_row, dest_col);
+            ret = is_valid_king_move(src_row, src_col, dest_row, dest_col) ||
+                  castling_allowed(game, SQUARE(src_row, src_col), SQUARE(dest_row, dest_col));
             break;
         default:
             return 0;
@@ -294,8 +1109,8 @@ int is_valid_move(char piece, int src_row, int src_col, int dest_row, int dest_c
     if (!ret) 
         return 0;
     // Check if capture same color
-    return is_white(game->chessboard[src_row][src_col]) != is_white(game->chessboard[dest_row][dest_col]) || 
-            '.' == game->chessboard[dest_row][dest_col];
+    int color = PIECE_COLOR(piece_index(piece));
+    return 0 == (game->colorBB[color] & SQUARE_BIT(SQUARE(dest_row, dest_col)));
 }
 
 /**
@@ -322,100 +1137,396 @@ int parse_move(const char* move, ChessMove* parsed_move) {
         return PARSE_MOVE_OUT_OF_BOUNDS;
     
     // Parse promotion
+    char promotion = 0;
     if (5 == length) {
         if ('8' != move[3] && '1' != move[3])  // Not reach to the last row
             return PARSE_MOVE_INVALID_DESTINATION;
         if ('r' != move[4] && 'b' != move[4] && 'n' != move[4] && 'q' != move[4])
             return PARSE_MOVE_INVALID_PROMOTION;
-        parsed_move->endSquare[2] = move[4];
-        parsed_move->endSquare[3] = '\0';
+        promotion = move[4];
+    }
+    set_move(parsed_move, SQUARE('8' - move[1], move[0] - 'a'), SQUARE('8' - move[3], move[2] - 'a'), promotion);
+    return 0;
+}
+
+/**
+ * @brief Pack a ChessMove from square indexes.
+ * @details The same 16 bits are the move in the journal, the opening book and binary frames.
+ * 0 never encodes a real move, since source and destination would be the same.
+ * 
+ * @param promotion Promotion piece ('q', 'r', 'b' or 'n'), 0 if not a promotion.
+ */
+void set_move(ChessMove* move, int src, int dest, char promotion) {
+    int code = 0;
+    switch (promotion) {
+        case 'n': code = 1; break;
+        case 'b': code = 2; break;
+        case 'r': code = 3; break;
+        case 'q': code = 4; break;
+    }
+    *move = (ChessMove) (src | dest << 6 | code << 12);
+}
+
+/**
+ * @brief Write a move as the text of /move, as "e2e4" or "e7e8q".
+ *
+ * @param text Buffer of at least MOVE_TEXT_SIZE bytes.
+ * @return text
+ */
+char* move_to_text(ChessMove move, char text[]) {
+    int src = MOVE_SRC(move), dest = MOVE_DEST(move);
+    text[0] = 'a' + (src & 7);
+    text[1] = '8' - (src >> 3);
+    text[2] = 'a' + (dest & 7);
+    text[3] = '8' - (dest >> 3);
+    text[4] = promotion_chars[MOVE_PROMOTION(move)];
+    text[5] = '\0';
+    return text;
+}
+
+/**
+ * @brief Resolve a move in Standard Algebraic Notation, such as "Nf3", "exd5", "e8=Q+" or "O-O".
+ * @details The move must be one of generate_moves, which are all legal, as SAN only tells legal moves apart.
+ *
+ * @return 0 if resolved, PARSE_MOVE_INVALID_FORMAT if it is not SAN,
+ * PARSE_MOVE_INVALID_DESTINATION if no move, or more than one, fits.
+ */
+int parse_san(const ChessGame* game, const char* san, ChessMove* move) {
+    char text[16];
+    size_t length = strcspn(san, "+#!?");
+    if (0 == length || length >= sizeof(text))
+        return PARSE_MOVE_INVALID_FORMAT;
+    memcpy(text, san, length);
+    text[length] = '\0';
+
+    int white = WHITE_PLAYER == game->currentPlayer;
+    int from_row = -1, from_col = -1, dest;
+    char piece = 'P', promotion = 0;
+    if (0 == strcmp(text, "O-O") || 0 == strcmp(text, "0-0") || 0 == strcmp(text, "O-O-O") || 0 == strcmp(text, "0-0-0")) {
+        piece = 'K';
+        from_row = white ? 7 : 0;
+        from_col = 4;
+        dest = SQUARE(from_row, 5 == length ? 2 : 6);
     } else {
-        parsed_move->endSquare[2] = '\0';
+        char* p = text;
+        if (NULL != strchr("NBRQK", *p))
+            piece = *p++;
+        if (length >= 2 && NULL != strchr("NBRQ", text[length - 1])) {
+            promotion = tolower(text[--length]);
+            if ('=' == text[length - 1])
+                length--;
+        }
+        if (text + length - p < 2)
+            return PARSE_MOVE_INVALID_FORMAT;
+        char file = text[length - 2], rank = text[length - 1];
+        if (file < 'a' || file > 'h' || rank < '1' || rank > '8')
+            return PARSE_MOVE_INVALID_FORMAT;
+        dest = SQUARE('8' - rank, file - 'a');
+        for (; p < text + length - 2; ++p) {   // Disambiguation and capture mark
+            if (*p >= 'a' && *p <= 'h')
+                from_col = *p - 'a';
+            else if (*p >= '1' && *p <= '8')
+                from_row = '8' - *p;
+            else if ('x' != *p && ':' != *p)
+                return PARSE_MOVE_INVALID_FORMAT;
+        }
     }
 
-    parsed_move->startSquare[0] = move[0];
-    parsed_move->startSquare[1] = move[1];
-    parsed_move->startSquare[2] = '\0';
+    char own = white ? piece : tolower(piece);
+    ChessMove moves[MAX_GENERATED_MOVES];
+    int count = generate_moves(game, moves), found = 0;
+    for (int i = 0; i < count; ++i) {
+        int row = MOVE_SRC(moves[i]) >> 3, col = MOVE_SRC(moves[i]) & 7;
+        if (MOVE_DEST(moves[i]) != dest
+                || game->chessboard[row][col] != own || promotion_chars[MOVE_PROMOTION(moves[i])] != promotion
+                || (from_row >= 0 && row != from_row) || (from_col >= 0 && col != from_col))
+            continue;
+        *move = moves[i];
+        found++;
+    }
+    return 1 == found ? 0 : PARSE_MOVE_INVALID_DESTINATION;
+}
 
-    parsed_move->endSquare[0] = move[2];
-    parsed_move->endSquare[1] = move[3];
-    return 0;
+/*
+ * @brief Append one move per target square, or the four promotions if it reaches the last row.
+ */
+static int add_moves(ChessMove* out, int count, int src, Bitboard targets, int is_pawn) {
+    while (targets) {
+        int dest = LSB(targets);
+        targets &= targets - 1;
+        if (is_pawn && (dest < 8 || dest >= 56)) {
+            set_move(&out[count++], src, dest, 'q');
+            set_move(&out[count++], src, dest, 'r');
+            set_move(&out[count++], src, dest, 'b');
+            set_move(&out[count++], src, dest, 'n');
+        } else {
+            set_move(&out[count++], src, dest, 0);
+        }
+    }
+    return count;
+}
+
+/*
+ * @brief Append pawn moves whose source is dest - shift, if they do not leave the king in check.
+ */
+static int add_pawn_moves(const ChessGame* game, ChessMove* out, int count, Bitboard targets, int shift) {
+    while (targets) {
+        int dest = LSB(targets);
+        count = add_moves(out, count, dest - shift, SQUARE_BIT(dest) & legal_targets(game, dest - shift), 1);
+        targets &= targets - 1;
+    }
+    return count;
 }
 
 /**
- * @brief Implement the ChessMove on the chess board.
+ * @brief Generate every legal move of the current player.
+ * @details The generated moves are exactly the ones make_move accepts with validation,
+ * including castling, en passant and one ChessMove per promotion piece. None leaves the king
+ * in check, which the attack and pin maps tell without making the move. No memory is allocated.
  * 
- * @param game Chess board
- * @param move Move
- * @param is_client If it's the client site calling the function
- * @param validate_move 1 if assume ChessMove itself is correct, 0 otherwise
- * @return 0 if the move is success made.
+ * @param out Buffer of at least MAX_GENERATED_MOVES moves.
+ * @return Number of moves written to out, 0 if the player is checkmated or stalemated.
  */
-int make_move(ChessGame* game, const ChessMove* move, int is_client, int validate_move) {
-    int src_row = '8' - move->startSquare[1];
-    int src_col = move->startSquare[0] - 'a';
-    int dest_row = '8' - move->endSquare[1];
-    int dest_col = move->endSquare[0] - 'a';
+int generate_moves(const ChessGame* game, ChessMove* out) {
+    int color = game->currentPlayer;
+    int offset = WHITE_PLAYER == color ? 0 : 6;
+    Bitboard own = game->colorBB[color];
+    Bitboard enemy = game->colorBB[!color];
+    Bitboard empty = ~game->occupiedBB;
+    int count = 0;
+
+    // Pawns move by shifts of the whole set
+    Bitboard pawns = game->pieceBB[offset];
+    if (WHITE_PLAYER == color) {
+        Bitboard single = (pawns >> 8) & empty;
+        count = add_pawn_moves(game, out, count, single, -8);
+        count = add_pawn_moves(game, out, count, ((single & (0xFFULL << 40)) >> 8) & empty, -16);
+        count = add_pawn_moves(game, out, count, (pawns >> 9) & ~FILE_H & enemy, -9);
+        count = add_pawn_moves(game, out, count, (pawns >> 7) & ~FILE_A & enemy, -7);
+    } else {
+        Bitboard single = (pawns << 8) & empty;
+        count = add_pawn_moves(game, out, count, single, 8);
+        count = add_pawn_moves(game, out, count, ((single & (0xFFULL << 16)) << 8) & empty, 16);
+        count = add_pawn_moves(game, out, count, (pawns << 7) & ~FILE_H & enemy, 7);
+        count = add_pawn_moves(game, out, count, (pawns << 9) & ~FILE_A & enemy, 9);
+    }
+    if (NO_SQUARE != game->epSquare) {
+        for (Bitboard set = pawn_attacks(SQUARE_BIT(game->epSquare), !color) & pawns; set; set &= set - 1) {
+            if (!en_passant_exposes_king(game, LSB(set), game->epSquare))
+                set_move(&out[count++], LSB(set), game->epSquare, 0);
+        }
+    }
+
+    for (int piece = offset + 1; piece < offset + 5; ++piece) {
+        Bitboard set = game->pieceBB[piece];
+        while (set) {
+            int src = LSB(set);
+            Bitboard targets;
+            switch (PIECE_CHARS[piece - offset]) {
+                case 'N':
+                    targets = knight_table[src];
+                    break;
+                case 'B':
+                    targets = bishop_attacks(src, game->occupiedBB);
+                    break;
+                case 'R':
+                    targets = rook_attacks(src, game->occupiedBB);
+                    break;
+                default:
+                    targets = rook_attacks(src, game->occupiedBB) | bishop_attacks(src, game->occupiedBB);
+                    break;
+            }
+            count = add_moves(out, count, src, targets & ~own & legal_targets(game, src), 0);
+            set &= set - 1;
+        }
+    }
+
+    Bitboard king = game->pieceBB[offset + 5];
+    if (king) {
+        int src = LSB(king);
+        count = add_moves(out, count, src, king_table[src] & ~own & ~game->attackBB[!color], 0);
+        for (int dest = src - 2; dest <= src + 2; dest += 4) {
+            if (game->castling && castling_allowed(game, src, dest))
+                set_move(&out[count++], src, dest, 0);
+        }
+    }
+    return count;
+}
+
+/*
+ * @brief Implement the ChessMove on the chess board, as make_move without its timing.
+ */
+static int apply_move(ChessGame* game, const ChessMove* move, int is_client, int validate_move) {
+    int src_row = MOVE_SRC(*move) >> 3;
+    int src_col = MOVE_SRC(*move) & 7;
+    int dest_row = MOVE_DEST(*move) >> 3;
+    int dest_col = MOVE_DEST(*move) & 7;
     char start = game->chessboard[src_row][src_col];
     char end = game->chessboard[dest_row][dest_col];
-    int endLength = (int) strlen(move->endSquare);
+    char promotion = promotion_chars[MOVE_PROMOTION(*move)];
 
     // Validate ChessMove
     if (validate_move) {
+        int color = is_client ? WHITE_PLAYER : BLACK_PLAYER;
         if (is_client == game->currentPlayer)  // Out of turn
             return MOVE_OUT_OF_TURN;
-        if ('.' == start) 
+        if (0 == (game->occupiedBB & SQUARE_BIT(SQUARE(src_row, src_col))))
             return MOVE_NOTHING;
-        if ((is_client && !is_white(start)) || (!is_client && is_white(start)))
+        if (0 == (game->colorBB[color] & SQUARE_BIT(SQUARE(src_row, src_col))))
             return MOVE_WRONG_COLOR;
-        if ('.' != end) {
-            if ((is_client && is_white(end)) || (!is_client && !is_white(end)))
-                return MOVE_SUS;
-        }
+        if (game->colorBB[color] & SQUARE_BIT(SQUARE(dest_row, dest_col)))
+            return MOVE_SUS;
 
-        if (('P' != start && 'p' != start) && 3 == endLength) 
+        if (('P' != start && 'p' != start) && promotion) 
             return MOVE_NOT_A_PAWN;
-        if (3 != endLength) {
+        if (!promotion) {
             if ('P' == start && 0 == dest_row) 
                 return MOVE_MISSING_PROMOTION;
             else if ('p' == start && 7 == dest_row)
                 return MOVE_MISSING_PROMOTION;
         }
         
-        if (!is_valid_move(start, src_row, src_col, dest_row, dest_col, game))
+        uint64_t begin = stats_clock();
+        int valid = is_valid_move(start, src_row, src_col, dest_row, dest_col, game);
+        stats_record(STAT_IS_VALID_MOVE, begin);
+        if (!valid)
             return MOVE_WRONG;
+        if (exposes_king(game, SQUARE(src_row, src_col), SQUARE(dest_row, dest_col)))
+            return MOVE_KING_IN_CHECK;
+        TRACE_EVENT(TRACE_VALIDATED, 'm', *move);
+    }
+
+    MoveUndo* undo = &game->history[game->moveCount % MOVE_HISTORY_SIZE];
+    int pawn = 'P' == start || 'p' == start;
+    undo->enPassant = pawn && src_col != dest_col && '.' == end;
+    undo->castling = (char) game->castling;
+    undo->epSquare = (signed char) game->epSquare;
+    undo->halfmoveClock = game->halfmoveClock;
+    if (undo->enPassant) {   // The captured pawn is beside the capturing one
+        end = game->chessboard[src_row][dest_col];
+        put_piece(game, src_row, dest_col, '.');
+    } else if (('K' == start || 'k' == start) && 2 == abs(dest_col - src_col)) {   // Castling moves the rook too
+        put_piece(game, src_row, dest_col > src_col ? 5 : 3, game->chessboard[src_row][dest_col > src_col ? 7 : 0]);
+        put_piece(game, src_row, dest_col > src_col ? 7 : 0, '.');
     }
 
-    game->chessboard[src_row][src_col] = '.';
-    game->chessboard[dest_row][dest_col] = start;
-    if ('P' == start && 3 == endLength)        // Promotion white
-        game->chessboard[dest_row][dest_col] = toupper(move->endSquare[2]);
-    else if ('p' == start && 3 == endLength)   // Promotion black
-        game->chessboard[dest_row][dest_col] = move->endSquare[2]; 
+    put_piece(game, src_row, src_col, '.');
+    if ('P' == start && promotion)        // Promotion white
+        put_piece(game, dest_row, dest_col, toupper(promotion));
+    else if ('p' == start && promotion)   // Promotion black
+        put_piece(game, dest_row, dest_col, promotion);
+    else
+        put_piece(game, dest_row, dest_col, start);
+    game->occupiedBB = game->colorBB[WHITE_PLAYER] | game->colorBB[BLACK_PLAYER];
 
-    game->moves[game->moveCount] = *move;
+    undo->move = *move;
+    undo->captured = end;
+    undo->promoted = pawn && promotion;
     game->moveCount++;
-    if ('.' != end) {  // Capture
-        game->capturedPieces[game->capturedCount] = end;
-        game->capturedCount++;
-    }
+    game->undoCount += MOVE_HISTORY_SIZE != game->undoCount;
     
-    // Update player
+    // Update player, counters, castling rights and en passant square
+    game->halfmoveClock = pawn || '.' != end ? 0 : game->halfmoveClock + 1;
+    game->fullmoveNumber += BLACK_PLAYER == game->currentPlayer;
     game->currentPlayer = game->currentPlayer ? WHITE_PLAYER : BLACK_PLAYER;
+    game->hash ^= zobrist_side ^ zobrist_castling[game->castling];
+    game->castling &= ~(castling_lost[SQUARE(src_row, src_col)] | castling_lost[SQUARE(dest_row, dest_col)]);
+    game->hash ^= zobrist_castling[game->castling];
+    if (NO_SQUARE != game->epSquare)
+        game->hash ^= zobrist_ep[game->epSquare & 7];
+    game->epSquare = pawn && 2 == abs(dest_row - src_row) ? en_passant_square(game, SQUARE((src_row + dest_row) / 2, src_col)) : NO_SQUARE;
+    if (NO_SQUARE != game->epSquare)
+        game->hash ^= zobrist_ep[game->epSquare & 7];
+    update_attacks(game);
     return 0;
 }
 
+/**
+ * @brief Take back the last move made by make_move.
+ * @details The board, bitboards, hash, current player, castling rights, en passant square and move
+ * counters are restored from the last record of the history, without copying the game. The history
+ * holds the last MOVE_HISTORY_SIZE moves, as many as a search takes back.
+ * 
+ * @return 0 if a move was taken back, -1 if there is no move in the history.
+ */
+int unmake_move(ChessGame* game) {
+    if (0 == game->undoCount)
+        return -1;
+    game->moveCount--;
+    game->undoCount--;
+    const MoveUndo* undo = &game->history[game->moveCount % MOVE_HISTORY_SIZE];
+    int src_row = MOVE_SRC(undo->move) >> 3;
+    int src_col = MOVE_SRC(undo->move) & 7;
+    int dest_row = MOVE_DEST(undo->move) >> 3;
+    int dest_col = MOVE_DEST(undo->move) & 7;
+    char piece = game->chessboard[dest_row][dest_col];
+
+    if (undo->promoted)
+        piece = is_white(piece) ? 'P' : 'p';
+    put_piece(game, src_row, src_col, piece);
+    if (undo->enPassant) {
+        put_piece(game, dest_row, dest_col, '.');
+        put_piece(game, src_row, dest_col, undo->captured);
+    } else {
+        put_piece(game, dest_row, dest_col, undo->captured);
+    }
+    if (('K' == piece || 'k' == piece) && 2 == abs(dest_col - src_col)) {   // Take the rook back from castling
+        put_piece(game, src_row, dest_col > src_col ? 7 : 0, game->chessboard[src_row][dest_col > src_col ? 5 : 3]);
+        put_piece(game, src_row, dest_col > src_col ? 5 : 3, '.');
+    }
+    game->occupiedBB = game->colorBB[WHITE_PLAYER] | game->colorBB[BLACK_PLAYER];
+
+    game->currentPlayer = game->currentPlayer ? WHITE_PLAYER : BLACK_PLAYER;
+    game->hash ^= zobrist_side ^ zobrist_castling[game->castling] ^ zobrist_castling[(int) undo->castling];
+    if (NO_SQUARE != game->epSquare)
+        game->hash ^= zobrist_ep[game->epSquare & 7];
+    if (NO_SQUARE != undo->epSquare)
+        game->hash ^= zobrist_ep[undo->epSquare & 7];
+    game->castling = undo->castling;
+    game->epSquare = undo->epSquare;
+    game->halfmoveClock = undo->halfmoveClock;
+    game->fullmoveNumber -= BLACK_PLAYER == game->currentPlayer;
+    update_attacks(game);
+    return 0;
+}
+
+/**
+ * @brief Implement the ChessMove on the chess board.
+ * @details Castling also moves the rook, and en passant removes the captured pawn. With validation,
+ * a move that leaves the player's own king in check is refused with MOVE_KING_IN_CHECK.
+ * The attack maps are brought up to date for the next player. Moves made with validation, those
+ * of players, are timed in STAT_MAKE_MOVE; searches make theirs without and stay untimed.
+ * 
+ * @param game Chess board
+ * @param move Move
+ * @param is_client If it's the client site calling the function
+ * @param validate_move 1 if assume ChessMove itself is correct, 0 otherwise
+ * @return 0 if the move is success made.
+ */
+int make_move(ChessGame* game, const ChessMove* move, int is_client, int validate_move) {
+    if (!validate_move)
+        return apply_move(game, move, is_client, 0);
+    uint64_t begin = stats_clock();
+    int ret = apply_move(game, move, is_client, 1);
+    stats_record(STAT_MAKE_MOVE, begin);
+    if (0 == ret)
+        TRACE_EVENT(TRACE_APPLIED, 'm', *move);
+    else
+        TRACE_EVENT(TRACE_REJECTED, 'm', (uint16_t) ret);
+    return ret;
+}
+
 /*
  * @brief Splite the command with " ", each element represents an argument.
+ * The 3rd argument holds the rest of the command, so a FEN keeps its optional fields.
  * 
  * @return Number of arguments from the command. Return -1 if it is an invalid command.
  */
 int parse_command(const char* message, char *args[3]) {
+    uint64_t begin = stats_clock();
     int arg_size = 0, arg_index = 0;
     while ('\0' != *message) {
-        if (3 == arg_size)
-            return -1;
-        if (' ' == *message) {
+        if (' ' == *message && arg_size < 2) {
             args[arg_size][arg_index] = '\0';
             arg_size++;
             arg_index = 0;
@@ -426,6 +1537,8 @@ int parse_command(const char* message, char *args[3]) {
         message++;
     }
     args[arg_size][arg_index] = '\0';
+    stats_record(STAT_PARSE_COMMAND, begin);
+    TRACE_EVENT(TRACE_PARSED, '/' == args[0][0] ? args[0][1] : 0, 0);
     return arg_size + 1;
 }
 
@@ -442,7 +1555,7 @@ int send_move_command(ChessGame* game, int arg_size, char* args[3],
     ChessMove move;
     if (0 == parse_move(args[1], &move)) {
         if (0 == make_move(game, &move, is_client, 1)) {
-            send(socketfd, message, strlen(message), 0);
+            transmit(socketfd, message);
             return COMMAND_MOVE;
         } else {
             return COMMAND_ERROR;
@@ -460,7 +1573,7 @@ int send_forfeit_command(int arg_size, char* arg, const char* message, int socke
         return COMMAND_UNKNOWN;
     if (1 != arg_size)
         return COMMAND_ERROR;
-    send(socketfd, message, strlen(message), 0);
+    transmit(socketfd, message);
     return COMMAND_FORFEIT;
 }
 
@@ -492,8 +1605,9 @@ int send_import_command(ChessGame* game, int arg_size, char* args[3],
         strcpy(fen, args[1]);
         strcat(fen, " ");
         strcat(fen, args[2]);
-        fen_to_chessboard(fen, game);
-        send(socketfd, message, strlen(message), 0);
+        if (0 != fen_to_chessboard(fen, game))
+            return COMMAND_ERROR;
+        transmit(socketfd, message);
         return COMMAND_IMPORT;
     }
     return COMMAND_ERROR;
@@ -515,24 +1629,56 @@ int send_load_command(ChessGame* game, int arg_size, char* args[3], const char*
         return COMMAND_ERROR;
     if (0 != load_game(game, args[1], "../src/game_database.txt", save_number))
         return COMMAND_ERROR;
-    send(socketfd, message, strlen(message), 0);
+    transmit(socketfd, message);
     return COMMAND_LOAD;
 }
 
+static int save_on_server;   // /save goes to a --multi server instead of the local database
+
+/**
+ * @brief Send /save to the server, which saves the game as it holds it, instead of saving it here.
+ * @details Only a --multi server handles /save; the single-game server would end its wait for the move.
+ */
+void set_save_on_server(int on) {
+    save_on_server = on;
+}
+
 /*
  * @details Apply /save command, but don't have to send to another player.
- * It is defaultly looking for file "game_database.txt" in src.
+ * It is defaultly looking for file "game_database.txt" in src, unless set_save_on_server
+ * sends it to a --multi server, which does not pass it on to the opponent either.
  */
-int send_save_command(const ChessGame* game, int arg_size, char* args[3]) {
+int send_save_command(const ChessGame* game, int arg_size, char* args[3], const char* message, int socketfd) {
     if (0 != strcmp(args[0], "/save"))
         return COMMAND_UNKNOWN;
     if (2 != arg_size)
         return COMMAND_ERROR;
+    if (save_on_server) {
+        transmit(socketfd, message);
+        return COMMAND_SAVE;
+    }
     if (0 != save_game(game, args[1], "../src/game_database.txt"))
         return COMMAND_ERROR;
     return COMMAND_SAVE;
 }
 
+/*
+ * @brief Display the counters and latencies of the commands, without sending anything.
+ * @details /stats is told from /save by its first argument, so it shares the case of send_command
+ * and is not timed itself.
+ */
+int send_stats_command(int arg_size, char* arg) {
+    if (0 != strcmp(arg, "/stats"))
+        return COMMAND_UNKNOWN;
+    if (1 != arg_size)
+        return COMMAND_ERROR;
+    char text[STATS_TEXT_SIZE];
+    stats_format(text, sizeof(text), 0);
+    fputs(text, stdout);
+    fflush(stdout);
+    return COMMAND_DISPLAY;
+}
+
 /*
  * @brief Send /none command in order to switch controller.
  */
@@ -542,7 +1688,7 @@ int send_none_command(int arg_size, char* arg,
         return COMMAND_UNKNOWN;
     if (1 != arg_size)
         return COMMAND_ERROR;
-    send(socketfd, message, strlen(message), is_client);
+    transmit(socketfd, message);
     return COMMAND_NONE;
 }
 
@@ -558,24 +1704,44 @@ int send_command(ChessGame* game, const char* message, int socketfd, int is_clie
     if (arg_size <= 0)
         return COMMAND_ERROR;
 
+    uint64_t begin = stats_clock();
+    int event, ret;
     switch (arg1[1]) {
         case 'm':
-            return send_move_command(game, arg_size, args, message, socketfd, is_client);
+            event = STAT_SEND_MOVE;
+            ret = send_move_command(game, arg_size, args, message, socketfd, is_client);
+            break;
         case 'f':
-            return send_forfeit_command(arg_size, args[0], message, socketfd);
+            event = STAT_SEND_FORFEIT;
+            ret = send_forfeit_command(arg_size, args[0], message, socketfd);
+            break;
         case 'c':
-            return send_chessboard_command(game, arg_size, args[0]);
+            event = STAT_SEND_CHESSBOARD;
+            ret = send_chessboard_command(game, arg_size, args[0]);
+            break;
         case 'i':
-            return send_import_command(game, arg_size, args, message, socketfd, is_client);
+            event = STAT_SEND_IMPORT;
+            ret = send_import_command(game, arg_size, args, message, socketfd, is_client);
+            break;
         case 'l':
-            return send_load_command(game, arg_size, args, message, socketfd);
+            event = STAT_SEND_LOAD;
+            ret = send_load_command(game, arg_size, args, message, socketfd);
+            break;
         case 's':
-            return send_save_command(game, arg_size, args);
+            if (0 == strcmp(args[0], "/stats"))
+                return send_stats_command(arg_size, args[0]);
+            event = STAT_SEND_SAVE;
+            ret = send_save_command(game, arg_size, args, message, socketfd);
+            break;
         case 'n':
-            return send_none_command(arg_size, args[0], message, socketfd, is_client);
+            event = STAT_SEND_NONE;
+            ret = send_none_command(arg_size, args[0], message, socketfd, is_client);
+            break;
         default:
             return COMMAND_UNKNOWN;
     }
+    stats_record(event, begin);
+    return ret;
 }
 
 /*
@@ -589,10 +1755,12 @@ int receive_move_command(ChessGame* game, int arg_size, char* args[3], int is_cl
 
     ChessMove move;
     if (0 == parse_move(args[1], &move)) {
-        if (0 == make_move(game, &move, is_client, 0)) 
+        if (0 == make_move(game, &move, is_client, 0)) {
+            TRACE_EVENT(TRACE_APPLIED, 'm', move);
             return COMMAND_MOVE;
-        else 
+        } else {
             return COMMAND_ERROR;
+        }
     }
     return COMMAND_ERROR;
 }
@@ -623,7 +1791,8 @@ int receive_import_command(ChessGame *game, int arg_size, char* args[3], int is_
         strcpy(fen, args[1]);
         strcat(fen, " ");
         strcat(fen, args[2]);
-        fen_to_chessboard(fen, game);
+        if (0 != fen_to_chessboard(fen, game))
+            return COMMAND_ERROR;
         return COMMAND_IMPORT;
     }
     return COMMAND_ERROR;
@@ -673,130 +1842,32 @@ int receive_command(ChessGame *game, const char *message, int socketfd, int is_c
     if (arg_size <= 0)
         return COMMAND_ERROR;
 
+    uint64_t begin = stats_clock();
+    int event, ret;
     switch (arg1[1]) {
         case 'm':
-            return receive_move_command(game, arg_size, args, is_client);
+            event = STAT_RECEIVE_MOVE;
+            ret = receive_move_command(game, arg_size, args, is_client);
+            break;
         case 'f':
-            return receive_forfeit_command(arg_size, args[0], socketfd);
+            event = STAT_RECEIVE_FORFEIT;
+            ret = receive_forfeit_command(arg_size, args[0], socketfd);
+            break;
         case 'i':
-            return receive_import_command(game, arg_size, args, is_client);
+            event = STAT_RECEIVE_IMPORT;
+            ret = receive_import_command(game, arg_size, args, is_client);
+            break;
         case 'l':
-            return receive_load_command(game, arg_size, args, socketfd, is_client);
+            event = STAT_RECEIVE_LOAD;
+            ret = receive_load_command(game, arg_size, args, socketfd, is_client);
+            break;
         case 'n':
-            return receive_none_command(arg_size, args[0]);
+            event = STAT_RECEIVE_NONE;
+            ret = receive_none_command(arg_size, args[0]);
+            break;
         default:
             return -1;
     }
-}
-
-/*
- * @brief Verify if the username is valid.
- * @details Username should not contain white spaces.
- * 
- * @return 1 if username valid.
- */
-int username_valid(const char* username) {
-    if (NULL == username) 
-        return 0;
-    int length = (int) strlen(username);
-    if (0 == length) 
-        return 0;
-    for (int i = 0; i < length; ++i) {
-        if (' ' == username[i])
-            return 0;
-    }
-    return 1;
-}
-
-/**
- * @brief Save the game state and username in a given file.
- * 
- * @return 0 if saved game success, -1 otherwise.
- */
-int save_game(const ChessGame* game, const char* username, const char* db_filename) {
-    if (!username_valid(username)) 
-        return -1;
-
-    FILE *db = fopen(db_filename, "a");
-    if (!db)
-        return -1;
-    char fen[BUFFER_SIZE];
-    chessboard_to_fen(fen, game);
-    fprintf(db, "%s:%s\n", username, fen);
-    fclose(db);
-    return 0;
-}
-
-/*
- * @brief Parse the username from a line.
- * @details Username is located in the beginning of the line,
- * and ended with a ':'.
- */
-void get_username(char* username, const char* line) {
-    memset(username, 0, BUFFER_SIZE);
-    int index = 0;
-    while (':' != *line) {
-        username[index] = *line;
-        index++;
-        line++;
-    }
-    username[index] = '\0';
-}
-
-/*
- * @brief Parse a FEN string from a line.
- * @details FEN string is located in the end of line, 
- * and started after a ':'.
- */
-void get_fen(char* fen, const char* line) {
-    while (':' != *line) line++;
-    int index = 0;
-    line++;
-    while ('\0' != *line) {
-        fen[index] = *line;
-        index++;
-        line++;
-    }
-    fen[index] = '\0';
-}
-
-/**
- * @brief Load the game state from a given file.
- * 
- * @param save_number The number of game state
- * @return 0 if loaded success, -1 otherwise.
- */
-int load_game(ChessGame* game, const char* username, const char* db_filename, int save_number) {
-    if (save_number <= 0 || !username_valid(username)) 
-        return -1;
-
-    FILE *db = fopen(db_filename, "r");
-    if (!db) 
-        return -1;
-    
-    int count = 0;
-    char line[BUFFER_SIZE], last_line[BUFFER_SIZE], u_name[BUFFER_SIZE];
-    while (NULL != fgets(line, BUFFER_SIZE, db)) {
-        line[strlen(line)-1] = '\0';
-        get_username(u_name, line);
-        if (0 == strcmp(username, u_name)) {   // Match username
-            memset(last_line, 0, BUFFER_SIZE);
-            strcpy(last_line, line);           // Hold the last line data
-            count++;
-            if (count == save_number)          // Match save number
-                break;
-        }
-        memset(line, 0, BUFFER_SIZE);
-    }
-    
-    if (count != save_number) {
-        fclose(db);
-        return -1;
-    }
-
-    char fen[BUFFER_SIZE];
-    get_fen(fen, last_line);
-    fen_to_chessboard(fen, game);
-    fclose(db);
-    return 0;
+    stats_record(event, begin);
+    return ret;
 }
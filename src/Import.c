@@ -0,0 +1,379 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include "Resources.h"
+
+/*
+ * Bulk import of PGN games or EPD positions into a game database, as a pipeline:
+ *   reader   reads the file in chunks of about IMPORT_CHUNK_SIZE bytes cut between games,
+ *   workers  replay the games of each chunk with read_pgn and format the final position
+ *            of each valid game,
+ *   writer   appends the records of each chunk, in file order, with a single write().
+ * Chunks are allocated once and passed from stage to stage, so nothing is allocated per game.
+ */
+
+#define IMPORT_CHUNK_SIZE (1 << 20)
+#define IMPORT_DEFAULT_USER "import"
+#define IMPORT_DEFAULT_DB "../src/game_database.txt"   // Where the server saves, run from play/
+#define IMPORT_MAX_WORKERS 64
+
+typedef struct Chunk {
+    char* text;           // Whole games or lines, NUL terminated
+    size_t length;
+    char* out;            // Records formatted by a worker
+    size_t outLength;
+    size_t outCapacity;
+    long sequence;        // Position of the chunk in the file
+    long games;           // Games or EPD lines found
+    long imported;
+    long moves;
+    struct Chunk* next;
+} Chunk;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;   // Broadcast whenever a chunk changes queue
+    Chunk* free;
+    Chunk* work;              // FIFO of chunks read and not yet taken by a worker
+    Chunk* workTail;
+    Chunk** done;             // Processed chunks, slot sequence % chunks
+    int chunks;
+    int reading;              // 0 once the reader has queued the last chunk
+    int epd;
+    int format;               // Format of the database records
+    const char* username;
+} Pipeline;
+
+typedef struct {
+    Pipeline* pipeline;
+    Chunk* chunk;
+} ImportContext;
+
+static double elapsed(const struct timespec* begin) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/*
+ * @brief Append the position of a game to the records of a chunk, growing them if needed.
+ */
+static int add_record(Pipeline* pipeline, Chunk* chunk, const ChessGame* game) {
+    if (chunk->outCapacity - chunk->outLength < DATABASE_RECORD_MAX) {
+        size_t capacity = 2 * chunk->outCapacity;
+        char* out = realloc(chunk->out, capacity);
+        if (NULL == out)
+            return -1;
+        chunk->out = out;
+        chunk->outCapacity = capacity;
+    }
+    int length = format_record(game, pipeline->username, pipeline->format, chunk->out + chunk->outLength);
+    if (length < 0)
+        return -1;
+    chunk->outLength += length;
+    chunk->imported++;
+    return 0;
+}
+
+/*
+ * @brief Import each "board side castling en-passant [operations]" line of a chunk.
+ */
+static void import_epd(Pipeline* pipeline, Chunk* chunk, ChessGame* game) {
+    for (char* line = chunk->text; line < chunk->text + chunk->length; ) {
+        char* end = strchr(line, '\n');
+        end = NULL == end ? chunk->text + chunk->length : end;
+        *end = '\0';
+        while (' ' == *line || '\t' == *line)
+            line++;
+        if ('\0' != *line && '\r' != *line && '#' != *line) {
+            chunk->games++;
+            char* field = line;   // The operations after the 4th field are not part of the FEN
+            for (int i = 0; i < 4 && '\0' != *field; ++i) {
+                field += strcspn(field, " \t\r");
+                if (i < 3)
+                    field += strspn(field, " \t");
+            }
+            *field = '\0';
+            if (0 == fen_to_chessboard(line, game))
+                add_record(pipeline, chunk, game);
+        }
+        line = end + 1;
+    }
+}
+
+/*
+ * @brief Count a PGN game, and record its final position if all of its moves were valid.
+ */
+static void import_game(const ChessGame* game, int valid, void* context) {
+    ImportContext* import = context;
+    import->chunk->games++;
+    if (valid)
+        add_record(import->pipeline, import->chunk, game);
+}
+
+/*
+ * @brief Worker: turn chunks of text into records until the reader is done.
+ */
+static void* worker(void* arg) {
+    Pipeline* pipeline = arg;
+    ChessGame* game = malloc(sizeof(ChessGame));
+    if (NULL == game)
+        return NULL;
+    pthread_mutex_lock(&pipeline->lock);
+    while (1) {
+        while (NULL == pipeline->work && pipeline->reading)
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        Chunk* chunk = pipeline->work;
+        if (NULL == chunk)
+            break;
+        pipeline->work = chunk->next;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        chunk->outLength = 0;
+        chunk->games = chunk->imported = chunk->moves = 0;
+        if (pipeline->epd) {
+            import_epd(pipeline, chunk, game);
+        } else {
+            ImportContext import = { pipeline, chunk };
+            PgnHandler handler = { NULL, import_game, &import };
+            chunk->moves = read_pgn(chunk->text, chunk->length, game, &handler);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->done[chunk->sequence % pipeline->chunks] = chunk;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    free(game);
+    return NULL;
+}
+
+static size_t epd_boundary(const char* text, size_t length) {
+    for (size_t i = length; i-- > 0; ) {
+        if ('\n' == text[i])
+            return i + 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    Pipeline* pipeline;
+    int fd;
+    long chunks;          // Number of chunks the reader produced, known once it is done
+    long games;
+    long imported;
+    long moves;
+    int failed;
+} Writer;
+
+/*
+ * @brief Writer: append the records of each chunk in file order, then give the chunk back to the reader.
+ */
+static void* writer(void* arg) {
+    Writer* w = arg;
+    Pipeline* pipeline = w->pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    for (long sequence = 0; ; ++sequence) {
+        Chunk* chunk;
+        while (NULL == (chunk = pipeline->done[sequence % pipeline->chunks]) && (pipeline->reading || sequence < w->chunks))
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        if (NULL == chunk)
+            break;
+        pipeline->done[sequence % pipeline->chunks] = NULL;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        for (size_t written = 0; written < chunk->outLength && !w->failed; ) {
+            ssize_t n = write(w->fd, chunk->out + written, chunk->outLength - written);
+            if (n < 0)
+                w->failed = 1;
+            else
+                written += n;
+        }
+        w->games += chunk->games;
+        w->imported += chunk->imported;
+        w->moves += chunk->moves;
+
+        pthread_mutex_lock(&pipeline->lock);
+        chunk->next = pipeline->free;
+        pipeline->free = chunk;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+/*
+ * @brief Read the input into chunks cut between games and queue them for the workers.
+ *
+ * @return Number of bytes read, -1 on a read error.
+ */
+static long long read_chunks(Pipeline* pipeline, Writer* w, int in) {
+    char* carry = malloc(2 * IMPORT_CHUNK_SIZE);   // Start of the game cut by the end of the last chunk
+    size_t carried = 0;
+    long long total = 0;
+    long sequence = 0;
+    int eof = 0;
+    if (NULL == carry)
+        return -1;
+    while (!eof) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (NULL == pipeline->free)
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        Chunk* chunk = pipeline->free;
+        pipeline->free = chunk->next;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        memcpy(chunk->text, carry, carried);
+        chunk->length = carried;
+        while (chunk->length < IMPORT_CHUNK_SIZE) {
+            ssize_t n = read(in, chunk->text + chunk->length, 2 * IMPORT_CHUNK_SIZE - chunk->length);
+            if (n <= 0) {
+                eof = 1;
+                if (n < 0)
+                    total = -1;
+                break;
+            }
+            chunk->length += n;
+            total += n;
+        }
+        size_t boundary = chunk->length;
+        if (!eof) {
+            boundary = pipeline->epd ? epd_boundary(chunk->text, chunk->length) : pgn_boundary(chunk->text, chunk->length);
+            if (0 == boundary)   // A game longer than the chunk is cut
+                boundary = chunk->length;
+        }
+        carried = chunk->length - boundary;
+        memcpy(carry, chunk->text + boundary, carried);
+        chunk->length = boundary;
+        chunk->text[boundary] = '\0';
+        chunk->sequence = sequence++;
+        chunk->next = NULL;
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (NULL == pipeline->work)
+            pipeline->work = chunk;
+        else
+            pipeline->workTail->next = chunk;
+        pipeline->workTail = chunk;
+        if (eof) {
+            pipeline->reading = 0;
+            w->chunks = sequence;
+        }
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+    free(carry);
+    return total;
+}
+
+/*
+ * @brief Usage: import <file.pgn|file.epd> [--user NAME] [--db PATH] [--workers N]
+ * @details Save the final position of every PGN game whose moves are all valid, or every EPD
+ * position, under one username. Files ending in ".epd" are read as EPD, anything else as PGN.
+ */
+int main(int argc, char* argv[]) {
+    const char* input = NULL;
+    const char* db_filename = IMPORT_DEFAULT_DB;
+    const char* username = IMPORT_DEFAULT_USER;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--user") && i + 1 < argc)
+            username = argv[++i];
+        else if (0 == strcmp(argv[i], "--db") && i + 1 < argc)
+            db_filename = argv[++i];
+        else if (0 == strcmp(argv[i], "--workers") && i + 1 < argc)
+            workers = atol(argv[++i]);
+        else if (NULL == input && '-' != argv[i][0])
+            input = argv[i];
+        else
+            input = "";
+    }
+    if (NULL == input || '\0' == *input) {
+        fprintf(stderr, "Usage: %s <file.pgn|file.epd> [--user NAME] [--db PATH] [--workers N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    workers = workers < 1 ? 1 : (workers > IMPORT_MAX_WORKERS ? IMPORT_MAX_WORKERS : workers);
+
+    int in = open(input, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "Cannot open %s.\n", input);
+        return EXIT_FAILURE;
+    }
+    int out = open(db_filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    Pipeline pipeline = { .username = username, .reading = 1 };
+    pipeline.format = out < 0 ? -1 : database_format(out);
+    size_t length = strlen(input);
+    pipeline.epd = length >= 4 && 0 == strcasecmp(input + length - 4, ".epd");
+    char record[DATABASE_RECORD_MAX];
+    ChessGame* game = malloc(sizeof(ChessGame));
+    if (NULL == game || pipeline.format < 0) {
+        fprintf(stderr, "Cannot open the game database %s.\n", db_filename);
+        return EXIT_FAILURE;
+    }
+    initialize_game(game);
+    if (format_record(game, username, pipeline.format, record) < 0) {
+        fprintf(stderr, "Invalid username %s.\n", username);
+        return EXIT_FAILURE;
+    }
+    free(game);
+
+    // Two chunks per worker keep every worker busy while the writer and reader catch up
+    pipeline.chunks = 2 * workers + 2;
+    pipeline.done = calloc(pipeline.chunks, sizeof(Chunk*));
+    Chunk* chunks = calloc(pipeline.chunks, sizeof(Chunk));
+    for (int i = 0; i < pipeline.chunks && chunks; ++i) {
+        chunks[i].text = malloc(2 * IMPORT_CHUNK_SIZE + 1);
+        chunks[i].outCapacity = IMPORT_CHUNK_SIZE;
+        chunks[i].out = malloc(chunks[i].outCapacity);
+        if (NULL == chunks[i].text || NULL == chunks[i].out) {
+            fprintf(stderr, "Out of memory.\n");
+            return EXIT_FAILURE;
+        }
+        chunks[i].next = pipeline.free;
+        pipeline.free = &chunks[i];
+    }
+    if (NULL == chunks || NULL == pipeline.done) {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    Writer w = { .pipeline = &pipeline, .fd = out };
+    pthread_t threads[IMPORT_MAX_WORKERS], writer_thread;
+    for (long i = 0; i < workers; ++i)
+        pthread_create(&threads[i], NULL, worker, &pipeline);
+    pthread_create(&writer_thread, NULL, writer, &w);
+    long long bytes = read_chunks(&pipeline, &w, in);
+    for (long i = 0; i < workers; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_join(writer_thread, NULL);
+    close(in);
+    if (0 != close(out))
+        w.failed = 1;
+    if (0 == w.failed)
+        update_database_index(db_filename);
+    double seconds = elapsed(&begin);
+
+    for (int i = 0; i < pipeline.chunks; ++i) {
+        free(chunks[i].text);
+        free(chunks[i].out);
+    }
+    free(chunks);
+    free(pipeline.done);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+
+    if (bytes < 0 || w.failed) {
+        fprintf(stderr, "Failed to %s.\n", bytes < 0 ? "read the input" : "write the game database");
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "%s %ld, imported %ld, rejected %ld, %ld moves, %ld workers\n",
+            pipeline.epd ? "Positions" : "Games", w.games, w.imported, w.games - w.imported, w.moves, workers);
+    fprintf(stdout, "%.2f s, %.1f MB/s, %.0f %s/s\n", seconds, bytes / 1e6 / seconds,
+            w.imported / seconds, pipeline.epd ? "positions" : "games");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,221 @@
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Resources.h"
+
+/*
+ * A journal is "<dir>/game-<id>.jnl": a header, a snapshot of the position, then one entry per
+ * move made since the snapshot. Entries are a 1-byte type and a payload:
+ *   JOURNAL_SNAPSHOT  a PositionRecord, then the halfmove clock and the fullmove number, which
+ *                     the record does not hold, 4 bytes little-endian each (version 1 had none)
+ *   JOURNAL_MOVE      the ChessMove, 2 bytes little-endian
+ * Every JOURNAL_SNAPSHOT_INTERVAL moves the journal is replaced by a new snapshot, written to a
+ * temporary file and renamed over it, so recovery never replays more than that many moves.
+ * Entries are written with write() without syncing: a game outlives a crash of the server
+ * process, not a crash of the machine.
+ */
+
+#define JOURNAL_MAGIC "CHESSJNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_HEADER_SIZE 16
+#define JOURNAL_SNAPSHOT 'S'
+#define JOURNAL_MOVE 'M'
+#define JOURNAL_SNAPSHOT_SIZE (1 + POSITION_RECORD_SIZE + 8)
+#define JOURNAL_V1_SNAPSHOT_SIZE (1 + POSITION_RECORD_SIZE)
+#define JOURNAL_MOVE_SIZE 3
+
+/*
+ * @brief Write the path of a journal file into a buffer of BUFFER_SIZE bytes.
+ *
+ * @return 0 on success, -1 if the path does not fit.
+ */
+static int journal_path(char* path, const char* dir, unsigned long id, const char* suffix) {
+    int length = snprintf(path, BUFFER_SIZE, "%s/game-%lu.%s", dir, id, suffix);
+    return length < 0 || length >= BUFFER_SIZE ? -1 : 0;
+}
+
+/*
+ * @brief Write a new journal holding only a snapshot of the game, and rename it over the old one.
+ *
+ * @return Descriptor of the new journal, open for appending, -1 on failure.
+ */
+static int write_snapshot(const char* dir, unsigned long id, const ChessGame* game) {
+    char path[BUFFER_SIZE], temp[BUFFER_SIZE];
+    unsigned char data[JOURNAL_HEADER_SIZE + JOURNAL_SNAPSHOT_SIZE];
+    uint32_t version = htole32(JOURNAL_VERSION);
+    memset(data, 0, sizeof(data));
+    memcpy(data, JOURNAL_MAGIC, 8);
+    memcpy(data + 8, &version, sizeof(version));
+    data[JOURNAL_HEADER_SIZE] = JOURNAL_SNAPSHOT;
+    pack_position(game, "", (PositionRecord*) (data + JOURNAL_HEADER_SIZE + 1));
+    uint32_t counters[2] = { htole32((uint32_t) game->halfmoveClock), htole32((uint32_t) game->fullmoveNumber) };
+    memcpy(data + JOURNAL_HEADER_SIZE + JOURNAL_V1_SNAPSHOT_SIZE, counters, sizeof(counters));
+
+    if (0 != journal_path(path, dir, id, "jnl") || 0 != journal_path(temp, dir, id, "tmp"))
+        return -1;
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return -1;
+    if (sizeof(data) != write(fd, data, sizeof(data)) || 0 != rename(temp, path)) {
+        close(fd);
+        unlink(temp);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Start the journal of a game, with a snapshot of its current position.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int journal_open(GameJournal* journal, const char* dir, unsigned long id, const ChessGame* game) {
+    if (strlen(dir) + 32 >= BUFFER_SIZE)
+        return -1;
+    strcpy(journal->dir, dir);
+    journal->id = id;
+    journal->moves = 0;
+    journal->fd = write_snapshot(dir, id, game);
+    return journal->fd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Replace the journal by a snapshot of the game, e.g. after /import or /load.
+ *
+ * @return 0 on success, -1 on failure; the old journal is kept on failure.
+ */
+int journal_snapshot(GameJournal* journal, const ChessGame* game) {
+    int fd = write_snapshot(journal->dir, journal->id, game);
+    if (fd < 0)
+        return -1;
+    close(journal->fd);
+    journal->fd = fd;
+    journal->moves = 0;
+    return 0;
+}
+
+/**
+ * @brief Record a move once make_move has applied it to the game.
+ * @details Every JOURNAL_SNAPSHOT_INTERVAL moves, the journal is replaced by a snapshot instead.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int journal_append_move(GameJournal* journal, const ChessGame* game, const ChessMove* move) {
+    if (journal->moves + 1 >= JOURNAL_SNAPSHOT_INTERVAL)
+        return journal_snapshot(journal, game);
+    unsigned char entry[JOURNAL_MOVE_SIZE] = { JOURNAL_MOVE, *move & 0xFF, *move >> 8 };
+    if (JOURNAL_MOVE_SIZE != write(journal->fd, entry, JOURNAL_MOVE_SIZE))
+        return -1;
+    journal->moves++;
+    return 0;
+}
+
+/**
+ * @brief Close the journal of a game. The journal of a finished game is removed.
+ */
+void journal_close(GameJournal* journal, int finished) {
+    char path[BUFFER_SIZE];
+    close(journal->fd);
+    if (finished && 0 == journal_path(path, journal->dir, journal->id, "jnl"))
+        unlink(path);
+}
+
+/**
+ * @brief Rebuild a game from its journal: load the snapshot, then replay the moves through make_move.
+ * @details A torn last entry, left by a crash in the middle of a write, is ignored, and replay stops
+ * at the first move make_move rejects.
+ *
+ * @param entries Receives the number of complete move entries, more than the moves replayed
+ * if one was rejected, or NULL.
+ * @param torn Receives 1 if the journal ends with an incomplete or unknown entry, or NULL.
+ * @return Number of moves replayed, -1 if the journal has no valid snapshot.
+ */
+int journal_replay(const char* path, ChessGame* game, int* entries, int* torn) {
+    unsigned char data[JOURNAL_HEADER_SIZE + JOURNAL_SNAPSHOT_SIZE + JOURNAL_SNAPSHOT_INTERVAL * JOURNAL_MOVE_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t length = read(fd, data, sizeof(data));
+    close(fd);
+    uint32_t version;
+    if (length < JOURNAL_HEADER_SIZE + JOURNAL_V1_SNAPSHOT_SIZE || 0 != memcmp(data, JOURNAL_MAGIC, 8))
+        return -1;
+    memcpy(&version, data + 8, sizeof(version));
+    version = le32toh(version);
+    ssize_t snapshot_size = 1 == version ? JOURNAL_V1_SNAPSHOT_SIZE : JOURNAL_SNAPSHOT_SIZE;
+    if ((1 != version && JOURNAL_VERSION != version) || length < JOURNAL_HEADER_SIZE + snapshot_size
+            || JOURNAL_SNAPSHOT != data[JOURNAL_HEADER_SIZE])
+        return -1;
+    PositionRecord record;
+    memcpy(&record, data + JOURNAL_HEADER_SIZE + 1, sizeof(record));
+    initialize_game(game);
+    if (0 != unpack_position(&record, game, NULL))
+        return -1;
+    if (1 != version) {   // Version 1 journals restart the counters, as records do
+        uint32_t counters[2];
+        memcpy(counters, data + JOURNAL_HEADER_SIZE + JOURNAL_V1_SNAPSHOT_SIZE, sizeof(counters));
+        game->halfmoveClock = (int) le32toh(counters[0]);
+        game->fullmoveNumber = (int) le32toh(counters[1]);
+        if (game->fullmoveNumber <= 0)
+            return -1;
+    }
+
+    int moves = 0, count = 0;
+    ChessMove move;
+    ssize_t offset = JOURNAL_HEADER_SIZE + snapshot_size;
+    for (; offset + JOURNAL_MOVE_SIZE <= length && JOURNAL_MOVE == data[offset]; offset += JOURNAL_MOVE_SIZE) {
+        move = (ChessMove) (data[offset + 1] | data[offset + 2] << 8);
+        count++;
+        if (moves + 1 == count && 0 == make_move(game, &move, WHITE_PLAYER == game->currentPlayer, 1))
+            moves++;
+    }
+    if (entries)
+        *entries = count;
+    if (torn)
+        *torn = offset != length;
+    return moves;
+}
+
+/**
+ * @brief Rebuild a game from its journal, as journal_replay does.
+ *
+ * @return Number of moves replayed, -1 if the journal has no valid snapshot.
+ */
+int journal_recover(const char* path, ChessGame* game) {
+    return journal_replay(path, game, NULL, NULL);
+}
+
+/**
+ * @brief Rebuild every game journaled in a directory.
+ * @details Games whose journal cannot be read are skipped; temporary files of interrupted
+ * snapshots are removed.
+ *
+ * @param recovered Called with the id and game of each journal, in no particular order.
+ * @return Number of games rebuilt, -1 if the directory cannot be read.
+ */
+long journal_recover_all(const char* dir, void (*recovered)(unsigned long id, ChessGame* game, void* context), void* context) {
+    DIR* directory = opendir(dir);
+    if (NULL == directory)
+        return ENOENT == errno ? 0 : -1;
+    long count = 0;
+    struct dirent* entry;
+    char path[BUFFER_SIZE], suffix[8];
+    ChessGame game;
+    while (NULL != (entry = readdir(directory))) {
+        unsigned long id;
+        if (2 != sscanf(entry->d_name, "game-%lu.%7s", &id, suffix))
+            continue;
+        if (0 != journal_path(path, dir, id, suffix))
+            continue;
+        if (0 == strcmp(suffix, "tmp")) {
+            unlink(path);
+        } else if (0 == strcmp(suffix, "jnl") && journal_recover(path, &game) >= 0) {
+            recovered(id, &game, context);
+            count++;
+        }
+    }
+    closedir(directory);
+    return count;
+}
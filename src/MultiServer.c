@@ -0,0 +1,852 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "Resources.h"
+
+#define MAX_EVENTS 256
+#define OUTPUT_BUFFER_SIZE 4096
+#define WATCH_QUEUE_SIZE 256   // Messages an observer may fall behind before it is dropped
+#define WATCH_IOV_MAX 64       // Messages sent to an observer in one sendmsg
+#define WATCH_SEND_BUFFER 16384   // Socket send buffer of an observer, so a stalled one is noticed early
+#define SMALL_MESSAGE_SIZE (POOL_ALIGN - (int) sizeof(SharedBuffer))   // Fits a move frame in one cache line
+
+typedef struct Session Session;
+typedef struct Connection Connection;
+
+/*
+ * @brief A message encoded once and shared by the queues of every observer of a game.
+ * It goes back to its pool when the last observer has sent it.
+ */
+typedef struct {
+    int refs;
+    int length;
+    unsigned char data[];
+} SharedBuffer;
+
+/*
+ * @brief One player or observer socket. Output of a player that could not be written right away
+ * waits in output; an observer queues references to shared messages instead.
+ * @details Connections are pooled. The fields before output are cleared for each new socket;
+ * output and the buffers after it are only ever read up to their lengths, so are left as they were.
+ */
+struct Connection {
+    int fd;
+    int color;              // WHITE_PLAYER or BLACK_PLAYER
+    int closed;             // Closed in this round of events, freed at the end of it
+    int watchingOutput;     // EPOLLOUT is registered
+    int observer;           // Connected on the watch port, always speaks WIRE_BINARY
+    Session* session;
+    Connection* nextClosing;
+    int outputLength;
+    Connection* nextObserver;                 // In the list of observers of the session
+    Connection* nextDirty;                    // In the observers to flush at the end of the round
+    int dirty;
+    int queueHead;
+    int queueLength;
+    int queueOffset;                          // Bytes of the first message already sent
+    char output[OUTPUT_BUFFER_SIZE];
+    FrameDecoder decoder;   // Used with WIRE_BINARY
+    SharedBuffer* queue[WATCH_QUEUE_SIZE];    // Messages to send, a ring starting at queueHead
+};
+
+/*
+ * @brief One game hosted by the server. Its ChessGame is the authoritative state.
+ * @details White may play before black joins; what black has to receive meanwhile waits in pending.
+ * Sessions are pooled like connections: the fields before game are cleared for each new game,
+ * game is reset by initialize_game, and pending and journal are used only once set.
+ */
+struct Session {
+    Connection* players[2];
+    int pendingLength;
+    unsigned long id;
+    int journaled;                  // Moves are written to journal
+    Session* nextRecovered;         // Next recovered session waiting for its players
+    Session* next;                  // In the list of every session, newest first
+    Session* previous;
+    Connection* observers;
+    int observerCount;
+    int ended;                      // Ended in this round of events, freed at the end of it
+    Session* nextEnded;
+    ChessGame game;
+    char pending[OUTPUT_BUFFER_SIZE];
+    GameJournal journal;
+};
+
+typedef struct {
+    int epollfd;
+    int listenfd;
+    int watchfd;                    // Listening socket of observers
+    int protocol;                   // WIRE_TEXT or WIRE_BINARY, for every player
+    int fsyncPolicy;                // Of the database writer
+    DbWriter* writer;               // Commits /save of every session, opened on first use
+    Session* waiting;               // Session whose white player waits for an opponent
+    Session* recovered;             // Sessions rebuilt from journals, seated before new ones
+    const char* journalDir;         // NULL if games are not journaled
+    unsigned long nextId;
+    Connection* closing;            // Connections closed in this round of events
+    Session* ended;                 // Sessions ended in this round of events
+    Connection* dirty;              // Observers with messages queued in this round of events
+    Session* all;                   // Every session, newest first
+    unsigned long sessions;         // Games in progress
+    unsigned long dropped;          // Observers dropped for falling behind
+    Pool* sessionPool;
+    Pool* connectionPool;
+    Pool* smallMessages;            // Shared messages of up to SMALL_MESSAGE_SIZE bytes, as moves
+    Pool* largeMessages;            // The others, up to a whole frame
+} MultiServer;
+
+static int stop_fd = -1;   // Eventfd written on SIGINT or SIGTERM to end the loop
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * @brief Watch the connection for input, and for output space while output is pending.
+ */
+static void update_events(MultiServer* server, Connection* conn, int op) {
+    struct epoll_event event;
+    conn->watchingOutput = conn->outputLength > 0 || conn->queueLength > 0;
+    event.events = EPOLLIN | (conn->watchingOutput ? EPOLLOUT : 0);
+    event.data.ptr = conn;
+    epoll_ctl(server->epollfd, op, conn->fd, &event);
+}
+
+static void release_buffer(MultiServer* server, SharedBuffer* buffer) {
+    if (0 == --buffer->refs)
+        pool_free(buffer->length <= SMALL_MESSAGE_SIZE ? server->smallMessages : server->largeMessages, buffer);
+}
+
+/*
+ * @brief Send the queued messages of an observer, up to WATCH_IOV_MAX of them per sendmsg.
+ *
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int flush_queue(MultiServer* server, Connection* conn) {
+    while (conn->queueLength > 0) {
+        struct iovec iov[WATCH_IOV_MAX];
+        int count = 0;
+        for (; count < conn->queueLength && count < WATCH_IOV_MAX; ++count) {
+            SharedBuffer* buffer = conn->queue[(conn->queueHead + count) % WATCH_QUEUE_SIZE];
+            int offset = 0 == count ? conn->queueOffset : 0;
+            iov[count].iov_base = buffer->data + offset;
+            iov[count].iov_len = buffer->length - offset;
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+            return -1;
+        }
+        long sent = n + conn->queueOffset;
+        while (conn->queueLength > 0 && sent >= conn->queue[conn->queueHead]->length) {
+            sent -= conn->queue[conn->queueHead]->length;
+            release_buffer(server, conn->queue[conn->queueHead]);
+            conn->queueHead = (conn->queueHead + 1) % WATCH_QUEUE_SIZE;
+            conn->queueLength--;
+        }
+        conn->queueOffset = (int) sent;
+    }
+    if (conn->watchingOutput != (conn->queueLength > 0))
+        update_events(server, conn, EPOLL_CTL_MOD);
+    return 0;
+}
+
+/*
+ * @brief Write as much pending output as the socket takes.
+ *
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int flush_output(MultiServer* server, Connection* conn) {
+    if (conn->observer)
+        return flush_queue(server, conn);
+    int sent = 0;
+    while (sent < conn->outputLength) {
+        ssize_t n = send(conn->fd, conn->output + sent, conn->outputLength - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+            return -1;
+        }
+        sent += (int) n;
+    }
+    memmove(conn->output, conn->output + sent, conn->outputLength - sent);
+    conn->outputLength -= sent;
+    if (conn->watchingOutput != (conn->outputLength > 0))
+        update_events(server, conn, EPOLL_CTL_MOD);
+    return 0;
+}
+
+static void close_connection(MultiServer* server, Connection* conn);
+
+/*
+ * @brief Queue bytes to a player and try to send them right away.
+ */
+static void send_message(MultiServer* server, Connection* conn, const char* message, int length) {
+    if (conn->closed)
+        return;
+    if (conn->outputLength + length > OUTPUT_BUFFER_SIZE) {   // Player does not read, give up on it
+        close_connection(server, conn);
+        return;
+    }
+    memcpy(conn->output + conn->outputLength, message, length);
+    conn->outputLength += length;
+    if (0 != flush_output(server, conn))
+        close_connection(server, conn);
+}
+
+/*
+ * @brief Send a text command to a player in the protocol of the server.
+ */
+static void send_text(MultiServer* server, Connection* conn, const char* message) {
+    if (WIRE_BINARY == server->protocol) {
+        unsigned char frame[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+        int size = encode_frame(message, frame);
+        if (size > 0)
+            send_message(server, conn, (const char*) frame, size);
+    } else {
+        send_message(server, conn, message, (int) strlen(message));
+    }
+}
+
+/*
+ * @brief Queue a shared message to an observer; it is sent with the others at the end of the round.
+ * @details An observer that already has WATCH_QUEUE_SIZE messages queued is not reading, and is dropped.
+ */
+static void queue_message(MultiServer* server, Connection* conn, SharedBuffer* buffer) {
+    if (conn->closed)
+        return;
+    if (WATCH_QUEUE_SIZE == conn->queueLength) {
+        server->dropped++;
+        INFO("Dropped observer fd %d of game %lu, %d messages behind", conn->fd, conn->session->id, conn->queueLength);
+        close_connection(server, conn);
+        return;
+    }
+    buffer->refs++;
+    conn->queue[(conn->queueHead + conn->queueLength) % WATCH_QUEUE_SIZE] = buffer;
+    conn->queueLength++;
+    if (!conn->dirty) {
+        conn->dirty = 1;
+        conn->nextDirty = server->dirty;
+        server->dirty = conn;
+    }
+}
+
+/*
+ * @brief Copy an encoded frame into a shared message from the pool of its size.
+ */
+static SharedBuffer* new_buffer(MultiServer* server, const unsigned char* data, int length) {
+    if (length > FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+        return NULL;
+    SharedBuffer* buffer = pool_alloc(length <= SMALL_MESSAGE_SIZE ? server->smallMessages : server->largeMessages);
+    if (NULL == buffer)
+        return NULL;
+    buffer->refs = 1;   // Held by the caller until it has queued it everywhere
+    buffer->length = length;
+    memcpy(buffer->data, data, length);
+    return buffer;
+}
+
+/*
+ * @brief Send an encoded frame to every observer of a session, copying it once for all of them.
+ */
+static void broadcast(MultiServer* server, Session* session, const unsigned char* frame, int size) {
+    if (NULL == session->observers)
+        return;
+    SharedBuffer* buffer = new_buffer(server, frame, size);
+    if (NULL == buffer)
+        return;
+    for (Connection* observer = session->observers, *next; observer; observer = next) {
+        next = observer->nextObserver;   // A dropped observer leaves the list
+        queue_message(server, observer, buffer);
+    }
+    release_buffer(server, buffer);
+}
+
+/*
+ * @brief Send the queued messages of every observer that received some in this round of events.
+ */
+static void flush_observers(MultiServer* server) {
+    while (server->dirty) {
+        Connection* conn = server->dirty;
+        server->dirty = conn->nextDirty;
+        conn->dirty = 0;
+        if (!conn->closed && 0 != flush_queue(server, conn))
+            close_connection(server, conn);
+    }
+}
+
+/*
+ * @brief Take an observer out of its session and release what it still had to send.
+ */
+static void unwatch(MultiServer* server, Session* session, Connection* conn) {
+    for (Connection** link = &session->observers; *link; link = &(*link)->nextObserver) {
+        if (*link == conn) {
+            *link = conn->nextObserver;
+            session->observerCount--;
+            break;
+        }
+    }
+    for (; conn->queueLength > 0; conn->queueLength--) {
+        release_buffer(server, conn->queue[conn->queueHead]);
+        conn->queueHead = (conn->queueHead + 1) % WATCH_QUEUE_SIZE;
+    }
+    conn->session = NULL;
+}
+
+/*
+ * @brief End a session: the opponent of a player that left, and every observer, are told the game is forfeited.
+ * @details The game is over, so its journal is removed. The session is freed once the current
+ * round of events is handled.
+ */
+static void end_session(MultiServer* server, Session* session, Connection* leaving) {
+    if (server->waiting == session)
+        server->waiting = NULL;
+    if (session->previous)
+        session->previous->next = session->next;
+    else
+        server->all = session->next;
+    if (session->next)
+        session->next->previous = session->previous;
+    for (Session** link = &server->recovered; *link; link = &(*link)->nextRecovered) {
+        if (*link == session) {
+            *link = session->nextRecovered;
+            break;
+        }
+    }
+    if (session->journaled)
+        journal_close(&session->journal, 1);
+    for (int color = WHITE_PLAYER; color <= BLACK_PLAYER; ++color) {
+        Connection* player = session->players[color];
+        if (NULL == player)
+            continue;
+        player->session = NULL;
+        if (player != leaving && !player->closed) {
+            TRACE_GAME(session->id);
+            TRACE_EVENT(TRACE_SENT, 'f', 0);
+            send_text(server, player, "/forfeit");
+            close_connection(server, player);
+        }
+    }
+    unsigned char frame[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+    broadcast(server, session, frame, encode_frame("/forfeit", frame));
+    while (session->observers) {
+        Connection* observer = session->observers;
+        flush_queue(server, observer);   // The socket is closed next, whatever could not be sent is lost
+        close_connection(server, observer);
+    }
+    session->ended = 1;   // Callers up the stack may still hold it
+    session->nextEnded = server->ended;
+    server->ended = session;
+    server->sessions--;
+}
+
+/*
+ * @brief Close a connection now and free it once the current round of events is handled.
+ */
+static void close_connection(MultiServer* server, Connection* conn) {
+    if (conn->closed)
+        return;
+    conn->closed = 1;
+    close(conn->fd);
+    if (conn->observer && conn->session)
+        unwatch(server, conn->session, conn);
+    else if (conn->session)
+        end_session(server, conn->session, conn);
+    conn->nextClosing = server->closing;
+    server->closing = conn;
+}
+
+/*
+ * @brief Send a message to the player of a color, or keep it until that player joins.
+ */
+static void forward_message(MultiServer* server, Session* session, int color, const char* message, int length) {
+    Connection* player = session->players[color];
+    if (player) {
+        send_message(server, player, message, length);
+        return;
+    }
+    if (session->pendingLength + length <= OUTPUT_BUFFER_SIZE) {
+        memcpy(session->pending + session->pendingLength, message, length);
+        session->pendingLength += length;
+    }
+}
+
+/*
+ * @brief Add a new session to the list of every session.
+ */
+static void add_session(MultiServer* server, Session* session) {
+    session->next = server->all;
+    if (server->all)
+        server->all->previous = session;
+    server->all = session;
+    server->sessions++;
+}
+
+/*
+ * @brief Take a session from the pool, with no players, observers or journal, and a new game.
+ *
+ * @return The session, NULL if out of memory.
+ */
+static Session* new_session(MultiServer* server) {
+    Session* session = pool_alloc(server->sessionPool);
+    if (NULL == session)
+        return NULL;
+    memset(session, 0, offsetof(Session, game));
+    initialize_game(&session->game);
+    return session;
+}
+
+/*
+ * @brief Start journaling a session, if the server journals games.
+ */
+static void start_journal(MultiServer* server, Session* session) {
+    if (NULL == server->journalDir)
+        return;
+    session->journaled = 0 == journal_open(&session->journal, server->journalDir, session->id, &session->game);
+    if (!session->journaled) {
+        INFO("Failed to journal game %lu", session->id);
+    }
+}
+
+/*
+ * @brief Seat a player in the first recovered session, white first, and send it the position.
+ * @details The position covers any move white made before black joined, so pending is dropped.
+ */
+static void seat_recovered(MultiServer* server, Connection* conn) {
+    Session* session = server->recovered;
+    int color = NULL == session->players[WHITE_PLAYER] ? WHITE_PLAYER : BLACK_PLAYER;
+    session->players[color] = conn;
+    conn->color = color;
+    conn->session = session;
+    if (BLACK_PLAYER == color) {
+        server->recovered = session->nextRecovered;
+        session->pendingLength = 0;
+    }
+    char message[BUFFER_SIZE], fen[FEN_MAX_LENGTH];
+    chessboard_to_fen(fen, sizeof(fen), &session->game);
+    snprintf(message, sizeof(message), "/import %s", fen);
+    send_text(server, conn, message);
+}
+
+/*
+ * @brief Rebuild a session from its journal; called once per journal at startup.
+ */
+static void recover_session(unsigned long id, ChessGame* game, void* context) {
+    MultiServer* server = context;
+    Session* session = new_session(server);
+    if (NULL == session)
+        return;
+    session->game = *game;
+    session->id = id;
+    start_journal(server, session);
+    session->nextRecovered = server->recovered;
+    server->recovered = session;
+    add_session(server, session);
+    if (id >= server->nextId)
+        server->nextId = id + 1;
+}
+
+/*
+ * @brief Pair a new player: it plays black in the waiting session, or opens a new session as white.
+ * @details Sessions recovered from journals are filled first.
+ */
+static void pair_player(MultiServer* server, Connection* conn) {
+    if (server->recovered) {
+        seat_recovered(server, conn);
+        return;
+    }
+    Session* session = server->waiting;
+    if (session) {
+        session->players[BLACK_PLAYER] = conn;
+        conn->color = BLACK_PLAYER;
+        conn->session = session;
+        server->waiting = NULL;
+        if (session->pendingLength > 0) {
+            send_message(server, conn, session->pending, session->pendingLength);
+            session->pendingLength = 0;
+        }
+        return;
+    }
+
+    session = new_session(server);
+    if (NULL == session) {
+        close_connection(server, conn);
+        return;
+    }
+    session->id = server->nextId++;
+    start_journal(server, session);
+    session->players[WHITE_PLAYER] = conn;
+    conn->color = WHITE_PLAYER;
+    conn->session = session;
+    server->waiting = session;
+    add_session(server, session);
+    INFO("Game %lu opened", session->id);
+}
+
+/*
+ * @brief Handle "/watch [game id]" from an observer: it follows that game, or the newest one.
+ * @details The observer is sent the position with /import, then every command its players make.
+ */
+static void watch_session(MultiServer* server, Connection* conn, const char* text) {
+    if (NULL != conn->session || 0 != strncmp(text, "/watch", 6) || (' ' != text[6] && '\0' != text[6]))
+        return;
+    char* end;
+    unsigned long id = strtoul(text + 6, &end, 10);
+    Session* session = server->all;
+    for (; session && end != text + 6 && session->id != id; session = session->next)
+        ;
+    char message[BUFFER_SIZE] = "/forfeit", fen[FEN_MAX_LENGTH];
+    if (session) {
+        conn->session = session;
+        conn->nextObserver = session->observers;
+        session->observers = conn;
+        session->observerCount++;
+        chessboard_to_fen(fen, sizeof(fen), &session->game);
+        snprintf(message, sizeof(message), "/import %s", fen);
+    }
+    unsigned char frame[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+    SharedBuffer* buffer = new_buffer(server, frame, encode_frame(message, frame));
+    if (NULL != buffer) {
+        queue_message(server, conn, buffer);
+        release_buffer(server, buffer);
+    }
+    if (NULL == session) {   // No such game
+        flush_queue(server, conn);
+        close_connection(server, conn);
+    }
+}
+
+/*
+ * @brief Queue a save of the session's game for the database writer, without waiting for it.
+ */
+static void save_session(MultiServer* server, Session* session, const char* username) {
+    if (NULL == server->writer)
+        server->writer = db_writer_open("../src/game_database.txt", server->fsyncPolicy, DEFAULT_FSYNC_INTERVAL_MS);
+    if (NULL == server->writer || db_writer_submit(server->writer, &session->game, username) < 0) {
+        INFO("Failed to save the game as %s", username);
+    }
+}
+
+/*
+ * @brief Apply a command of a player to its session and forward it to the opponent.
+ * @details Moves are validated against the session's game; a rejected move is not forwarded.
+ * /import and /load are applied as the opponent receives them. /save is committed by the
+ * database writer thread, so many sessions share one write and the loop never waits on disk.
+ *
+ * @param wire The command as it arrived, forwarded as is.
+ */
+static void handle_frame(MultiServer* server, Connection* conn, const Frame* frame, const char* wire, int size) {
+    Session* session = conn->session;
+    if (NULL == session)
+        return;
+    int is_client = WHITE_PLAYER == conn->color;
+    TRACE_GAME(session->id);
+    TRACE_FRAME(TRACE_RECEIVED, frame);
+
+    switch (frame->opcode) {
+        case FRAME_MOVE:
+            if (0 != make_move(&session->game, &frame->move, is_client, 1)) {
+                char text[MOVE_TEXT_SIZE];
+                INFO("Rejected move %s from fd %d", move_to_text(frame->move, text), conn->fd);
+                return;
+            }
+            if (session->journaled && 0 != journal_append_move(&session->journal, &session->game, &frame->move)) {
+                INFO("Failed to journal game %lu", session->id);
+            }
+            break;
+        case FRAME_FORFEIT:
+            close_connection(server, conn);   // The opponent is sent /forfeit as the session ends
+            return;
+        case FRAME_NONE:
+            break;
+        default:
+            if (0 == strncmp(frame->text, "/save ", 6)) {
+                save_session(server, session, frame->text + 6);
+                return;   // Like play/client, a save is not sent to the opponent
+            }
+            if (0 != strncmp(frame->text, "/import ", 8) && 0 != strncmp(frame->text, "/load ", 6))
+                return;
+            if (COMMAND_ERROR == receive_command(&session->game, frame->text, -1, !is_client))
+                return;
+            if (session->journaled && 0 != journal_snapshot(&session->journal, &session->game)) {
+                INFO("Failed to journal game %lu", session->id);
+            }
+            break;
+    }
+    TRACE_FRAME(TRACE_SENT, frame);
+    forward_message(server, session, !conn->color, wire, size);
+    if (session->ended)   // The opponent could not be sent the command and was closed
+        return;
+    broadcast(server, session, frame->raw, frame->size);
+}
+
+static void accept_connections(MultiServer* server, int observer) {
+    while (1) {
+        int fd = accept(observer ? server->watchfd : server->listenfd, NULL, NULL);
+        if (fd < 0)
+            return;   // EAGAIN: no more pending connections
+        Connection* conn = pool_alloc(server->connectionPool);
+        if (NULL == conn || 0 != set_nonblocking(fd)) {
+            pool_free(server->connectionPool, conn);
+            close(fd);
+            continue;
+        }
+        memset(conn, 0, offsetof(Connection, output));
+        if (observer) {
+            int size = WATCH_SEND_BUFFER;
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        }
+        conn->fd = fd;
+        conn->observer = observer;
+        frame_decoder_init(&conn->decoder);
+        update_events(server, conn, EPOLL_CTL_ADD);
+        if (!observer)
+            pair_player(server, conn);
+    }
+}
+
+/*
+ * @brief Read what arrived from a player and handle every complete command.
+ * @details With WIRE_TEXT each read holds exactly one command, like the two player programs.
+ * With WIRE_BINARY the decoder handles frames split across reads and several frames per read.
+ */
+static void read_connection(MultiServer* server, Connection* conn) {
+    Frame frame;
+    if (WIRE_TEXT == server->protocol && !conn->observer) {
+        char buffer[BUFFER_SIZE];
+        unsigned char encoded[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+        ssize_t n = read(conn->fd, buffer, BUFFER_SIZE - 1);
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+            return;
+        if (n <= 0) {
+            close_connection(server, conn);
+            return;
+        }
+        buffer[n] = '\0';
+        int size = encode_frame(buffer, encoded);
+        if (size > 0 && 0 == decode_frame(encoded, size, &frame))
+            handle_frame(server, conn, &frame, buffer, (int) n);
+        return;
+    }
+
+    int n = frame_decoder_read(&conn->decoder, conn->fd);
+    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+        return;
+    if (n <= 0) {
+        close_connection(server, conn);
+        return;
+    }
+    int ret = 0;
+    while (!conn->closed && (ret = frame_decoder_next(&conn->decoder, &frame)) > 0) {
+        if (conn->observer)
+            watch_session(server, conn, FRAME_TEXT == frame.opcode ? frame.text : "");
+        else
+            handle_frame(server, conn, &frame, (const char*) frame.raw, frame.size);
+    }
+    if (ret < 0)
+        close_connection(server, conn);
+}
+
+/*
+ * @brief Open a non-blocking listening socket on a port.
+ *
+ * @return The socket, -1 on failure.
+ */
+static int listen_on(int port) {
+    int opt = 1;
+    struct sockaddr_in address;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0 || 0 != set_nonblocking(fd)) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * @brief Wake the event loop to stop the server; only async-signal-safe calls are made here.
+ */
+static void stop_on_signal(int signal_number) {
+    (void) signal_number;
+    int saved = errno;
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0) {
+        // Counter full: a stop is already pending
+    }
+    errno = saved;
+}
+
+/*
+ * @brief Stop the loop on SIGINT and SIGTERM through an eventfd it polls.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int watch_stop_signals(MultiServer* server) {
+    if (stop_fd < 0 && (stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &stop_fd;   // Marks the stop signal
+    if (0 != epoll_ctl(server->epollfd, EPOLL_CTL_ADD, stop_fd, &event))
+        return -1;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_on_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    return 0;
+}
+
+/**
+ * @brief Host many games in one process.
+ * @details All sockets are non-blocking and served by one epoll loop. Players are paired in
+ * order of arrival: the first of a pair plays white (as play/client), the second black
+ * (as play/client --black). White may move before black joins. Each session's game
+ * advances as its messages arrive. Every player uses the protocol chosen with set_wire_protocol.
+ *
+ * Every move is journaled in journal_dir. After a restart, the games left in it are rebuilt and
+ * the first players to connect are seated in them, in order, and sent the position with /import.
+ *
+ * Observers connect on port + 1 and send "/watch [game id]". Each command of a game is copied once
+ * into a reference-counted buffer queued to all its observers, and each observer's queue is sent
+ * in one sendmsg at the end of the round of events. An observer that falls WATCH_QUEUE_SIZE
+ * messages behind is dropped, so observers never hold up the players.
+ *
+ * Sessions, connections and shared messages come from object pools (see Pool.c) and go back to
+ * them, so handling a move allocates nothing and a server running for days does not fragment
+ * its heap. Their reuse is part of the statistics written with --stats.
+ *
+ * SIGINT and SIGTERM stop the server: every save already queued is committed first. Journals
+ * are kept, so the games go on after a restart.
+ *
+ * @param fsync_policy When saves reach the disk, FSYNC_NONE, FSYNC_BATCH or FSYNC_INTERVAL.
+ * @param journal_dir Directory of the game journals, NULL to not journal games.
+ * @return 0 once stopped by a signal, -1 on failure.
+ */
+int run_multi_server(int port, int fsync_policy, const char* journal_dir) {
+    MultiServer server;
+    memset(&server, 0, sizeof(server));
+    server.protocol = get_wire_protocol();
+    server.fsyncPolicy = fsync_policy;
+    server.journalDir = journal_dir;
+    server.sessionPool = pool_create("sessions", sizeof(Session));
+    server.connectionPool = pool_create("connections", sizeof(Connection));
+    server.smallMessages = pool_create("small_messages", sizeof(SharedBuffer) + SMALL_MESSAGE_SIZE);
+    server.largeMessages = pool_create("large_messages", sizeof(SharedBuffer) + FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+    if (NULL == server.sessionPool || NULL == server.connectionPool || NULL == server.smallMessages
+        || NULL == server.largeMessages) {
+        perror("pool_create");
+        return -1;
+    }
+    if (journal_dir) {
+        mkdir(journal_dir, 0755);
+        long recovered = journal_recover_all(journal_dir, recover_session, &server);
+        if (recovered < 0) {
+            perror("journal");
+            return -1;
+        }
+        if (recovered > 0) {
+            INFO("Recovered %ld games from %s", recovered, journal_dir);
+        }
+    }
+    if ((server.listenfd = listen_on(port)) < 0 || (server.watchfd = listen_on(port + 1)) < 0)
+        return -1;
+    if ((server.epollfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;   // NULL marks the listening socket of players
+    epoll_ctl(server.epollfd, EPOLL_CTL_ADD, server.listenfd, &event);
+    event.data.ptr = &server.watchfd;   // And this the one of observers
+    epoll_ctl(server.epollfd, EPOLL_CTL_ADD, server.watchfd, &event);
+    if (0 != watch_stop_signals(&server)) {
+        perror("eventfd");
+        return -1;
+    }
+    INFO("Multi-game server listening on port %d, observers on port %d", port, port + 1);
+
+    struct epoll_event events[MAX_EVENTS];
+    int ret = 1;   // Running
+    while (ret > 0) {
+        int count = epoll_wait(server.epollfd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (EINTR == errno)
+                continue;
+            perror("epoll_wait");
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            Connection* conn = events[i].data.ptr;
+            if ((void*) &stop_fd == events[i].data.ptr) {
+                ret = 0;   // Finish this round of events, then stop
+                continue;
+            }
+            if (NULL == conn || (void*) &server.watchfd == events[i].data.ptr) {
+                accept_connections(&server, NULL != conn);
+                continue;
+            }
+            if (conn->closed)
+                continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(&server, conn);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && 0 != flush_output(&server, conn)) {
+                close_connection(&server, conn);
+                continue;
+            }
+            if (events[i].events & EPOLLIN)
+                read_connection(&server, conn);
+        }
+        flush_observers(&server);
+        while (server.closing) {
+            Connection* next = server.closing->nextClosing;
+            pool_free(server.connectionPool, server.closing);
+            server.closing = next;
+        }
+        while (server.ended) {
+            Session* next = server.ended->nextEnded;
+            pool_free(server.sessionPool, server.ended);
+            server.ended = next;
+        }
+    }
+    if (0 == ret) {
+        INFO("Stopping, %lu games in progress", server.sessions);
+    }
+    if (server.writer && 0 != db_writer_close(server.writer)) {   // Commit the saves already queued
+        INFO("Failed to commit the queued saves");
+        ret = -1;
+    }
+    close(server.listenfd);
+    close(server.watchfd);
+    close(server.epollfd);
+    return ret;
+}
@@ -0,0 +1,57 @@
+#include <time.h>
+#include "Resources.h"
+
+#define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w"
+
+/*
+ * @brief Count the leaf nodes of the move tree to the given depth.
+ */
+unsigned long long perft(ChessGame* game, int depth) {
+    ChessMove moves[MAX_GENERATED_MOVES];
+    int count = generate_moves(game, moves);
+    if (1 == depth)
+        return count;
+
+    unsigned long long nodes = 0;
+    for (int i = 0; i < count; ++i) {
+        make_move(game, &moves[i], game->currentPlayer == WHITE_PLAYER, 0);
+        nodes += perft(game, depth - 1);
+        unmake_move(game);
+    }
+    return nodes;
+}
+
+/*
+ * @brief Usage: perft <depth> [FEN]
+ * @details Report the node count, elapsed time and nodes per second for every depth
+ * from 1 up to the given depth. The FEN defaults to the starting position.
+ */
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <depth> [FEN]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int depth = atoi(argv[1]);
+    if (depth <= 0) {
+        fprintf(stderr, "Depth must be positive.\n");
+        return EXIT_FAILURE;
+    }
+
+    ChessGame game;
+    initialize_game(&game);
+    if (0 != fen_to_chessboard(argc > 2 ? argv[2] : START_FEN, &game)) {
+        fprintf(stderr, "Invalid FEN.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int d = 1; d <= depth; ++d) {
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        unsigned long long nodes = perft(&game, d);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        fprintf(stdout, "perft(%d) = %llu  time %.3f s  %.0f nodes/s\n",
+                d, nodes, seconds, seconds > 0 ? nodes / seconds : 0.0);
+    }
+    return EXIT_SUCCESS;
+}
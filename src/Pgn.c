@@ -0,0 +1,124 @@
+#include "Resources.h"
+
+/*
+ * PGN reading shared by the importer and the opening book builder. Games are replayed from the
+ * standard position, or from their [FEN] tag, resolving each SAN move with parse_san and making
+ * it with make_move's validation. Comments, variations, annotation glyphs and move numbers are
+ * skipped. A game ends at its result, or at the next tag section if it has none.
+ */
+
+#define PGN_TOKEN_MAX 16
+
+/*
+ * @brief Report the game being read to the handler and start the next one.
+ */
+static void end_game(ChessGame* game, const PgnHandler* handler, int* valid, int* started) {
+    if (*started && handler->game)
+        handler->game(game, *valid, handler->context);
+    initialize_game(game);
+    *valid = 1;
+    *started = 0;
+}
+
+/**
+ * @brief Replay the PGN games of a text, which must hold whole games.
+ *
+ * @param game Used for replay; it holds the final position of each game when handler->game is called.
+ * @return Number of valid moves made.
+ */
+long read_pgn(const char* text, size_t length, ChessGame* game, const PgnHandler* handler) {
+    int valid = 1, started = 0, ply = 0, depth = 0;   // depth: nesting of (variations)
+    long moves = 0;
+    const char* p = text;
+    const char* end = text + length;
+    char token[PGN_TOKEN_MAX], fen[BUFFER_SIZE];
+    ChessMove move;
+    initialize_game(game);
+    while (p < end) {
+        char c = *p;
+        if (' ' == c || '\t' == c || '\r' == c || '\n' == c) {
+            p++;
+        } else if ('[' == c) {   // Tag pair, a new game if the last one had moves
+            const char* close = memchr(p, '\n', end - p);
+            close = NULL == close ? end : close;
+            if (started && ply > 0) {
+                end_game(game, handler, &valid, &started);
+                ply = 0;
+            }
+            started = 1;
+            if (0 == strncmp(p, "[FEN \"", 6) && close - p - 6 < (long) sizeof(fen)) {
+                memcpy(fen, p + 6, close - p - 6);
+                fen[close - p - 6] = '\0';
+                fen[strcspn(fen, "\"")] = '\0';
+                if (0 != fen_to_chessboard(fen, game))
+                    valid = 0;
+            }
+            p = close;
+        } else if ('{' == c) {
+            const char* close = memchr(p, '}', end - p);
+            p = NULL == close ? end : close + 1;
+        } else if (';' == c || ('%' == c && (p == text || '\n' == p[-1]))) {
+            const char* close = memchr(p, '\n', end - p);
+            p = NULL == close ? end : close;
+        } else if ('(' == c || ')' == c) {
+            depth += '(' == c ? 1 : (depth > 0 ? -1 : 0);
+            p++;
+        } else {
+            const char* begin = p;
+            while (p < end && NULL == strchr(" \t\r\n{}();[", *p))
+                p++;
+            size_t size = p - begin < PGN_TOKEN_MAX ? p - begin : PGN_TOKEN_MAX - 1;   // Longer tokens are not moves
+            memcpy(token, begin, size);
+            token[size] = '\0';
+            char* san = token;
+            if (depth > 0 || '$' == *san || 0 == strcmp(san, "e.p.")) {
+                // Variations, annotation glyphs and en passant marks are not part of the game
+            } else if (0 == strcmp(san, "1-0") || 0 == strcmp(san, "0-1")
+                    || 0 == strcmp(san, "1/2-1/2") || 0 == strcmp(san, "*")) {
+                started = 1;
+                end_game(game, handler, &valid, &started);
+                ply = 0;
+            } else {
+                if (*san >= '0' && *san <= '9' && 0 != strncmp(san, "0-0", 3))
+                    san += strspn(san, "0123456789.");   // Move number, as in "12." or "12...e5"
+                if ('\0' == *san)
+                    continue;
+                started = 1;
+                ply++;
+                if (!valid)
+                    continue;
+                uint64_t hash = game->hash;
+                valid = 0 == parse_san(game, san, &move)
+                        && 0 == make_move(game, &move, WHITE_PLAYER == game->currentPlayer, 1);
+                if (valid) {
+                    moves++;
+                    if (handler->move)
+                        handler->move(hash, &move, ply, handler->context);
+                }
+            }
+        }
+    }
+    end_game(game, handler, &valid, &started);
+    return moves;
+}
+
+/**
+ * @brief Length of the text before the last PGN game that starts in it: a tag line that does
+ * not follow another tag line. Text can be cut there into parts holding whole games.
+ *
+ * @return 0 if no game starts after the beginning of the text.
+ */
+size_t pgn_boundary(const char* text, size_t length) {
+    for (size_t i = length; i-- > 1; ) {
+        if ('[' != text[i] || '\n' != text[i - 1])
+            continue;
+        size_t j = i - 1;
+        while (j > 0 && ('\n' == text[j - 1] || '\r' == text[j - 1]))   // Skip blank lines
+            j--;
+        while (j > 0 && '\n' != text[j - 1])
+            j--;
+        if ('[' != text[j])
+            return i;
+    }
+    return 0;
+}
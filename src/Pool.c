@@ -0,0 +1,192 @@
+#include <pthread.h>
+#include "Resources.h"
+
+/*
+ * Fixed-size object pools for state that is created and freed all the time by a long-running
+ * server, such as sessions, connections and message buffers. Objects are carved out of slabs of
+ * POOL_SLAB_BYTES or more, aligned to a cache line, and are never given back to malloc: a freed
+ * object goes to a free list and is handed out again, so days of churn do not fragment the heap.
+ *
+ * Each thread keeps its own free list of every pool, of at most POOL_CACHE_SIZE objects, and
+ * trades half of it with the pool's shared list under its lock when it runs empty or full. An
+ * allocation or a free is then a few pointer moves, with no lock and no malloc.
+ */
+
+#define POOL_SLAB_BYTES (64 * 1024)
+#define POOL_CACHE_SIZE 64
+#define POOL_BATCH (POOL_CACHE_SIZE / 2)
+
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+struct Pool {
+    char name[POOL_NAME_SIZE];
+    size_t objectSize;            // Rounded up to a whole number of cache lines
+    int slabObjects;
+    int id;                       // Index of the pool's free list in every thread
+    pthread_mutex_t lock;
+    void* free;                   // Shared free list, linked through the first word of each object
+    char* fresh;                  // Objects of the newest slab never handed out yet
+    char* freshEnd;
+    PoolSlab* slabs;
+    PoolStats stats;              // Counts of every thread, added when it trades with the pool
+};
+
+typedef struct {
+    void* head;
+    int count;
+    unsigned long long allocations;   // Not yet added to the pool's stats
+    unsigned long long frees;
+} PoolCache;
+
+static __thread PoolCache thread_caches[POOL_MAX];
+static Pool* pools[POOL_MAX];
+static int pool_count;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Create a pool of objects of one size.
+ * @details Pools last as long as the process; at most POOL_MAX are created.
+ *
+ * @param name Name reported by pool_list.
+ * @return The pool, NULL if out of memory or POOL_MAX pools exist.
+ */
+Pool* pool_create(const char* name, size_t object_size) {
+    Pool* pool = calloc(1, sizeof(Pool));
+    if (NULL == pool)
+        return NULL;
+    snprintf(pool->name, sizeof(pool->name), "%s", name);
+    object_size = object_size < sizeof(void*) ? sizeof(void*) : object_size;
+    pool->objectSize = (object_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    pool->slabObjects = POOL_SLAB_BYTES / pool->objectSize > 8 ? (int) (POOL_SLAB_BYTES / pool->objectSize) : 8;
+    pool->stats.objectSize = pool->objectSize;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_lock(&pools_lock);
+    pool->id = pool_count < POOL_MAX ? pool_count++ : -1;
+    if (pool->id >= 0)
+        pools[pool->id] = pool;
+    pthread_mutex_unlock(&pools_lock);
+    if (pool->id < 0) {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+ * @brief Move a batch of objects from the shared list, or from a new slab, to a thread's list.
+ * Called with the pool locked.
+ *
+ * @return 0 on success, -1 if a slab is needed and cannot be allocated.
+ */
+static int refill_cache(Pool* pool, PoolCache* cache) {
+    for (int i = 0; i < POOL_BATCH && pool->free; ++i) {
+        void* object = pool->free;
+        pool->free = *(void**) object;
+        *(void**) object = cache->head;
+        cache->head = object;
+        cache->count++;
+    }
+    if (cache->head)
+        return 0;
+    if (pool->fresh == pool->freshEnd) {
+        PoolSlab* slab;
+        if (0 != posix_memalign((void**) &slab, POOL_ALIGN, POOL_ALIGN + pool->slabObjects * pool->objectSize))
+            return -1;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->fresh = (char*) slab + POOL_ALIGN;   // Objects start a cache line after the slab header
+        pool->freshEnd = pool->fresh + pool->slabObjects * pool->objectSize;
+        pool->stats.slabs++;
+        pool->stats.bytes += POOL_ALIGN + pool->slabObjects * pool->objectSize;
+    }
+    for (int i = 0; i < POOL_BATCH && pool->fresh < pool->freshEnd; ++i) {
+        *(void**) pool->fresh = cache->head;
+        cache->head = pool->fresh;
+        cache->count++;
+        pool->fresh += pool->objectSize;
+        pool->stats.created++;
+    }
+    return 0;
+}
+
+/*
+ * @brief Add a thread's counts to the pool's stats. Called with the pool locked.
+ */
+static void merge_counts(Pool* pool, PoolCache* cache) {
+    pool->stats.allocations += cache->allocations;
+    pool->stats.frees += cache->frees;
+    cache->allocations = cache->frees = 0;
+}
+
+/**
+ * @brief Take an object from a pool. Its content is what its last user left, or undefined.
+ *
+ * @return The object, aligned to POOL_ALIGN, NULL if out of memory.
+ */
+void* pool_alloc(Pool* pool) {
+    PoolCache* cache = &thread_caches[pool->id];
+    if (NULL == cache->head) {
+        pthread_mutex_lock(&pool->lock);
+        merge_counts(pool, cache);
+        int ret = refill_cache(pool, cache);
+        pthread_mutex_unlock(&pool->lock);
+        if (0 != ret)
+            return NULL;
+    }
+    void* object = cache->head;
+    cache->head = *(void**) object;
+    cache->count--;
+    cache->allocations++;
+    return object;
+}
+
+/**
+ * @brief Give an object back to the pool it was taken from, from any thread.
+ */
+void pool_free(Pool* pool, void* object) {
+    if (NULL == object)
+        return;
+    PoolCache* cache = &thread_caches[pool->id];
+    *(void**) object = cache->head;
+    cache->head = object;
+    cache->count++;
+    cache->frees++;
+    if (cache->count < POOL_CACHE_SIZE)
+        return;
+
+    pthread_mutex_lock(&pool->lock);   // Keep half, the shared list takes the rest
+    merge_counts(pool, cache);
+    for (; cache->count > POOL_CACHE_SIZE - POOL_BATCH; cache->count--) {
+        void* next = *(void**) cache->head;
+        *(void**) cache->head = pool->free;
+        pool->free = cache->head;
+        cache->head = next;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Copy the stats of every pool created, in order of creation.
+ * @details Allocations and frees of a thread are counted once it trades objects with the pool,
+ * and those of the calling thread are counted now, so only other threads' last few are missing.
+ *
+ * @param out Buffer of at least POOL_MAX stats.
+ * @return Number of pools.
+ */
+int pool_list(PoolStats* out) {
+    pthread_mutex_lock(&pools_lock);
+    int count = pool_count;
+    pthread_mutex_unlock(&pools_lock);
+    for (int i = 0; i < count; ++i) {
+        Pool* pool = pools[i];
+        pthread_mutex_lock(&pool->lock);
+        merge_counts(pool, &thread_caches[i]);
+        out[i] = pool->stats;
+        pthread_mutex_unlock(&pool->lock);
+        snprintf(out[i].name, sizeof(out[i].name), "%s", pool->name);
+    }
+    return count;
+}
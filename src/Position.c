@@ -0,0 +1,201 @@
+#include <endian.h>
+#include <fcntl.h>
+#include "Resources.h"
+
+/*
+ * A binary game database is a PositionHeader followed by PositionRecords of
+ * POSITION_RECORD_SIZE bytes each, so record n is at POSITION_HEADER_SIZE + n * POSITION_RECORD_SIZE.
+ * Integers are stored little-endian.
+ */
+
+/**
+ * @brief Tell the format of an open game database from its first bytes.
+ *
+ * @return DATABASE_BINARY if it starts with a supported header, DATABASE_TEXT if it does not
+ * start with the header magic (an empty file is text), -1 for an unsupported binary version.
+ */
+int database_format(int fd) {
+    PositionHeader header;
+    if (sizeof(header) != pread(fd, &header, sizeof(header), 0)
+            || 0 != memcmp(header.magic, POSITION_MAGIC, sizeof(header.magic)))
+        return DATABASE_TEXT;
+    if (POSITION_VERSION != le32toh(header.version) || POSITION_RECORD_SIZE != le32toh(header.recordSize))
+        return -1;
+    return DATABASE_BINARY;
+}
+
+/**
+ * @brief Write the header of a binary game database at the current position of file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int write_position_header(FILE* file) {
+    PositionHeader header;
+    memcpy(header.magic, POSITION_MAGIC, sizeof(header.magic));
+    header.version = htole32(POSITION_VERSION);
+    header.recordSize = htole32(POSITION_RECORD_SIZE);
+    return 1 == fwrite(&header, sizeof(header), 1, file) ? 0 : -1;
+}
+
+/**
+ * @brief Pack a position and the username it is saved under into a record.
+ *
+ * @return 0 on success, -1 if the username does not fit in the record.
+ */
+int pack_position(const ChessGame* game, const char* username, PositionRecord* record) {
+    size_t length = strlen(username);
+    if (length > POSITION_USERNAME_SIZE)
+        return -1;
+    memset(record, 0, sizeof(*record));
+    for (int square = 0; square < 64; ++square) {
+        int index = piece_index(game->chessboard[square >> 3][square & 7]);
+        record->board[square >> 1] |= (uint8_t) ((index + 1) << (4 * (square & 1)));
+    }
+    record->hash = htole64(game->hash);
+    record->side = (uint8_t) game->currentPlayer;
+    record->state = (uint8_t) (game->castling | (NO_SQUARE == game->epSquare ? 0 : 1 + (game->epSquare & 7)) << 4);
+    memcpy(record->username, username, length);
+    return 0;
+}
+
+/**
+ * @brief Set up a game from a record, as fen_to_chessboard does from a FEN.
+ *
+ * @param username Buffer of at least POSITION_USERNAME_SIZE + 1 bytes, or NULL.
+ * @return 0 on success, -1 if the record is corrupt.
+ */
+int unpack_position(const PositionRecord* record, ChessGame* game, char* username) {
+    if (record->side > BLACK_PLAYER || (record->state >> 4) > 8)
+        return -1;
+    memset(game->pieceBB, 0, sizeof(game->pieceBB));
+    game->colorBB[WHITE_PLAYER] = game->colorBB[BLACK_PLAYER] = 0;
+    for (int square = 0; square < 64; ++square) {
+        int code = (record->board[square >> 1] >> (4 * (square & 1))) & 0xF;
+        if (code > PIECE_TYPES)
+            return -1;
+        game->chessboard[square >> 3][square & 7] = 0 == code ? '.' : PIECE_CHARS[code - 1];
+        if (0 != code) {
+            game->pieceBB[code - 1] |= SQUARE_BIT(square);
+            game->colorBB[PIECE_COLOR(code - 1)] |= SQUARE_BIT(square);
+        }
+    }
+    game->occupiedBB = game->colorBB[WHITE_PLAYER] | game->colorBB[BLACK_PLAYER];
+    game->currentPlayer = record->side;
+    game->castling = record->state & 0xF;
+    game->epSquare = 0 == (record->state >> 4) ? NO_SQUARE : SQUARE(BLACK_PLAYER == record->side ? 5 : 2, (record->state >> 4) - 1);
+    game->moveCount = 0;
+    game->undoCount = 0;
+    game->halfmoveClock = 0;      // Records do not hold the move counters
+    game->fullmoveNumber = 1;
+    update_attacks(game);
+    game->hash = compute_hash(game);
+    if (le64toh(record->hash) != game->hash)
+        return -1;
+    if (username) {
+        memcpy(username, record->username, POSITION_USERNAME_SIZE);
+        username[POSITION_USERNAME_SIZE] = '\0';
+    }
+    return 0;
+}
+
+/**
+ * @brief Read record number n (from 0) of a binary game database with a single read.
+ *
+ * @param username Buffer of at least POSITION_USERNAME_SIZE + 1 bytes, or NULL.
+ * @return 0 on success, -1 if the file is not a binary database, has no such record, or it is corrupt.
+ */
+int read_position(const char* db_filename, long n, ChessGame* game, char* username) {
+    int fd = open(db_filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    PositionRecord record;
+    int ret = -1;
+    if (n >= 0 && DATABASE_BINARY == database_format(fd)
+            && sizeof(record) == pread(fd, &record, sizeof(record), POSITION_HEADER_SIZE + (off_t) n * POSITION_RECORD_SIZE))
+        ret = unpack_position(&record, game, username);
+    close(fd);
+    return ret;
+}
+
+/*
+ * @brief Copy the records of a text database into a new binary one.
+ */
+static long text_to_binary(FILE* in, FILE* out, long* skipped) {
+    long count = 0;
+    char line[BUFFER_SIZE];
+    ChessGame game;
+    PositionRecord record;
+    if (0 != write_position_header(out))
+        return -1;
+    while (NULL != fgets(line, BUFFER_SIZE, in)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* colon = strchr(line, ':');
+        if (NULL == colon) {
+            (*skipped)++;
+            continue;
+        }
+        *colon = '\0';
+        if (0 != fen_to_chessboard(colon + 1, &game) || 0 != pack_position(&game, line, &record)) {
+            (*skipped)++;
+            continue;
+        }
+        if (1 != fwrite(&record, sizeof(record), 1, out))
+            return -1;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * @brief Copy the records of a binary database into a new text one.
+ */
+static long binary_to_text(FILE* in, FILE* out, long* skipped) {
+    long count = 0;
+    char username[POSITION_USERNAME_SIZE + 1], fen[FEN_MAX_LENGTH];
+    ChessGame game;
+    PositionRecord record;
+    if (0 != fseeko(in, POSITION_HEADER_SIZE, SEEK_SET))
+        return -1;
+    while (1 == fread(&record, sizeof(record), 1, in)) {
+        if (0 != unpack_position(&record, &game, username)) {
+            (*skipped)++;
+            continue;
+        }
+        chessboard_to_fen(fen, sizeof(fen), &game);
+        if (fprintf(out, "%s:%s\n", username, fen) < 0)
+            return -1;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Convert a game database to the other format: text to binary, or binary to text.
+ * @details Records are kept in order, so save numbers do not change. The index of the
+ * new database is removed, it is built again on first use.
+ *
+ * @param skipped Receives the number of records that could not be converted: lines without
+ * a username or a valid FEN, usernames longer than POSITION_USERNAME_SIZE, corrupt binary records.
+ * @return Number of records converted, -1 on failure.
+ */
+long convert_database(const char* from, const char* to, long* skipped) {
+    FILE* in = fopen(from, "r");
+    if (!in)
+        return -1;
+    int format = database_format(fileno(in));
+    FILE* out = format < 0 ? NULL : fopen(to, "w");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+    *skipped = 0;
+    long count = DATABASE_TEXT == format ? text_to_binary(in, out, skipped) : binary_to_text(in, out, skipped);
+    fclose(in);
+    if (0 != fclose(out))
+        count = -1;
+
+    char index[BUFFER_SIZE];
+    if (snprintf(index, sizeof(index), "%s.idx", to) < (int) sizeof(index))
+        unlink(index);
+    return count;
+}
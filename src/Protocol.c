@@ -0,0 +1,205 @@
+#include "Resources.h"
+
+/*
+ * A binary frame is a 2-byte big-endian length, then that many bytes of payload.
+ * The payload is a 1-byte opcode followed by:
+ *   FRAME_MOVE     the ChessMove, 2 bytes big-endian
+ *   FRAME_FORFEIT  nothing
+ *   FRAME_NONE     nothing
+ *   FRAME_TEXT     any other command as text, without '\0'
+ */
+
+static int wire_protocol = WIRE_TEXT;
+
+/**
+ * @brief Choose the protocol used by transmit and receive_message, WIRE_TEXT or WIRE_BINARY.
+ */
+void set_wire_protocol(int protocol) {
+    wire_protocol = protocol;
+}
+
+int get_wire_protocol(void) {
+    return wire_protocol;
+}
+
+/**
+ * @brief Encode a text command in a binary frame.
+ *
+ * @param out Buffer of at least FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD bytes.
+ * @return Size of the frame, -1 if the command is too long.
+ */
+int encode_frame(const char* message, unsigned char* out) {
+    int payload;
+    ChessMove move;
+    if (0 == strncmp(message, "/move ", 6) && 0 == parse_move(message + 6, &move)) {
+        out[2] = FRAME_MOVE;
+        out[3] = move >> 8;
+        out[4] = move & 0xFF;
+        payload = 3;
+    } else if (0 == strcmp(message, "/forfeit")) {
+        out[2] = FRAME_FORFEIT;
+        payload = 1;
+    } else if (0 == strcmp(message, "/none")) {
+        out[2] = FRAME_NONE;
+        payload = 1;
+    } else {
+        int length = (int) strlen(message);
+        if (length + 1 > FRAME_MAX_PAYLOAD)
+            return -1;
+        out[2] = FRAME_TEXT;
+        memcpy(out + 3, message, length);
+        payload = length + 1;
+    }
+    out[0] = payload >> 8;
+    out[1] = payload & 0xFF;
+    return FRAME_HEADER_SIZE + payload;
+}
+
+/**
+ * @brief Decode one complete frame.
+ *
+ * @param size Number of bytes of the frame, header included.
+ * @return 0 if decoded, -1 if malformed.
+ */
+int decode_frame(const unsigned char* data, int size, Frame* frame) {
+    int payload = size - FRAME_HEADER_SIZE;
+    if (payload < 1 || (data[0] << 8 | data[1]) != payload)
+        return -1;
+    frame->opcode = data[2];
+    frame->raw = data;
+    frame->size = size;
+    switch (frame->opcode) {
+        case FRAME_MOVE:
+            if (3 != payload)
+                return -1;
+            frame->move = (ChessMove) (data[3] << 8 | data[4]);
+            return 0;
+        case FRAME_FORFEIT:
+        case FRAME_NONE:
+            return 1 == payload ? 0 : -1;
+        case FRAME_TEXT:
+            memcpy(frame->text, data + 3, payload - 1);
+            frame->text[payload - 1] = '\0';
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief Write the text command a frame stands for.
+ *
+ * @param message Buffer of at least BUFFER_SIZE bytes.
+ */
+void frame_to_message(const Frame* frame, char* message) {
+    char text[MOVE_TEXT_SIZE];
+    switch (frame->opcode) {
+        case FRAME_MOVE:
+            sprintf(message, "/move %s", move_to_text(frame->move, text));
+            break;
+        case FRAME_FORFEIT:
+            strcpy(message, "/forfeit");
+            break;
+        case FRAME_NONE:
+            strcpy(message, "/none");
+            break;
+        default:
+            strcpy(message, frame->text);
+            break;
+    }
+}
+
+void frame_decoder_init(FrameDecoder* decoder) {
+    decoder->start = decoder->end = 0;
+}
+
+/**
+ * @brief Read from a socket straight into the free space of the decoder.
+ * @details Decoded bytes are dropped first, so a partial frame is moved to the front at most once per read.
+ *
+ * @return Result of read(), or -1 if the buffer is full of an unfinished frame.
+ */
+int frame_decoder_read(FrameDecoder* decoder, int socketfd) {
+    if (decoder->start > 0) {
+        memmove(decoder->buffer, decoder->buffer + decoder->start, decoder->end - decoder->start);
+        decoder->end -= decoder->start;
+        decoder->start = 0;
+    }
+    if (FRAME_DECODER_SIZE == decoder->end)
+        return -1;
+    int n = (int) read(socketfd, decoder->buffer + decoder->end, FRAME_DECODER_SIZE - decoder->end);
+    if (n > 0)
+        decoder->end += n;
+    return n;
+}
+
+/**
+ * @brief Take the next complete frame out of the decoder.
+ * @details Several frames from one read are returned one by one, and a frame split across
+ * reads is returned once its last byte arrives. frame->raw stays valid until the next read.
+ *
+ * @return 1 if a frame was decoded, 0 if more bytes are needed, -1 if the stream is malformed.
+ */
+int frame_decoder_next(FrameDecoder* decoder, Frame* frame) {
+    int available = decoder->end - decoder->start;
+    if (available < FRAME_HEADER_SIZE)
+        return 0;
+    const unsigned char* data = decoder->buffer + decoder->start;
+    int payload = data[0] << 8 | data[1];
+    if (payload < 1 || payload > FRAME_MAX_PAYLOAD)
+        return -1;
+    if (available < FRAME_HEADER_SIZE + payload)
+        return 0;
+    if (0 != decode_frame(data, FRAME_HEADER_SIZE + payload, frame))
+        return -1;
+    decoder->start += FRAME_HEADER_SIZE + payload;
+    return 1;
+}
+
+/**
+ * @brief Send a command to the other player with the current wire protocol.
+ *
+ * @return Number of bytes sent, -1 on failure.
+ */
+int transmit(int socketfd, const char* message) {
+    TRACE_MESSAGE(TRACE_SENT, message);
+    if (WIRE_TEXT == wire_protocol)
+        return (int) send(socketfd, message, strlen(message), 0);
+    unsigned char frame[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+    int size = encode_frame(message, frame);
+    if (size < 0)
+        return -1;
+    return (int) send(socketfd, frame, size, 0);
+}
+
+/**
+ * @brief Receive the next command from the other player with the current wire protocol.
+ * @details With WIRE_TEXT each read is one command, as in the original protocol.
+ * With WIRE_BINARY frames are taken from the decoder, reading only when it has no complete frame.
+ *
+ * @param message Buffer of BUFFER_SIZE bytes, receives the command as text.
+ * @return Positive on success, 0 if the connection closed, -1 on error.
+ */
+int receive_message(int socketfd, FrameDecoder* decoder, char* message) {
+    if (WIRE_TEXT == wire_protocol) {
+        memset(message, 0, BUFFER_SIZE);
+        int n = (int) read(socketfd, message, BUFFER_SIZE - 1);
+        if (n > 0)
+            TRACE_MESSAGE(TRACE_RECEIVED, message);
+        return n;
+    }
+    Frame frame;
+    while (1) {
+        int ret = frame_decoder_next(decoder, &frame);
+        if (ret < 0)
+            return -1;
+        if (ret > 0) {
+            frame_to_message(&frame, message);
+            TRACE_FRAME(TRACE_RECEIVED, &frame);
+            return 1;
+        }
+        int n = frame_decoder_read(decoder, socketfd);
+        if (n <= 0)
+            return n;
+    }
+}
@@ -0,0 +1,109 @@
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "Resources.h"
+
+#define BENCH_JOURNAL_DIR "play/bench_journal"
+
+typedef struct {
+    long games;
+    long moves;
+    long mismatched;        // Games whose position or move counters differ from the journaled ones
+    const char* fens;       // FEN of each game when journaled, FEN_MAX_LENGTH bytes apart
+} Recovered;
+
+static double elapsed(const struct timespec* begin) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static void count_game(unsigned long id, ChessGame* game, void* context) {
+    Recovered* recovered = context;
+    char fen[FEN_MAX_LENGTH];
+    recovered->games++;
+    recovered->moves += game->moveCount;
+    chessboard_to_fen(fen, sizeof(fen), game);
+    recovered->mismatched += 0 != strcmp(fen, recovered->fens + id * FEN_MAX_LENGTH);
+}
+
+/*
+ * @brief Remove the journals of a previous run.
+ */
+static void clear_journals(void) {
+    DIR* directory = opendir(BENCH_JOURNAL_DIR);
+    if (NULL == directory)
+        return;
+    struct dirent* entry;
+    char path[BUFFER_SIZE];
+    while (NULL != (entry = readdir(directory))) {
+        if ('.' == entry->d_name[0])
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", BENCH_JOURNAL_DIR, entry->d_name);
+        unlink(path);
+    }
+    closedir(directory);
+}
+
+/*
+ * @brief Usage: recoverybench [games]
+ * @details Journal games of random length, as a --multi server does while they are played,
+ * then rebuild them all as a restarted server does, and report games restored per second.
+ * Every game rebuilt must have the FEN, move counters included, it had when journaled.
+ */
+int main(int argc, char* argv[]) {
+    long games = argc > 1 ? atol(argv[1]) : 10000;
+    if (games <= 0) {
+        fprintf(stderr, "Usage: %s [games]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char* fens = malloc(games * FEN_MAX_LENGTH);
+    if (NULL == fens) {
+        fprintf(stderr, "Usage: %s [games]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    mkdir(BENCH_JOURNAL_DIR, 0755);
+    clear_journals();
+
+    ChessGame game;
+    ChessMove moves[MAX_GENERATED_MOVES];
+    GameJournal journal;
+    long journaled = 0;
+    struct timespec begin;
+    srand(1);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (long i = 0; i < games; ++i) {
+        initialize_game(&game);
+        if (0 != journal_open(&journal, BENCH_JOURNAL_DIR, (unsigned long) i, &game)) {
+            fprintf(stderr, "Failed to journal game %ld.\n", i);
+            return EXIT_FAILURE;
+        }
+        int length = 1 + rand() % 200;
+        for (int ply = 0; ply < length; ++ply) {
+            int count = generate_moves(&game, moves);
+            if (0 == count)
+                break;
+            ChessMove* move = &moves[rand() % count];
+            make_move(&game, move, WHITE_PLAYER == game.currentPlayer, 0);
+            journal_append_move(&journal, &game, move);
+            journaled++;
+        }
+        journal_close(&journal, 0);
+        chessboard_to_fen(fens + i * FEN_MAX_LENGTH, FEN_MAX_LENGTH, &game);
+    }
+    double write_seconds = elapsed(&begin);
+
+    Recovered recovered = { 0, 0, 0, fens };
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    long count = journal_recover_all(BENCH_JOURNAL_DIR, count_game, &recovered);
+    double seconds = elapsed(&begin);
+    fprintf(stdout, "journaled %ld moves of %ld games in %.3f s (%.0f moves/s)\n",
+            journaled, games, write_seconds, write_seconds > 0 ? journaled / write_seconds : 0.0);
+    fprintf(stdout, "recovered %ld games in %.3f s: %.0f games/s, %.0f moves replayed/s\n",
+            count, seconds, seconds > 0 ? count / seconds : 0.0, seconds > 0 ? recovered.moves / seconds : 0.0);
+    if (recovered.mismatched > 0)
+        fprintf(stderr, "%ld games were not rebuilt as journaled.\n", recovered.mismatched);
+    clear_journals();
+    free(fens);
+    return count == games && 0 == recovered.mismatched ? EXIT_SUCCESS : EXIT_FAILURE;
+}
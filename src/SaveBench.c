@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <time.h>
+#include "Resources.h"
+
+#define BENCH_DATABASE "play/bench_saves.txt"
+
+typedef struct {
+    DbWriter* writer;       // NULL to call save_game
+    int id;
+    int saves;
+    double* latencies;      // Microseconds, one per save
+    int failures;
+} Saver;
+
+static double now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * @brief One session: save its game after every move, waiting for each save to commit.
+ */
+static void* run_saver(void* arg) {
+    Saver* saver = arg;
+    ChessGame game;
+    ChessMove moves[MAX_GENERATED_MOVES];
+    char username[32];
+    sprintf(username, "session%d", saver->id);
+    initialize_game(&game);
+    unsigned int seed = (unsigned int) saver->id;
+    for (int i = 0; i < saver->saves; ++i) {
+        int count = generate_moves(&game, moves);
+        if (0 == count || game.moveCount >= 200)
+            initialize_game(&game);
+        else
+            make_move(&game, &moves[rand_r(&seed) % count], WHITE_PLAYER == game.currentPlayer, 0);
+        double begin = now_us();
+        int ret = saver->writer ? db_writer_save(saver->writer, &game, username) : save_game(&game, username, BENCH_DATABASE);
+        saver->latencies[i] = now_us() - begin;
+        saver->failures += 0 != ret;
+    }
+    return NULL;
+}
+
+/*
+ * @brief Check that the database holds exactly the expected records, each one whole.
+ */
+static int check_database(long expected) {
+    FILE* db = fopen(BENCH_DATABASE, "r");
+    if (!db)
+        return -1;
+    long count = 0, torn = 0;
+    char line[BUFFER_SIZE];
+    while (NULL != fgets(line, BUFFER_SIZE, db)) {
+        count++;
+        if (0 != strncmp(line, "session", 7) || NULL == strchr(line, ':') || '\n' != line[strlen(line) - 1])
+            torn++;
+    }
+    fclose(db);
+    return count == expected && 0 == torn ? 0 : -1;
+}
+
+/*
+ * @brief Run all sessions against one write path and report its throughput and latency.
+ */
+static int run_mode(const char* name, int policy, int sessions, int saves) {
+    remove(BENCH_DATABASE);
+    remove(BENCH_DATABASE ".idx");
+    DbWriter* writer = NULL;
+    if (policy >= 0 && NULL == (writer = db_writer_open(BENCH_DATABASE, policy, DEFAULT_FSYNC_INTERVAL_MS)))
+        return -1;
+
+    pthread_t threads[sessions];
+    Saver savers[sessions];
+    double* latencies = malloc(sizeof(double) * sessions * saves);
+    if (NULL == latencies)
+        return -1;
+    double begin = now_us();
+    for (int i = 0; i < sessions; ++i) {
+        savers[i] = (Saver) { .writer = writer, .id = i, .saves = saves, .latencies = latencies + (size_t) i * saves };
+        pthread_create(&threads[i], NULL, run_saver, &savers[i]);
+    }
+    int failures = 0;
+    for (int i = 0; i < sessions; ++i) {
+        pthread_join(threads[i], NULL);
+        failures += savers[i].failures;
+    }
+    double seconds = (now_us() - begin) / 1e6;
+
+    DbWriterStats stats = { 0 };
+    if (writer) {
+        db_writer_stats(writer, &stats);
+        db_writer_close(writer);
+    }
+    long total = (long) sessions * saves;
+    qsort(latencies, total, sizeof(double), compare_doubles);
+    fprintf(stdout, "%-16s %10.0f saves/s  p50 %9.1f us  p99 %9.1f us  saves/write %7.1f  syncs %6llu  %s\n",
+            name, total / seconds, latencies[total / 2], latencies[total * 99 / 100],
+            writer ? (double) stats.saves / stats.batches : 1.0, stats.syncs,
+            0 == failures && 0 == check_database(total) ? "ok" : "CORRUPT");
+    free(latencies);
+    return 0;
+}
+
+/*
+ * @brief Usage: savebench [sessions] [saves per session]
+ * @details Every session saves its game after each move and waits for the save to commit.
+ * Compare save_game, which opens and closes the database per save, with the group-commit
+ * writer under each fsync policy.
+ */
+int main(int argc, char* argv[]) {
+    int sessions = argc > 1 ? atoi(argv[1]) : 8;
+    int saves = argc > 2 ? atoi(argv[2]) : 2000;
+    if (sessions <= 0 || saves <= 0) {
+        fprintf(stderr, "Usage: %s [sessions] [saves per session]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    run_mode("save_game", -1, sessions, saves);
+    run_mode("writer none", FSYNC_NONE, sessions, saves);
+    run_mode("writer interval", FSYNC_INTERVAL, sessions, saves);
+    run_mode("writer batch", FSYNC_BATCH, sessions, saves);
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,43 @@
 #include "Resources.h"
 
-int main() {
+int main(int argc, char* argv[]) {
+    // --multi hosts many games, --binary uses framed binary messages instead of raw text,
+    // --fsync=none|batch|interval sets when saves made on a --multi server reach the disk,
+    // --journal=DIR sets where a --multi server journals its games, --no-journal turns it off,
+    // --diff shows the squares each move changes, --stats=FILE writes the command latencies to FILE as JSON on exit,
+    // --trace=FILE records the flow of commands to FILE, in a build with `make TRACE=1`
+    int multi = 0, diff = 0, flags = 1, fsync_policy = FSYNC_BATCH;
+    const char* journal_dir = "journal";
+    for (; flags < argc && 0 != strcmp(argv[flags], "--engine"); ++flags) {
+        if (0 == strcmp(argv[flags], "--multi"))
+            multi = 1;
+        else if (0 == strcmp(argv[flags], "--binary"))
+            set_wire_protocol(WIRE_BINARY);
+        else if (0 == strncmp(argv[flags], "--fsync=", 8) && (fsync_policy = parse_fsync_policy(argv[flags] + 8)) >= 0)
+            continue;
+        else if (0 == strncmp(argv[flags], "--journal=", 10) && '\0' != argv[flags][10])
+            journal_dir = argv[flags] + 10;
+        else if (0 == strcmp(argv[flags], "--no-journal"))
+            journal_dir = NULL;
+        else if (0 == strcmp(argv[flags], "--diff"))
+            diff = 1;
+        else if (0 == strncmp(argv[flags], "--stats=", 8) && '\0' != argv[flags][8])
+            stats_dump_on_exit(argv[flags] + 8);
+        else if (0 == strncmp(argv[flags], "--trace=", 8) && '\0' != argv[flags][8] && 0 == trace_start(argv[flags] + 8))
+            continue;
+        else
+            break;
+    }
+
+    EngineOptions options;
+    int engine = parse_engine_options(argc - flags + 1, argv + flags - 1, &options);
+    if (engine < 0 || fsync_policy < 0 || (multi && engine)) {
+        fprintf(stderr, "Usage: %s [--multi [--fsync=none|batch|interval] [--journal=DIR | --no-journal]] [--binary] [--diff] [--stats=FILE] [--trace=FILE] [--engine [depth=N] [movetime=ms] [threads=N] [hash=MB] [book=PATH] [tablebases=DIR]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (multi)
+        return run_multi_server(PORT, fsync_policy, journal_dir) ? EXIT_FAILURE : EXIT_SUCCESS;
+
     int listenfd, connfd;
     struct sockaddr_in address;
     int opt = 1;
@@ -51,13 +88,15 @@ int main() {
     display_chessboard(&game);
 
     char buffer[BUFFER_SIZE];
-    int client_command, server_command;
+    FrameDecoder decoder;
+    frame_decoder_init(&decoder);
+    int client_command = 0, server_command;
     while (1) {
         // Read from client
         while (1) {
-            memset(buffer, 0, BUFFER_SIZE);
-            if (read(connfd, buffer, BUFFER_SIZE) < 0) {
+            if (receive_message(connfd, &decoder, buffer) <= 0) {
                 fprintf(stdout, "[Server] Read error\n");
+                client_command = COMMAND_FORFEIT;
                 break;
             }
 
@@ -65,8 +104,13 @@ int main() {
             client_command = receive_command(&game, buffer, connfd, 1);
             if (COMMAND_NONE != client_command) {
                 fprintf(stdout, "[Client] Client enter: %s\n", buffer);
-                    if (COMMAND_FORFEIT == server_command)
-                        break;
+                if (COMMAND_MOVE == client_command) {
+                    if (diff)
+                        display_last_move(&game);
+                    display_status(&game);
+                }
+                if (COMMAND_FORFEIT == client_command)
+                    break;
                 if (COMMAND_LOAD == client_command && game.currentPlayer == WHITE_PLAYER) {
                     fprintf(stdout, "[Client] Current player is client. Switch control to client.\n");
                     send_command(&game, "/none", connfd, 0);
@@ -79,13 +123,21 @@ int main() {
             }
         }
 
+        if (COMMAND_FORFEIT == client_command)
+            break;
+
         // Server enter
         while (1) {
-            fprintf(stdout, "[Server] Enter message: ");
-            memset(buffer, 0, BUFFER_SIZE);
-            fgets(buffer, BUFFER_SIZE, stdin);
-            buffer[strlen(buffer)-1] = '\0';
-            fprintf(stdout, "\n");
+            if (engine) {
+                engine_command(&game, &options, buffer);
+                fprintf(stdout, "[Server] Engine plays: %s\n", buffer);
+            } else {
+                fprintf(stdout, "[Server] Enter message: ");
+                memset(buffer, 0, BUFFER_SIZE);
+                fgets(buffer, BUFFER_SIZE, stdin);
+                buffer[strlen(buffer)-1] = '\0';
+                fprintf(stdout, "\n");
+            }
 
             // Send command
             server_command = send_command(&game, buffer, connfd, 0);
@@ -96,6 +148,11 @@ int main() {
                 close(connfd);
                 return 0;
             } else if (COMMAND_DISPLAY != server_command  && COMMAND_SAVE != server_command) {
+                if (COMMAND_MOVE == server_command) {
+                    if (diff)
+                        display_last_move(&game);
+                    display_status(&game);
+                }
                 break;
             }
         }
@@ -0,0 +1,53 @@
+#include "Resources.h"
+
+/*
+ * @brief Fixed positions searched by the benchmark: opening, middlegames and an endgame.
+ */
+static const char* bench_positions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w",
+    "r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w",
+    "r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP3PPP/R2QKB1R w",
+    "r2q1rk1/1b2bppp/p2ppn2/1p6/3NP3/1BN1B3/PPP2PPP/R2Q1RK1 w",
+    "2r2rk1/pp1bqppp/2n1pn2/3p4/3P4/2PBPN2/P1Q2PPP/R4RK1 b",
+    "8/5pk1/6p1/3R4/5P2/6PK/r7/8 w",
+};
+
+/*
+ * @brief Usage: smpbench [max threads] [depth] [hash MB]
+ * @details Search every benchmark position to a fixed depth with 1, 2, ... up to max threads,
+ * clearing the transposition table before each position, and report the time to depth,
+ * nodes per second and speedup over one thread.
+ */
+int main(int argc, char* argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+    int depth = argc > 2 ? atoi(argv[2]) : 7;
+    int hash = argc > 3 ? atoi(argv[3]) : DEFAULT_HASH_MB;
+    if (max_threads <= 0 || depth <= 0 || hash <= 0) {
+        fprintf(stderr, "Usage: %s [max threads] [depth] [hash MB]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int positions = sizeof(bench_positions) / sizeof(bench_positions[0]);
+    double base_seconds = 0;
+    tt_resize(hash);
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        EngineOptions options = { .depth = depth, .movetime = 0, .threads = threads, .hash = hash };
+        unsigned long long nodes = 0;
+        double seconds = 0;
+        for (int i = 0; i < positions; ++i) {
+            ChessGame game;
+            SearchResult result;
+            fen_to_chessboard(bench_positions[i], &game);
+            tt_clear();
+            engine_search(&game, &options, &result);
+            nodes += result.nodes;
+            seconds += result.seconds;
+        }
+        if (1 == threads)
+            base_seconds = seconds;
+        fprintf(stdout, "threads %2d  time %8.3f s  nodes %12llu  %10.0f nodes/s  speedup %.2fx\n",
+                threads, seconds, nodes, seconds > 0 ? nodes / seconds : 0.0,
+                seconds > 0 ? base_seconds / seconds : 0.0);
+    }
+    return EXIT_SUCCESS;
+}
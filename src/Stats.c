@@ -0,0 +1,351 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "Resources.h"
+
+/*
+ * Counters and latency histograms of the command paths. Each thread records into its own
+ * StatsBlock, allocated on its first event, so recording takes no lock and shares no cache line:
+ * two clock reads, a bucket index and three relaxed stores. The blocks of every thread are
+ * merged when the statistics are read.
+ *
+ * Histograms are log-linear like HDR histograms: values below STATS_SUB_BUCKETS clock ticks have
+ * a bucket each, then every power of two is split into STATS_SUB_BUCKETS buckets, so a bucket
+ * is within 1/STATS_SUB_BUCKETS of its values.
+ */
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 48                                               // Longer times count as 2^48 ticks
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+#define STATS_CALIBRATION_NS 10000000
+
+typedef struct StatsBlock {
+    uint64_t counts[STAT_EVENTS];
+    uint64_t sums[STAT_EVENTS];                     // Clock ticks
+    uint64_t maxima[STAT_EVENTS];
+    uint64_t buckets[STAT_EVENTS][STATS_BUCKETS];
+    struct StatsBlock* next;
+} StatsBlock;
+
+static const char* const stat_names[STAT_EVENTS] = {
+    "parse_command", "make_move", "is_valid_move", "save_game", "load_game",
+    "send_move", "send_forfeit", "send_chessboard", "send_import", "send_load", "send_save", "send_none",
+    "receive_move", "receive_forfeit", "receive_import", "receive_load", "receive_none",
+};
+
+static __thread StatsBlock* thread_block;
+static StatsBlock* all_blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char* dump_path;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t dump_signal;   // Signal that asked for the dump, 0 if none yet
+static int signal_pipe[2] = { -1, -1 };     // Wakes the dumping thread from the signal handler
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * @brief Read the clock used to time events: the time stamp counter on x86, nanoseconds elsewhere.
+ */
+uint64_t stats_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+/**
+ * @brief Clock ticks of stats_clock per nanosecond, measured once against CLOCK_MONOTONIC.
+ */
+double stats_ticks_per_ns(void) {
+    static double ratio;
+    if (0.0 == ratio) {
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t begin_ns = monotonic_ns(), begin = stats_clock(), end_ns;
+        while ((end_ns = monotonic_ns()) - begin_ns < STATS_CALIBRATION_NS)
+            ;
+        ratio = (double) (stats_clock() - begin) / (double) (end_ns - begin_ns);
+#else
+        ratio = 1.0;
+#endif
+    }
+    return ratio;
+}
+
+static int bucket_of(uint64_t ticks) {
+    if (ticks < STATS_SUB_BUCKETS)
+        return (int) ticks;
+    int shift = 63 - __builtin_clzll(ticks) - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS + (int) ((ticks >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+/*
+ * @brief Smallest number of ticks counted in a bucket.
+ */
+static uint64_t bucket_floor(int bucket) {
+    if (bucket < 2 * STATS_SUB_BUCKETS)
+        return (uint64_t) bucket;
+    int shift = bucket / STATS_SUB_BUCKETS - 1;
+    return (uint64_t) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << shift;
+}
+
+/*
+ * @brief The block of the calling thread, created and registered on its first event.
+ */
+static StatsBlock* own_block(void) {
+    StatsBlock* block = calloc(1, sizeof(StatsBlock));
+    if (NULL == block)
+        return NULL;
+    pthread_mutex_lock(&blocks_lock);
+    block->next = all_blocks;
+    all_blocks = block;
+    pthread_mutex_unlock(&blocks_lock);
+    thread_block = block;
+    return block;
+}
+
+static void add_relaxed(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count an event of STAT_* and its time from start, a stats_clock reading, to now.
+ * @details Only the calling thread writes its counters, so plain relaxed stores suffice.
+ */
+void stats_record(int event, uint64_t start) {
+    uint64_t ticks = stats_clock() - start;
+    StatsBlock* block = thread_block;
+    if (NULL == block && NULL == (block = own_block()))
+        return;
+    if (ticks >> STATS_MAX_BITS)
+        ticks = (1ULL << STATS_MAX_BITS) - 1;
+    add_relaxed(&block->counts[event], 1);
+    add_relaxed(&block->sums[event], ticks);
+    add_relaxed(&block->buckets[event][bucket_of(ticks)], 1);
+    if (ticks > __atomic_load_n(&block->maxima[event], __ATOMIC_RELAXED))
+        __atomic_store_n(&block->maxima[event], ticks, __ATOMIC_RELAXED);
+}
+
+/*
+ * @brief Sum the blocks of every thread into one.
+ */
+static void merge_blocks(StatsBlock* total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&blocks_lock);
+    for (const StatsBlock* block = all_blocks; block; block = block->next) {
+        for (int event = 0; event < STAT_EVENTS; ++event) {
+            total->counts[event] += __atomic_load_n(&block->counts[event], __ATOMIC_RELAXED);
+            total->sums[event] += __atomic_load_n(&block->sums[event], __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&block->maxima[event], __ATOMIC_RELAXED);
+            total->maxima[event] = max > total->maxima[event] ? max : total->maxima[event];
+            for (int i = 0; i < STATS_BUCKETS; ++i)
+                total->buckets[event][i] += __atomic_load_n(&block->buckets[event][i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+/*
+ * @brief Value in ticks below which a fraction of the events of a merged histogram fall.
+ * @details The top of the bucket is returned, but never more than the largest value seen.
+ */
+static uint64_t quantile(const StatsBlock* total, int event, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * total->counts[event]), seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+        seen += total->buckets[event][i];
+        if (seen > rank) {
+            uint64_t top = bucket_floor(i + 1) - 1;
+            return top < total->maxima[event] ? top : total->maxima[event];
+        }
+    }
+    return total->maxima[event];
+}
+
+/*
+ * @brief Append formatted text, counting what did not fit, like snprintf.
+ */
+static void append(char* out, size_t size, size_t* length, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(*length < size ? out + *length : NULL, *length < size ? size - *length : 0, format, args);
+    va_end(args);
+    if (n > 0)
+        *length += (size_t) n;
+}
+
+/*
+ * @brief Append the reuse of every object pool of the process, if it has any.
+ * @details Closes the events object of the JSON, and opens and closes the pools object after it.
+ */
+static void append_pools(char* out, size_t size, size_t* length, int json) {
+    PoolStats pools[POOL_MAX];
+    int count = pool_list(pools);
+    if (json)
+        append(out, size, length, "\n}, \"pools\": {");
+    else if (count > 0)
+        append(out, size, length, "\n%-16s %10s %9s %9s %9s %9s %9s %9s\n",
+               "pool", "allocs", "frees", "in use", "reused", "created", "slabs", "kB");
+    for (int i = 0; i < count; ++i) {
+        const PoolStats* pool = &pools[i];
+        unsigned long long reused = pool->allocations > pool->created ? pool->allocations - pool->created : 0;
+        if (json)
+            append(out, size, length, "%s\n  \"%s\": {\"objectSize\": %llu, \"allocations\": %llu, \"frees\": %llu, "
+                   "\"reused\": %llu, \"created\": %llu, \"slabs\": %llu, \"bytes\": %llu}", 0 == i ? "" : ",",
+                   pool->name, pool->objectSize, pool->allocations, pool->frees, reused, pool->created,
+                   pool->slabs, pool->bytes);
+        else
+            append(out, size, length, "%-16s %10llu %9llu %9llu %9llu %9llu %9llu %9llu\n", pool->name,
+                   pool->allocations, pool->frees, pool->allocations - pool->frees, reused, pool->created,
+                   pool->slabs, pool->bytes / 1024);
+    }
+    if (json)
+        append(out, size, length, "\n}");
+}
+
+/**
+ * @brief Format the merged statistics of every thread, as a table or as JSON.
+ * @details Times are in nanoseconds. Events that never happened are left out of the table;
+ * the JSON lists every event, with its count, mean, quantiles, maximum and non-empty buckets.
+ * The reuse of the object pools of the process follows the events.
+ *
+ * @return Length of the whole text, which was cut to fit size if it is not smaller, like snprintf.
+ */
+size_t stats_format(char* out, size_t size, int json) {
+    StatsBlock* total = malloc(sizeof(StatsBlock));
+    size_t length = 0;
+    if (size > 0)
+        out[0] = '\0';
+    if (NULL == total)
+        return 0;
+    merge_blocks(total);
+    double ratio = stats_ticks_per_ns();
+    static const double fractions[4] = { 0.5, 0.9, 0.99, 0.999 };
+    if (json)
+        append(out, size, &length, "{\"unit\": \"ns\", \"events\": {");
+    else
+        append(out, size, &length, "%-16s %10s %9s %9s %9s %9s %9s %9s (ns)\n",
+               "event", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int event = 0; event < STAT_EVENTS; ++event) {
+        uint64_t count = total->counts[event];
+        double mean = count > 0 ? total->sums[event] / ratio / count : 0.0;
+        double values[4];
+        for (int i = 0; i < 4; ++i)
+            values[i] = quantile(total, event, fractions[i]) / ratio;
+        double max = total->maxima[event] / ratio;
+        if (!json) {
+            if (count > 0)
+                append(out, size, &length, "%-16s %10llu %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n", stat_names[event],
+                       (unsigned long long) count, mean, values[0], values[1], values[2], values[3], max);
+            continue;
+        }
+        append(out, size, &length, "%s\n  \"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %.0f, \"p90\": %.0f, "
+               "\"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f, \"buckets\": [", 0 == event ? "" : ",", stat_names[event],
+               (unsigned long long) count, mean, values[0], values[1], values[2], values[3], max);
+        int first = 1;
+        for (int i = 0; i < STATS_BUCKETS; ++i) {
+            if (0 == total->buckets[event][i])
+                continue;
+            append(out, size, &length, "%s[%.0f, %llu]", first ? "" : ", ", bucket_floor(i) / ratio,
+                   (unsigned long long) total->buckets[event][i]);
+            first = 0;
+        }
+        append(out, size, &length, "]}");
+    }
+    free(total);
+    append_pools(out, size, &length, json);
+    if (json)
+        append(out, size, &length, "\n}\n");
+    return length;
+}
+
+/*
+ * @brief Write the statistics as JSON to the file given to stats_dump_on_exit, once.
+ * @details Runs at exit or on the dumping thread, never in a signal handler: formatting takes
+ * locks and allocates. Whichever comes second waits for the first to finish the file.
+ */
+static void write_dump(void) {
+    pthread_mutex_lock(&dump_lock);
+    const char* path = dump_path;
+    dump_path = NULL;
+    if (NULL == path) {
+        pthread_mutex_unlock(&dump_lock);
+        return;
+    }
+    size_t length = stats_format(NULL, 0, 1);
+    char* text = malloc(length + 1);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (NULL != text && fd >= 0) {
+        stats_format(text, length + 1, 1);
+        if (write(fd, text, length) != (ssize_t) length) {
+            INFO("Failed to write the statistics to %s", path);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    free(text);
+    pthread_mutex_unlock(&dump_lock);
+}
+
+/*
+ * @brief Note the signal and wake the dumping thread; only async-signal-safe calls are made here.
+ */
+static void dump_on_signal(int signal_number) {
+    int saved = errno;
+    dump_signal = signal_number;
+    if (write(signal_pipe[1], "", 1) < 0) {
+        // Pipe full: the thread is already awake
+    }
+    errno = saved;
+}
+
+/*
+ * @brief Thread: wait for SIGINT or SIGTERM, dump the statistics, then end as the signal would have.
+ */
+static void* dump_on_wakeup(void* arg) {
+    (void) arg;
+    char byte;
+    while (read(signal_pipe[0], &byte, 1) < 0 && EINTR == errno)
+        ;
+    write_dump();
+    signal(dump_signal, SIG_DFL);
+    raise(dump_signal);
+    return NULL;
+}
+
+/**
+ * @brief Write the statistics as JSON to a file when the process exits, or is ended by SIGINT or SIGTERM.
+ * @details The dump is written by a thread the signal handler wakes. A program that installs its
+ * own handlers afterwards, to stop cleanly, still gets the dump when it exits.
+ */
+void stats_dump_on_exit(const char* path) {
+    dump_path = path;
+    atexit(write_dump);
+    pthread_t thread;
+    if (signal_pipe[0] >= 0 || 0 != pipe(signal_pipe))
+        return;
+    if (0 != pthread_create(&thread, NULL, dump_on_wakeup, NULL)) {
+        close(signal_pipe[0]);
+        close(signal_pipe[1]);
+        signal_pipe[0] = signal_pipe[1] = -1;
+        return;
+    }
+    pthread_detach(thread);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_on_signal;
+    action.sa_flags = SA_RESTART;   // As signal() did, blocking calls carry on
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
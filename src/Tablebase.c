@@ -0,0 +1,557 @@
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Resources.h"
+
+/*
+ * Endgame tablebases of a king and one piece against a lone king: KQK, KRK, KBK, KNK and KPK.
+ * A table has one byte per position of the strong side as white, indexed by the side to move and
+ * the squares of the white king, black king and piece:
+ *   TB_DRAW     draw
+ *   1 + n       the side to move wins (n odd) or loses (n even) with best play, in n plies,
+ *               mate included; 1 is checkmated
+ *   TB_INVALID  not a legal position
+ * Positions are reduced by symmetry first: the white king is brought to files a-d, and without a
+ * pawn to the a1-d1-d4 triangle. A position where black has the piece is probed with the board
+ * mirrored and the colors swapped. Tables follow the rules of chess: a move may not leave its own
+ * king attacked, checkmate is a loss and stalemate a draw.
+ *
+ * Tables are built by retrograde analysis: positions mated or stalemated are found first, then
+ * pass n finds the positions won in n plies (a move to a position lost in n - 1) or lost in n plies
+ * (every move goes to a position won in less than n). Each pass only reads values of earlier
+ * passes, so the positions of a pass are split between threads without locking. Positions left
+ * when the passes stop finding any are draws. Promotions lead into the tables of the new piece.
+ *
+ * A file is a TablebaseHeader followed by the table, "<dir>/<ending>.tb".
+ */
+
+#define TB_DRAW 0
+#define TB_UNKNOWN 254   // Only while building
+#define TB_INVALID 255
+#define TB_MAX_PLIES 252
+
+#define TB_MAGIC "CHESSTBL"
+#define TB_VERSION 1
+#define TB_HEADER_SIZE 16
+#define TB_MAX_THREADS 64
+
+typedef struct {
+    char magic[8];                // TB_MAGIC
+    uint32_t version;             // TB_VERSION
+    uint32_t size;                // Bytes of the table after the header
+} TablebaseHeader;
+
+typedef struct {
+    const char* name;
+    char piece;                   // Piece of the strong side, uppercase
+    const uint8_t* values;        // Mapped from its file or built, NULL if not available
+    void* map;
+    size_t mapSize;
+    uint8_t* built;               // Table built by this process
+} Ending;
+
+static Ending endings[TABLEBASE_ENDINGS] = {
+    { "KQK", 'Q' }, { "KRK", 'R' }, { "KBK", 'B' }, { "KNK", 'N' }, { "KPK", 'P' }
+};
+
+static int king_slots[64];        // Slot of each square of the white king without a pawn, -1 off the triangle
+static int pawn_king_slots[64];   // Slot of each square of the white king with a pawn, -1 on files e-h
+static int king_squares[10];
+static int pawn_king_squares[32];
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    const Ending* ending;
+    uint8_t* values;
+    long begin;                   // Range of indexes of this thread
+    long end;
+    int plies;                    // Pass: positions decided in this many plies
+    long changed;
+} Pass;
+
+static void init_slots(void) {
+    int slots = 0, pawn_slots = 0;
+    for (int square = 0; square < 64; ++square) {
+        int file = square & 7, rank = 7 - (square >> 3);
+        king_slots[square] = pawn_king_slots[square] = -1;
+        if (file <= 3 && rank <= file) {
+            king_squares[slots] = square;
+            king_slots[square] = slots++;
+        }
+        if (file <= 3) {
+            pawn_king_squares[pawn_slots] = square;
+            pawn_king_slots[square] = pawn_slots++;
+        }
+    }
+}
+
+static long table_size(char piece) {
+    return 2L * ('P' == piece ? 32 : 10) * 64 * 64;
+}
+
+/*
+ * @brief Index of a position in a table, after reducing it by symmetry.
+ */
+static long table_index(char piece, int side, int wk, int bk, int ps) {
+    if ((wk & 7) > 3) {   // Mirror files
+        wk ^= 7;
+        bk ^= 7;
+        ps ^= 7;
+    }
+    if ('P' == piece)
+        return (((long) side * 32 + pawn_king_slots[wk]) * 64 + bk) * 64 + ps;
+    if ((wk >> 3) < 4) {   // Mirror ranks
+        wk ^= 56;
+        bk ^= 56;
+        ps ^= 56;
+    }
+    if (7 - (wk >> 3) > (wk & 7)) {   // Mirror along the a1-h8 diagonal
+        wk = ((7 - (wk & 7)) << 3) | (7 - (wk >> 3));
+        bk = ((7 - (bk & 7)) << 3) | (7 - (bk >> 3));
+        ps = ((7 - (ps & 7)) << 3) | (7 - (ps >> 3));
+    }
+    return (((long) side * 10 + king_slots[wk]) * 64 + bk) * 64 + ps;
+}
+
+static Bitboard piece_attacks(char piece, int square, Bitboard occupied) {
+    switch (piece) {
+        case 'Q': return rook_attacks(square, occupied) | bishop_attacks(square, occupied);
+        case 'R': return rook_attacks(square, occupied);
+        case 'B': return bishop_attacks(square, occupied);
+        case 'N': return knight_attacks(square);
+        default:  // White pawn
+            if (square < 8)
+                return 0;
+            return ((square & 7) > 0 ? SQUARE_BIT(square - 9) : 0) | ((square & 7) < 7 ? SQUARE_BIT(square - 7) : 0);
+    }
+}
+
+/*
+ * @brief Whether a position can occur: no two pieces on a square, no pawn on a back rank,
+ * and the player who just moved has not left its king attacked.
+ */
+static int position_valid(char piece, int side, int wk, int bk, int ps) {
+    if (wk == bk || wk == ps || bk == ps || (king_attacks(wk) & SQUARE_BIT(bk)))
+        return 0;
+    if ('P' == piece && ((ps >> 3) == 0 || (ps >> 3) == 7))
+        return 0;
+    Bitboard occupied = SQUARE_BIT(wk) | SQUARE_BIT(bk) | SQUARE_BIT(ps);
+    return BLACK_PLAYER == side || 0 == (piece_attacks(piece, ps, occupied) & SQUARE_BIT(bk));
+}
+
+static const Ending* find_ending(char piece) {
+    for (int i = 0; i < TABLEBASE_ENDINGS; ++i) {
+        if (endings[i].piece == piece)
+            return &endings[i];
+    }
+    return NULL;
+}
+
+/*
+ * @brief Value of each position reached by a legal move, from the point of view of the player to
+ * move there, passed to visit until it returns non-zero.
+ *
+ * @return Number of legal moves visited, or -1 if visit stopped.
+ */
+static int visit_moves(const Ending* ending, const uint8_t* values, int side, int wk, int bk, int ps,
+                        int (*visit)(uint8_t value, void* context), void* context) {
+    char piece = ending->piece;
+    Bitboard occupied = SQUARE_BIT(wk) | SQUARE_BIT(bk) | SQUARE_BIT(ps);
+    int count = 0;
+    if (BLACK_PLAYER == side) {
+        for (Bitboard targets = king_attacks(bk) & ~SQUARE_BIT(wk); targets; targets &= targets - 1) {
+            int to = LSB(targets);
+            uint8_t value;
+            if (to == ps) {   // Capture, a draw with the kings alone
+                if (king_attacks(wk) & SQUARE_BIT(to))
+                    continue;
+                value = TB_DRAW;
+            } else {
+                if (!position_valid(piece, WHITE_PLAYER, wk, to, ps))
+                    continue;
+                value = __atomic_load_n(&values[table_index(piece, WHITE_PLAYER, wk, to, ps)], __ATOMIC_RELAXED);
+            }
+            count++;
+            if (visit(value, context))
+                return -1;
+        }
+        return count;
+    }
+
+    for (Bitboard targets = king_attacks(wk) & ~occupied; targets; targets &= targets - 1) {
+        int to = LSB(targets);
+        if (!position_valid(piece, BLACK_PLAYER, to, bk, ps))
+            continue;
+        count++;
+        if (visit(__atomic_load_n(&values[table_index(piece, BLACK_PLAYER, to, bk, ps)], __ATOMIC_RELAXED), context))
+            return -1;
+    }
+    Bitboard targets;
+    if ('P' == piece) {
+        targets = (ps >= 8 && !(occupied & SQUARE_BIT(ps - 8))) ? SQUARE_BIT(ps - 8) : 0;
+        if (6 == (ps >> 3) && targets && !(occupied & SQUARE_BIT(ps - 16)))
+            targets |= SQUARE_BIT(ps - 16);
+    } else {
+        targets = piece_attacks(piece, ps, occupied) & ~occupied;
+    }
+    for (; targets; targets &= targets - 1) {
+        int to = LSB(targets);
+        if ('P' == piece && to < 8) {   // Promotion, into the table of each new piece
+            static const char promotions[4] = { 'Q', 'R', 'B', 'N' };
+            for (int i = 0; i < 4; ++i) {
+                const Ending* next = find_ending(promotions[i]);
+                count++;
+                if (visit(next->values[table_index(next->piece, BLACK_PLAYER, wk, bk, to)], context))
+                    return -1;
+            }
+        } else if (position_valid(piece, BLACK_PLAYER, wk, bk, to)) {
+            count++;
+            if (visit(__atomic_load_n(&values[table_index(piece, BLACK_PLAYER, wk, bk, to)], __ATOMIC_RELAXED), context))
+                return -1;
+        }
+    }
+    return count;
+}
+
+static void decode_index(char piece, long index, int* side, int* wk, int* bk, int* ps) {
+    int kings = 'P' == piece ? 32 : 10;
+    *ps = index % 64;
+    *bk = (index / 64) % 64;
+    int slot = (index / 4096) % kings;
+    *wk = 'P' == piece ? pawn_king_squares[slot] : king_squares[slot];
+    *side = (int) (index / (4096L * kings));
+}
+
+static int count_move(uint8_t value, void* context) {
+    (void) value;
+    (void) context;
+    return 0;
+}
+
+static int is_loss(uint8_t value, void* context) {
+    return *(uint8_t*) context == value;
+}
+
+static int not_win(uint8_t value, void* context) {
+    int plies = value - 1;
+    return TB_DRAW == value || TB_UNKNOWN == value || TB_INVALID == value
+            || 0 == (plies & 1) || plies > *(int*) context;
+}
+
+/*
+ * @brief Thread: mark invalid, checkmated and stalemated positions of a range.
+ */
+static void* initial_pass(void* arg) {
+    Pass* pass = arg;
+    char piece = pass->ending->piece;
+    for (long index = pass->begin; index < pass->end; ++index) {
+        int side, wk, bk, ps;
+        decode_index(piece, index, &side, &wk, &bk, &ps);
+        uint8_t value = TB_UNKNOWN;
+        if (!position_valid(piece, side, wk, bk, ps)) {
+            value = TB_INVALID;
+        } else if (0 == visit_moves(pass->ending, pass->values, side, wk, bk, ps, count_move, NULL)) {
+            Bitboard occupied = SQUARE_BIT(wk) | SQUARE_BIT(bk) | SQUARE_BIT(ps);
+            int check = BLACK_PLAYER == side && (piece_attacks(piece, ps, occupied) & SQUARE_BIT(bk));
+            value = check ? 1 : TB_DRAW;
+        }
+        __atomic_store_n(&pass->values[index], value, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * @brief Thread: decide the positions of a range won or lost in pass->plies plies.
+ */
+static void* retrograde_pass(void* arg) {
+    Pass* pass = arg;
+    char piece = pass->ending->piece;
+    uint8_t loss = (uint8_t) pass->plies;   // Value of a position lost in plies - 1
+    int shorter = pass->plies - 1;
+    for (long index = pass->begin; index < pass->end; ++index) {
+        if (TB_UNKNOWN != __atomic_load_n(&pass->values[index], __ATOMIC_RELAXED))
+            continue;
+        int side, wk, bk, ps;
+        decode_index(piece, index, &side, &wk, &bk, &ps);
+        int decided = pass->plies & 1
+                ? visit_moves(pass->ending, pass->values, side, wk, bk, ps, is_loss, &loss) < 0
+                : visit_moves(pass->ending, pass->values, side, wk, bk, ps, not_win, &shorter) > 0;
+        if (decided) {
+            __atomic_store_n(&pass->values[index], (uint8_t) (pass->plies + 1), __ATOMIC_RELAXED);
+            pass->changed++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * @brief Run a pass over a table on several threads.
+ *
+ * @return Number of positions decided.
+ */
+static long run_pass(const Ending* ending, uint8_t* values, int plies, int threads, void* (*routine)(void*)) {
+    Pass passes[TB_MAX_THREADS];
+    pthread_t workers[TB_MAX_THREADS];
+    int started[TB_MAX_THREADS];
+    long size = table_size(ending->piece), changed = 0;
+    for (int i = 0; i < threads; ++i) {
+        passes[i] = (Pass) { ending, values, size * i / threads, size * (i + 1) / threads, plies, 0 };
+        started[i] = 0 == pthread_create(&workers[i], NULL, routine, &passes[i]);
+        if (!started[i])
+            routine(&passes[i]);
+    }
+    for (int i = 0; i < threads; ++i) {
+        if (started[i])
+            pthread_join(workers[i], NULL);
+        changed += passes[i].changed;
+    }
+    return changed;
+}
+
+/*
+ * @brief Write a table to "<dir>/<ending>.tb", through a temporary file renamed over it.
+ *
+ * @return Bytes written, -1 on failure.
+ */
+static long write_table(const Ending* ending, const char* dir) {
+    char path[BUFFER_SIZE], temp[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "%s/%s.tb", dir, ending->name);
+    snprintf(temp, sizeof(temp), "%s/%s.tb.tmp", dir, ending->name);
+    long size = table_size(ending->piece);
+    TablebaseHeader header;
+    memcpy(header.magic, TB_MAGIC, sizeof(header.magic));
+    header.version = htole32(TB_VERSION);
+    header.size = htole32((uint32_t) size);
+    FILE* out = fopen(temp, "w");
+    int ok = NULL != out && 1 == fwrite(&header, sizeof(header), 1, out) && 1 == fwrite(ending->values, size, 1, out);
+    if (NULL != out && 0 != fclose(out))
+        ok = 0;
+    if (!ok || 0 != rename(temp, path)) {
+        unlink(temp);
+        return -1;
+    }
+    return TB_HEADER_SIZE + size;
+}
+
+/*
+ * @brief Map the table of an ending from "<dir>/<ending>.tb".
+ *
+ * @return 0 on success, -1 if it cannot be read or is not a table of this version.
+ */
+static int map_table(Ending* ending, const char* dir) {
+    char path[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "%s/%s.tb", dir, ending->name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    long size = table_size(ending->piece);
+    void* map = MAP_FAILED;
+    if (0 == fstat(fd, &st) && TB_HEADER_SIZE + size == st.st_size)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+        return -1;
+    const TablebaseHeader* header = map;
+    if (0 != memcmp(header->magic, TB_MAGIC, sizeof(header->magic)) || TB_VERSION != le32toh(header->version)
+            || size != le32toh(header->size)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    ending->map = map;
+    ending->mapSize = st.st_size;
+    ending->values = (const uint8_t*) map + TB_HEADER_SIZE;
+    return 0;
+}
+
+static void release_table(Ending* ending) {
+    if (ending->map)
+        munmap(ending->map, ending->mapSize);
+    free(ending->built);
+    ending->map = NULL;
+    ending->built = NULL;
+    ending->values = NULL;
+}
+
+static Ending* ending_named(const char* name) {
+    for (int i = 0; i < TABLEBASE_ENDINGS; ++i) {
+        if (0 == strcasecmp(endings[i].name, name))
+            return &endings[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Build the table of an ending by retrograde analysis and write it to "<dir>/<ending>.tb".
+ * @details KPK needs the tables of the promoted pieces; those missing from dir are built first.
+ *
+ * @param name "KQK", "KRK", "KBK", "KNK" or "KPK".
+ * @param stats Receives the counts of the table, may be NULL.
+ * @return 0 on success, -1 for an unknown ending or if a table cannot be written.
+ */
+int generate_tablebase(const char* name, const char* dir, int threads, TablebaseStats* stats) {
+    pthread_once(&slots_once, init_slots);
+    Ending* ending = ending_named(name);
+    if (NULL == ending)
+        return -1;
+    threads = threads < 1 ? 1 : (threads > TB_MAX_THREADS ? TB_MAX_THREADS : threads);
+    int max_exit = 0;   // Longest distance to mate reached by promoting
+    if ('P' == ending->piece) {
+        for (int i = 0; i < TABLEBASE_ENDINGS; ++i) {
+            if ('P' == endings[i].piece || (NULL == endings[i].values && 0 != map_table(&endings[i], dir)
+                    && 0 != generate_tablebase(endings[i].name, dir, threads, NULL)))
+                continue;
+            for (long j = 0; j < table_size(endings[i].piece) && endings[i].values; ++j) {
+                if (endings[i].values[j] < TB_UNKNOWN && endings[i].values[j] > max_exit)
+                    max_exit = endings[i].values[j];
+            }
+        }
+        if (NULL == endings[0].values || NULL == endings[1].values || NULL == endings[2].values || NULL == endings[3].values)
+            return -1;
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    long size = table_size(ending->piece);
+    uint8_t* values = malloc(size);
+    if (NULL == values)
+        return -1;
+    run_pass(ending, values, 0, threads, initial_pass);
+    int plies = 1, idle = 0;
+    for (; plies <= TB_MAX_PLIES && (idle < 2 || plies <= max_exit + 1); ++plies)
+        idle = 0 == run_pass(ending, values, plies, threads, retrograde_pass) ? idle + 1 : 0;
+    for (long i = 0; i < size; ++i) {
+        if (TB_UNKNOWN == values[i])
+            values[i] = TB_DRAW;
+    }
+    release_table(ending);
+    ending->built = values;
+    ending->values = values;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long bytes = write_table(ending, dir);
+    if (bytes < 0)
+        return -1;
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->bytes = bytes;
+        stats->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        for (long i = 0; i < size; ++i) {
+            if (TB_INVALID == values[i])
+                continue;
+            stats->positions++;
+            if (TB_DRAW == values[i]) {
+                stats->draws++;
+            } else if ((values[i] - 1) & 1) {
+                stats->wins++;
+                if (values[i] - 1 > stats->maxPlies)
+                    stats->maxPlies = values[i] - 1;
+            } else {
+                stats->losses++;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Map the tables found in a directory, replacing any mapped or built before.
+ *
+ * @return Number of endings available.
+ */
+int tablebase_open(const char* dir) {
+    pthread_once(&slots_once, init_slots);
+    int count = 0;
+    for (int i = 0; i < TABLEBASE_ENDINGS; ++i) {
+        release_table(&endings[i]);
+        count += 0 == map_table(&endings[i], dir);
+    }
+    return count;
+}
+
+/**
+ * @brief Unmap every table.
+ */
+void tablebase_close(void) {
+    for (int i = 0; i < TABLEBASE_ENDINGS; ++i)
+        release_table(&endings[i]);
+}
+
+/**
+ * @brief Result of a position with a king and at most one other piece, for the player to move.
+ *
+ * @param plies Receives the number of plies to mate with best play, for a win or a loss.
+ * @return TABLEBASE_WIN, TABLEBASE_DRAW or TABLEBASE_LOSS; TABLEBASE_UNKNOWN if the ending has
+ * no table, or the position is not legal.
+ */
+int tablebase_probe(const ChessGame* game, int* plies) {
+    *plies = 0;
+    if (__builtin_popcountll(game->occupiedBB) > 3 || 1 != __builtin_popcountll(game->pieceBB[5])
+            || 1 != __builtin_popcountll(game->pieceBB[11]))
+        return TABLEBASE_UNKNOWN;
+    if (2 == __builtin_popcountll(game->occupiedBB))
+        return TABLEBASE_DRAW;
+    Bitboard others = game->occupiedBB & ~(game->pieceBB[5] | game->pieceBB[11]);
+    int ps = LSB(others), strong = game->colorBB[WHITE_PLAYER] & others ? WHITE_PLAYER : BLACK_PLAYER;
+    char piece = toupper(game->chessboard[ps >> 3][ps & 7]);
+    int wk = LSB(game->pieceBB[5]), bk = LSB(game->pieceBB[11]), side = game->currentPlayer;
+    if (BLACK_PLAYER == strong) {   // Mirror the board so the piece is white's
+        int king = wk;
+        wk = bk ^ 56;
+        bk = king ^ 56;
+        ps ^= 56;
+        side = !side;
+    }
+    const Ending* ending = find_ending(piece);
+    if (NULL == ending || NULL == ending->values)
+        return TABLEBASE_UNKNOWN;
+    uint8_t value = ending->values[table_index(piece, side, wk, bk, ps)];
+    if (TB_INVALID == value || TB_UNKNOWN == value)
+        return TABLEBASE_UNKNOWN;
+    if (TB_DRAW == value)
+        return TABLEBASE_DRAW;
+    *plies = value - 1;
+    return (*plies & 1) ? TABLEBASE_WIN : TABLEBASE_LOSS;
+}
+
+/**
+ * @brief Best move of a position with a table: the fastest win, a draw, or the slowest loss.
+ *
+ * @param plies Receives the plies to mate after the move for a win or a loss, may be NULL.
+ * @return Result for the player to move as tablebase_probe, TABLEBASE_UNKNOWN if the position
+ * has no table or no legal move.
+ */
+int tablebase_move(const ChessGame* game, ChessMove* move, int* plies) {
+    int result, distance;
+    if (TABLEBASE_UNKNOWN == tablebase_probe(game, &distance))
+        return TABLEBASE_UNKNOWN;
+    ChessGame* copy = malloc(sizeof(ChessGame));
+    if (NULL == copy)
+        return TABLEBASE_UNKNOWN;
+    *copy = *game;
+    ChessMove moves[MAX_GENERATED_MOVES];
+    int count = generate_moves(copy, moves), best = -1, best_score = 0, best_plies = 0;
+    for (int i = 0; i < count; ++i) {
+        make_move(copy, &moves[i], WHITE_PLAYER == copy->currentPlayer, 0);
+        result = tablebase_probe(copy, &distance);
+        // Rank moves: wins first, fastest first; then draws; then losses, slowest first
+        int score = TABLEBASE_LOSS == result ? 1000 - distance : TABLEBASE_DRAW == result ? 0 : -1000 + distance;
+        if (TABLEBASE_UNKNOWN != result && (best < 0 || score > best_score)) {
+            best = i;
+            best_score = score;
+            best_plies = distance + (TABLEBASE_DRAW != result);
+        }
+        unmake_move(copy);
+    }
+    free(copy);
+    if (best < 0)
+        return TABLEBASE_UNKNOWN;
+    *move = moves[best];
+    if (plies)
+        *plies = best_plies;
+    return best_score > 0 ? TABLEBASE_WIN : best_score < 0 ? TABLEBASE_LOSS : TABLEBASE_DRAW;
+}
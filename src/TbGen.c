@@ -0,0 +1,83 @@
+#include <sys/stat.h>
+#include "Resources.h"
+
+#define DEFAULT_TABLEBASE_DIR "tablebases"
+
+static const char* results[] = { "loses", "draws", "wins" };
+
+/*
+ * @brief Print the result and best move of a position from the tables.
+ */
+static int probe(const char* fen, const char* dir) {
+    ChessGame* game = malloc(sizeof(ChessGame));
+    int invalid = NULL == game || 0 != fen_to_chessboard(fen, game);
+    if (invalid || 0 == tablebase_open(dir)) {
+        fprintf(stderr, invalid ? "Invalid FEN.\n" : "No tables in %s.\n", dir);
+        free(game);
+        return EXIT_FAILURE;
+    }
+    ChessMove move;
+    int plies;
+    int result = tablebase_probe(game, &plies);
+    if (TABLEBASE_UNKNOWN == result) {
+        fprintf(stdout, "Not in the tables.\n");
+    } else {
+        const char* player = WHITE_PLAYER == game->currentPlayer ? "White" : "Black";
+        fprintf(stdout, "%s %s", player, results[result]);
+        if (TABLEBASE_DRAW != result)
+            fprintf(stdout, ", mate in %d plies", plies);
+        char text[MOVE_TEXT_SIZE];
+        if (TABLEBASE_UNKNOWN != tablebase_move(game, &move, NULL))
+            fprintf(stdout, ", best move %s", move_to_text(move, text));
+        fprintf(stdout, "\n");
+    }
+    tablebase_close();
+    free(game);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * @brief Usage: tbgen [--dir DIR] [--threads N] [ENDING...] | tbgen [--dir DIR] --probe FEN
+ * @details Build the tables of the endings given (default: KQK KRK KBK KNK KPK) into DIR,
+ * default "tablebases", reporting the time and size of each; or look a position up in them.
+ * Engines use the tables with `--engine tablebases=DIR`.
+ */
+int main(int argc, char* argv[]) {
+    const char* dir = DEFAULT_TABLEBASE_DIR;
+    const char* fen = NULL;
+    const char* names[TABLEBASE_ENDINGS] = { "KQK", "KRK", "KBK", "KNK", "KPK" };
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN), count = 0, all = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--dir") && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--probe") && i + 1 < argc) {
+            fen = argv[++i];
+        } else if ('-' != argv[i][0] && count < TABLEBASE_ENDINGS) {
+            names[count++] = argv[i];
+            all = 0;
+        } else {
+            fprintf(stderr, "Usage: %s [--dir DIR] [--threads N] [ENDING...] | %s [--dir DIR] --probe FEN\n", argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (fen)
+        return probe(fen, dir);
+    mkdir(dir, 0755);
+    count = all ? TABLEBASE_ENDINGS : count;
+
+    TablebaseStats stats;
+    fprintf(stdout, "%-6s %10s %10s %10s %10s %6s %10s %8s\n", "ending", "positions", "wins", "draws", "losses",
+            "mate", "KB", "seconds");
+    for (int i = 0; i < count; ++i) {
+        if (0 != generate_tablebase(names[i], dir, threads, &stats)) {
+            fprintf(stderr, "Failed to build %s in %s.\n", names[i], dir);
+            return EXIT_FAILURE;
+        }
+        fprintf(stdout, "%-6s %10ld %10ld %10ld %10ld %6d %10.1f %8.3f\n", names[i], stats.positions, stats.wins,
+                stats.draws, stats.losses, stats.maxPlies, stats.bytes / 1024.0, stats.seconds);
+    }
+    tablebase_close();
+    return EXIT_SUCCESS;
+}
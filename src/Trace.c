@@ -0,0 +1,320 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "Resources.h"
+
+/*
+ * Event tracer of the command flow, read back with play/tracedump. Each thread records into its
+ * own ring of TRACE_RING_SIZE events, allocated on its first event. The thread is the only writer of
+ * the ring's head and the flusher thread the only writer of its tail, so recording takes no lock:
+ * a clock read, a 16-byte store and a release store of the head. When a ring is full the event is
+ * counted and dropped rather than waiting for the flusher, which writes the count as TRACE_DROPPED.
+ *
+ * The file is a TraceHeader, then a TraceChunk per ring drained, each followed by its events.
+ * Events of one thread are in order; the decoder merges the threads by timestamp.
+ */
+
+#define TRACE_CACHE_LINE 64
+
+typedef struct {
+    TraceEvent event;
+    uint32_t thread;
+    uint32_t order;               // Position in the file, keeps sorting stable
+} TimedEvent;
+
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_SIZE];
+    uint64_t head __attribute__((aligned(TRACE_CACHE_LINE)));   // Written by the thread
+    uint64_t dropped;                                           // Written by the thread
+    uint64_t tail __attribute__((aligned(TRACE_CACHE_LINE)));   // Written by the flusher
+    uint64_t reported;                                          // Drops already written
+    uint32_t thread;
+    struct TraceRing* next;
+} TraceRing;
+
+static __thread TraceRing* thread_ring;
+static __thread uint32_t thread_game;
+static TraceRing* all_rings;
+static uint32_t ring_count;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static int trace_fd = -1;
+static int tracing;              // Set while the flusher runs
+
+/*
+ * @brief The ring of the calling thread, created and registered on its first event.
+ */
+static TraceRing* own_ring(void) {
+    TraceRing* ring;
+    if (0 != posix_memalign((void**) &ring, TRACE_CACHE_LINE, sizeof(TraceRing)))
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    pthread_mutex_lock(&rings_lock);
+    ring->thread = ring_count++;
+    ring->next = all_rings;
+    all_rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * @brief Set the game the calling thread's next events belong to.
+ */
+void trace_set_game(unsigned long id) {
+    thread_game = (uint32_t) id;
+}
+
+/**
+ * @brief Record an event of the calling thread, if tracing was started.
+ *
+ * @param kind TRACE_*
+ * @param command Letter after the '/' of the command, or 0
+ * @param move ChessMove, or the MOVE_* error of TRACE_REJECTED
+ */
+void trace_event(int kind, int command, uint16_t move) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+        return;
+    TraceRing* ring = thread_ring;
+    if (NULL == ring && NULL == (ring = own_ring()))
+        return;
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    TraceEvent* event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    event->tsc = stats_clock();
+    event->game = thread_game;
+    event->kind = (uint8_t) kind;
+    event->command = (char) command;
+    event->move = move;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Record an event of a text command, with its move if it is a /move.
+ */
+void trace_message(int kind, const char* message) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED) || '/' != message[0])
+        return;
+    ChessMove move;
+    uint16_t packed = 0;
+    if (0 == strncmp(message, "/move ", 6) && 0 == parse_move(message + 6, &move))
+        packed = move;
+    trace_event(kind, message[1], packed);
+}
+
+/**
+ * @brief Record an event of a decoded frame, with its move if it is a /move.
+ */
+void trace_frame(int kind, const Frame* frame) {
+    switch (frame->opcode) {
+        case FRAME_MOVE:
+            trace_event(kind, 'm', frame->move);
+            break;
+        case FRAME_FORFEIT:
+            trace_event(kind, 'f', 0);
+            break;
+        case FRAME_NONE:
+            trace_event(kind, 'n', 0);
+            break;
+        default:
+            trace_message(kind, frame->text);
+            break;
+    }
+}
+
+/*
+ * @brief Write the events of a ring recorded since the last drain, and a TRACE_DROPPED event if
+ * any were lost since.
+ */
+static void drain_ring(TraceRing* ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    TraceChunk chunk = { ring->thread, (uint32_t) (head - tail) + (dropped != ring->reported) };
+    if (0 == chunk.count)
+        return;
+
+    TraceEvent lost = { stats_clock(), (uint32_t) (dropped - ring->reported), TRACE_DROPPED, 0, 0 };
+    int start = (int) (tail & (TRACE_RING_SIZE - 1));
+    int first = (int) (head - tail) < TRACE_RING_SIZE - start ? (int) (head - tail) : TRACE_RING_SIZE - start;
+    struct iovec parts[4] = {
+        { &chunk, sizeof(chunk) },
+        { &ring->events[start], first * sizeof(TraceEvent) },
+        { ring->events, (head - tail - first) * sizeof(TraceEvent) },   // Wrapped around the end
+        { &lost, dropped != ring->reported ? sizeof(lost) : 0 },
+    };
+    ssize_t size = 0;
+    for (int i = 0; i < 4; ++i)
+        size += parts[i].iov_len;
+    if (writev(trace_fd, parts, 4) != size) {
+        INFO("Failed to write the trace");
+    }
+    ring->reported = dropped;
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+static void drain_rings(void) {
+    pthread_mutex_lock(&rings_lock);
+    for (TraceRing* ring = all_rings; ring; ring = ring->next)
+        drain_ring(ring);
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void* flush_rings(void* arg) {
+    struct timespec pause = { 0, TRACE_FLUSH_MS * 1000000L };
+    while (__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) {
+        drain_rings();
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start writing the events of every thread to a file, until trace_stop or exit.
+ * @details The file is drained by a background thread every TRACE_FLUSH_MS milliseconds, so a
+ * killed process loses only the last ones.
+ *
+ * @return 0 on success, -1 if the file cannot be created, tracing already runs, or the program
+ * was built without TRACE=1.
+ */
+int trace_start(const char* path) {
+#ifndef CHESS_TRACE
+    INFO("Tracing needs a build with `make TRACE=1`");
+    return -1;
+#endif
+    if (trace_fd >= 0)
+        return -1;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+        return -1;
+    TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceEvent), stats_ticks_per_ns() };
+    if (sizeof(header) != write(trace_fd, &header, sizeof(header))) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    if (0 != pthread_create(&flusher, NULL, flush_rings, NULL)) {
+        __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    atexit(trace_stop);
+    return 0;
+}
+
+/**
+ * @brief Stop tracing, write the events still in the rings and close the file.
+ */
+void trace_stop(void) {
+    if (!__atomic_load_n(&tracing, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    drain_rings();
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+static int compare_events(const void* a, const void* b) {
+    const TimedEvent* x = a;
+    const TimedEvent* y = b;
+    if (x->event.tsc != y->event.tsc)
+        return x->event.tsc < y->event.tsc ? -1 : 1;
+    return x->order < y->order ? -1 : 1;
+}
+
+/*
+ * @brief Name of a command from the letter after its '/'.
+ */
+static const char* command_name(char command) {
+    switch (command) {
+        case 'm': return "/move";
+        case 'f': return "/forfeit";
+        case 'c': return "/chessboard";
+        case 'i': return "/import";
+        case 'l': return "/load";
+        case 's': return "/save";
+        case 'n': return "/none";
+        case 'w': return "/watch";
+        default:  return "?";
+    }
+}
+
+/**
+ * @brief Print a trace file as a timeline: the events of every thread merged by time, each with its
+ * time since the first event, since the previous one, its thread, game, kind and command.
+ *
+ * @param game Only events of this game are printed, all if negative.
+ * @return Number of events printed, -1 if the file cannot be read or is not a trace.
+ */
+long trace_dump(const char* path, FILE* out, long game) {
+    static const char* const kinds[TRACE_KINDS] = {
+        "received", "parsed", "validated", "applied", "sent", "rejected", "dropped",
+    };
+    FILE* in = fopen(path, "r");
+    TraceHeader header;
+    if (NULL == in)
+        return -1;
+    if (1 != fread(&header, sizeof(header), 1, in) || 0 != memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+            || TRACE_VERSION != header.version || sizeof(TraceEvent) != header.eventSize || header.ticksPerNs <= 0.0) {
+        fclose(in);
+        return -1;
+    }
+
+    TimedEvent* events = NULL;
+    long count = 0, capacity = 0;
+    TraceChunk chunk;
+    while (1 == fread(&chunk, sizeof(chunk), 1, in)) {
+        if (count + (long) chunk.count > capacity) {
+            long grown = 2 * capacity > count + (long) chunk.count ? 2 * capacity : count + (long) chunk.count;
+            TimedEvent* more = realloc(events, grown * sizeof(TimedEvent));
+            if (NULL == more)
+                break;
+            events = more;
+            capacity = grown;
+        }
+        uint32_t i = 0;
+        for (; i < chunk.count && 1 == fread(&events[count].event, sizeof(TraceEvent), 1, in); ++i) {
+            events[count].thread = chunk.thread;
+            events[count].order = (uint32_t) count;
+            ++count;
+        }
+        if (i < chunk.count)
+            break;   // Cut short, as by a killed process
+    }
+    fclose(in);
+    qsort(events, count, sizeof(TimedEvent), compare_events);
+
+    long printed = 0;
+    uint64_t first = count > 0 ? events[0].event.tsc : 0, previous = first;
+    fprintf(out, "%12s %10s %6s %8s  %-9s  %s\n", "us", "+us", "thread", "game", "event", "command");
+    for (long i = 0; i < count; ++i) {
+        const TraceEvent* event = &events[i].event;
+        if (game >= 0 && (TRACE_DROPPED == event->kind || (long) event->game != game))
+            continue;
+        char detail[BUFFER_SIZE] = "";
+        if (TRACE_DROPPED == event->kind) {
+            snprintf(detail, sizeof(detail), "%u events lost", event->game);
+        } else if (TRACE_REJECTED == event->kind) {
+            snprintf(detail, sizeof(detail), "%s error %u", command_name(event->command), event->move);
+        } else if ('m' == event->command && TRACE_PARSED != event->kind) {
+            char text[MOVE_TEXT_SIZE];
+            snprintf(detail, sizeof(detail), "/move %s", move_to_text(event->move, text));
+        } else if (0 != event->command) {
+            snprintf(detail, sizeof(detail), "%s", command_name(event->command));
+        }
+        fprintf(out, "%12.3f %10.3f %6u %8u  %-9s  %s\n", (event->tsc - first) / header.ticksPerNs / 1000.0,
+                (event->tsc - previous) / header.ticksPerNs / 1000.0, events[i].thread,
+                TRACE_DROPPED == event->kind ? 0 : event->game, event->kind < TRACE_KINDS ? kinds[event->kind] : "?", detail);
+        previous = event->tsc;
+        ++printed;
+    }
+    free(events);
+    return printed;
+}
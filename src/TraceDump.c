@@ -0,0 +1,19 @@
+#include "Resources.h"
+
+/*
+ * @brief Usage: tracedump <trace file> [game id]
+ * @details Print the events a client or server built with `make TRACE=1` and run with --trace=FILE
+ * recorded, as one timeline, optionally only those of one game.
+ */
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <trace file> [game id]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long game = 3 == argc ? atol(argv[2]) : -1;
+    if (trace_dump(argv[1], stdout, game) < 0) {
+        fprintf(stderr, "%s is not a trace file.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
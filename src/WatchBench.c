@@ -0,0 +1,292 @@
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "Resources.h"
+
+#define BENCH_WAIT_US 5000000   // Longest wait for the observers to catch up once the moves are played
+#define BENCH_DIR_TEMPLATE "/tmp/watchbench.XXXXXX"
+
+static const char* shuffle[4] = { "/move g1f3", "/move g8f6", "/move f3g1", "/move f6g8" };
+
+// Saves the server must refuse: each would split or forge a record of the text database
+static const char* forged_saves[] = {
+    "/save x\nvictim:rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "/save victim:x",
+    "/save tab\tname",
+    "/save line\r",
+    "/save name_longer_than_22_bytes",
+};
+
+typedef struct {
+    int fd;
+    int received;           // Moves received, after the position
+    int positioned;         // The /import of the position arrived
+    int closed;
+    FrameDecoder decoder;
+} Viewer;
+
+static long long sent_at[1 << 20];   // Microseconds at which each move was sent, by ply
+static double* latencies;            // Microseconds from sending a move to an observer decoding it
+static long latency_count;
+
+static double now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void* run_server(void* arg) {
+    (void) arg;
+    run_multi_server(PORT, FSYNC_NONE, NULL);
+    return NULL;
+}
+
+/*
+ * @brief Connect to a port of the server, retrying while it starts.
+ */
+static int connect_port(int port, int receive_buffer) {
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (receive_buffer > 0)
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+        if (0 == connect(fd, (struct sockaddr*) &address, sizeof(address)))
+            return fd;
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+/*
+ * @brief Read every frame that arrived for an observer, timing each move.
+ */
+static void read_viewer(Viewer* viewer) {
+    Frame frame;
+    int n = frame_decoder_read(&viewer->decoder, viewer->fd);
+    if (0 == n || (n < 0 && EAGAIN != errno && EWOULDBLOCK != errno)) {
+        viewer->closed = 1;
+        return;
+    }
+    double now = now_us();
+    while (frame_decoder_next(&viewer->decoder, &frame) > 0) {
+        if (FRAME_MOVE == frame.opcode) {
+            long long sent = __atomic_load_n(&sent_at[viewer->received++], __ATOMIC_ACQUIRE);
+            latencies[latency_count++] = now - sent;
+        } else if (FRAME_FORFEIT == frame.opcode) {
+            viewer->closed = 1;
+        } else {
+            viewer->positioned = 1;
+        }
+    }
+}
+
+typedef struct {
+    int players[2];
+    int moves;
+    int played;
+    double seconds;
+    int finished;
+} PlayerJob;
+
+/*
+ * @brief Play the moves, white and black in turn, each player waiting for the move of the other.
+ */
+static void* play_moves(void* arg) {
+    PlayerJob* job = arg;
+    FrameDecoder decoders[2];
+    char buffer[BUFFER_SIZE];
+    double begin = now_us();
+    frame_decoder_init(&decoders[WHITE_PLAYER]);
+    frame_decoder_init(&decoders[BLACK_PLAYER]);
+    for (; job->played < job->moves; job->played++) {
+        int color = job->played % 2;
+        __atomic_store_n(&sent_at[job->played], (long long) now_us(), __ATOMIC_RELEASE);
+        if (transmit(job->players[color], shuffle[job->played % 4]) < 0
+                || receive_message(job->players[!color], &decoders[!color], buffer) <= 0)
+            break;
+    }
+    job->seconds = (now_us() - begin) / 1e6;
+    __atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * @brief Send saves with forged usernames, then a valid one, and check that only the valid one
+ * reaches the database of the server, ../src/game_database.txt from the directory of the bench.
+ *
+ * @return 0 if every forged save was refused, -1 otherwise.
+ */
+static int check_forged_saves(int white) {
+    for (size_t i = 0; i < sizeof(forged_saves) / sizeof(*forged_saves); ++i)
+        transmit(white, forged_saves[i]);
+    transmit(white, "/save watchbench");   // Saves are committed in order, so this one comes last
+
+    char line[BUFFER_SIZE];
+    int lines = 0, valid = 0;
+    for (double begin = now_us(); 0 == valid && now_us() - begin < BENCH_WAIT_US; usleep(10000)) {
+        FILE* db = fopen("../src/game_database.txt", "r");
+        lines = 0;
+        while (db && NULL != fgets(line, sizeof(line), db)) {
+            lines++;
+            valid += 0 == strncmp(line, "watchbench:", 11);
+        }
+        if (db)
+            fclose(db);
+    }
+    return 1 == valid && 1 == lines ? 0 : -1;
+}
+
+/*
+ * @brief Run the bench in a directory of its own, so the database the server saves to is a new one.
+ *
+ * @param dir Buffer holding BENCH_DIR_TEMPLATE, replaced by the directory made.
+ * @return 0 on success, -1 on failure.
+ */
+static int enter_bench_dir(char* dir) {
+    char path[sizeof(BENCH_DIR_TEMPLATE) + 8];
+    if (NULL == mkdtemp(dir))
+        return -1;
+    snprintf(path, sizeof(path), "%s/src", dir);
+    if (0 != mkdir(path, 0755))
+        return -1;
+    snprintf(path, sizeof(path), "%s/play", dir);
+    if (0 != mkdir(path, 0755))
+        return -1;
+    return chdir(path);
+}
+
+static void remove_bench_dir(const char* dir) {
+    char path[sizeof(BENCH_DIR_TEMPLATE) + 40];
+    const char* files[] = { "src/game_database.txt", "src/game_database.txt.idx", "src", "play", "" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(*files); ++i) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        remove(path);
+    }
+}
+
+/*
+ * @brief Usage: watchbench [viewers] [moves] [slow viewers]
+ * @details Host one game on a --multi server in this process, watched by the given number of
+ * observers, and play moves between two players, each player waiting for the other's move.
+ * Slow viewers watch but never read. Reports moves/s, deliveries/s to observers, the latency
+ * from sending a move to an observer decoding it, and how many slow viewers were dropped.
+ * Then checks that the server refuses /save with usernames that would forge database records.
+ */
+int main(int argc, char* argv[]) {
+    int viewers = argc > 1 ? atoi(argv[1]) : 500;
+    int moves = argc > 2 ? atoi(argv[2]) : 2000;
+    int slow = argc > 3 ? atoi(argv[3]) : 0;
+    if (viewers <= 0 || moves <= 0 || moves > (int) (sizeof(sent_at) / sizeof(*sent_at)) || slow < 0) {
+        fprintf(stderr, "Usage: %s [viewers] [moves] [slow viewers]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char dir[] = BENCH_DIR_TEMPLATE;
+    if (0 != enter_bench_dir(dir)) {
+        perror("watchbench");
+        return EXIT_FAILURE;
+    }
+    set_wire_protocol(WIRE_BINARY);
+    pthread_t server;
+    pthread_create(&server, NULL, run_server, NULL);
+    int players[2] = { connect_port(PORT, 0), -1 };
+    usleep(100000);   // White opens the game before black joins it
+    players[BLACK_PLAYER] = connect_port(PORT, 0);
+    latencies = malloc((size_t) viewers * moves * sizeof(double));
+    Viewer* all = calloc(viewers + slow, sizeof(Viewer));
+    int epollfd = epoll_create1(0);
+    if (players[WHITE_PLAYER] < 0 || players[BLACK_PLAYER] < 0 || NULL == latencies || NULL == all) {
+        fprintf(stderr, "Failed to start the benchmark.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < viewers + slow; ++i) {
+        Viewer* viewer = &all[i];
+        viewer->fd = connect_port(WATCH_PORT, i < viewers ? 0 : 4096);
+        if (viewer->fd < 0) {
+            fprintf(stderr, "Failed to connect observer %d.\n", i);
+            return EXIT_FAILURE;
+        }
+        frame_decoder_init(&viewer->decoder);
+        transmit(viewer->fd, "/watch 0");
+        if (i < viewers) {
+            fcntl(viewer->fd, F_SETFL, fcntl(viewer->fd, F_GETFL, 0) | O_NONBLOCK);
+            struct epoll_event event = { .events = EPOLLIN, .data.ptr = viewer };
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, viewer->fd, &event);
+        }
+    }
+    struct epoll_event events[256];
+    for (int positioned = 0; positioned < viewers; ) {   // Every observer is subscribed before moves start
+        int count = epoll_wait(epollfd, events, 256, 1000);
+        for (int i = 0; i < count; ++i) {
+            Viewer* viewer = events[i].data.ptr;
+            int before = viewer->positioned;
+            read_viewer(viewer);
+            positioned += viewer->positioned - before;
+        }
+        if (count <= 0) {
+            fprintf(stderr, "Observers were not sent the position.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The players move on another thread while this one reads the observers
+    PlayerJob job = { { players[WHITE_PLAYER], players[BLACK_PLAYER] }, moves, 0, 0.0, 0 };
+    pthread_t mover;
+    double begin = now_us();
+    pthread_create(&mover, NULL, play_moves, &job);
+    long expected = (long) viewers * moves, closed = 0;
+    double finished = 0.0;
+    while (latency_count + closed < expected && (0.0 == finished || now_us() - finished < BENCH_WAIT_US)) {
+        if (0.0 == finished && __atomic_load_n(&job.finished, __ATOMIC_ACQUIRE))
+            finished = now_us();
+        int count = epoll_wait(epollfd, events, 256, 100);
+        for (int i = 0; i < count; ++i) {
+            Viewer* viewer = events[i].data.ptr;
+            read_viewer(viewer);
+            if (viewer->closed) {
+                closed += moves - viewer->received;
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, viewer->fd, NULL);
+            }
+        }
+    }
+    double seconds = (now_us() - begin) / 1e6;
+    pthread_join(mover, NULL);
+
+    int dropped = 0;
+    char buffer[BUFFER_SIZE];
+    for (int i = viewers; i < viewers + slow; ++i) {   // A dropped slow viewer reads to the end of its stream
+        fcntl(all[i].fd, F_SETFL, fcntl(all[i].fd, F_GETFL, 0) | O_NONBLOCK);
+        ssize_t n;
+        while ((n = read(all[i].fd, buffer, sizeof(buffer))) > 0)
+            ;
+        dropped += 0 == n;
+    }
+
+    qsort(latencies, latency_count, sizeof(double), compare_doubles);
+    double p50 = latency_count > 0 ? latencies[latency_count / 2] : 0.0;
+    double p99 = latency_count > 0 ? latencies[(long) (latency_count * 0.99)] : 0.0;
+    double max = latency_count > 0 ? latencies[latency_count - 1] : 0.0;
+    fprintf(stdout, "viewers %d  moves %d  %.0f moves/s  %.0f deliveries/s\n",
+            viewers, job.played, job.played / job.seconds, latency_count / seconds);
+    fprintf(stdout, "latency p50 %.1f us  p99 %.1f us  max %.1f us  missed %ld\n",
+            p50, p99, max, expected - latency_count);
+    if (slow > 0)
+        fprintf(stdout, "slow viewers %d  dropped %d\n", slow, dropped);
+
+    int forged = check_forged_saves(players[WHITE_PLAYER]);
+    fprintf(stdout, "forged saves %s\n", 0 == forged ? "refused" : "NOT refused");
+    remove_bench_dir(dir);
+    return 0 == forged ? EXIT_SUCCESS : EXIT_FAILURE;
+}